@@ -68,5 +68,7 @@ bin_path = "/usr4/alg504/cliao25/rebel/outputs/2021-05-03/512/ckpt/epoch0.torchs
 #net = _build_model(device, cfg.env, cfg.model, torch.load("outputs/2021-05-03/15-08-30/ckpt/epoch3.ckpt"))
 cfg.env.random_action_prob = 0
 
-(exploitability,mse_net_traverse,mse_fp_traverse) = cfvpy.rela.compute_stats_with_net(create_mdp_config(cfg.env), str(bin_path))
+(exploitability,mse_net_traverse,mse_fp_traverse,hand_exploitabilities,hands_per_second) = cfvpy.rela.compute_stats_with_net(create_mdp_config(cfg.env), str(bin_path))
 print("Exploitability to leaf : {}".format(exploitability))
+print("Per public hand: {}".format(hand_exploitabilities))
+print("Throughput: {:.1f} hands/s".format(hands_per_second))
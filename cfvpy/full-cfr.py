@@ -15,8 +15,8 @@ import cfvpy.rela
 import cfvpy.utils
 import heyhi
 
-acc = 0
-for i in range(216):
-  acc += cfvpy.rela.compute_full_game_cfr(i, 8192)
+exploitabilities = cfvpy.rela.compute_full_game_cfr_all(8192)
+for i, exploitability in enumerate(exploitabilities):
+  print("Hand: %d\tExploitability: %s" % (i, exploitability))
 
-print("Final exploitability: ", acc/216)
+print("Final exploitability: ", sum(exploitabilities)/216)
@@ -219,6 +219,8 @@ class CFVExp:
                 model.eval()
             ref_models.extend(ref_model)
             model_locker = cfvpy.rela.ModelLocker(ref_model, act_device)
+            if act_device == "cpu" and self.cfg.selfplay.get("cpu_mlp_net"):
+                model_locker.use_mlp_net()
             model_lockers.append(model_locker)
 
         replay_params = dict(
@@ -242,20 +244,49 @@ class CFVExp:
         else:
             policy_replay = None
 
-        context = cfvpy.utils.TimedContext()
+        # Optionally merge the queries of all threads sharing a model locker
+        # into large batches.
+        inference_servers = []
+        server_cfg = self.cfg.selfplay.get("inference_server")
+        if server_cfg:
+            logging.info("Inference server params: %s", server_cfg)
+            for model_locker in model_lockers:
+                inference_servers.append(
+                    cfvpy.rela.InferenceServer(model_locker, replay, **server_cfg)
+                )
+
+        pool_workers = self.cfg.selfplay.get("pool_workers")
+        if pool_workers:
+            logging.info(
+                "Running %d loops on %d pool workers", num_threads, pool_workers
+            )
+            context = cfvpy.utils.TimedContext(pool_workers)
+        else:
+            context = cfvpy.utils.TimedContext()
         cfr_cfg = create_mdp_config(self.cfg.env)
+        num_episodes = self.cfg.selfplay.get("episodes_per_thread") or 1
         for i in range(num_threads):
-            thread = cfvpy.rela.create_cfr_thread(
-                model_lockers[i % len(model_lockers)],
-                replay,
-                cfr_cfg,
-                self.rank * 1000 + i,
-            )
+            if inference_servers:
+                thread = cfvpy.rela.create_cfr_thread(
+                    inference_servers[i % len(inference_servers)],
+                    cfr_cfg,
+                    self.rank * 1000 + i,
+                    num_episodes=num_episodes,
+                )
+            else:
+                thread = cfvpy.rela.create_cfr_thread(
+                    model_lockers[i % len(model_lockers)],
+                    replay,
+                    cfr_cfg,
+                    self.rank * 1000 + i,
+                    num_episodes=num_episodes,
+                )
             context.push_env_thread(thread)
 
         return dict(
             ref_models=ref_models,
             model_lockers=model_lockers,
+            inference_servers=inference_servers,
             replay=replay,
             policy_replay=policy_replay,
             context=context,
@@ -579,13 +610,23 @@ class CFVExp:
                         exploitability,
                         mse_net_traverse,
                         mse_fp_traverse,
+                        hand_exploitabilities,
+                        hands_per_second,
                     ) = cfvpy.rela.compute_stats_with_net(
-                        create_mdp_config(self.cfg.env), str(bin_path)
+                        create_mdp_config(self.cfg.env),
+                        str(bin_path),
+                        num_threads=self.cfg.get("exploit_num_threads", 0),
                     )
                     logging.info(
-                        "Exploitability to leaf (epoch=%d): %f", epoch, exploitability
+                        "Exploitability to leaf (epoch=%d): %f (max over hands %f, %.1f hands/s)",
+                        epoch,
+                        exploitability,
+                        max(hand_exploitabilities),
+                        hands_per_second,
                     )
                     metrics["exploitability_last"] = exploitability
+                    metrics["exploitability_max_hand"] = max(hand_exploitabilities)
+                    metrics["bps/exploit_hands"] = hands_per_second
                     metrics["eval_mse/net_reach"] = mse_net_traverse
                     metrics["eval_mse/fp_reach"] = mse_fp_traverse
 
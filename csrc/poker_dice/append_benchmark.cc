@@ -0,0 +1,240 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Times concurrent appends of small blocks to the replay storage with 1 to 64
+// producer threads, as many data loops do during generation, while a consumer
+// keeps popping the oldest rows. Compares ConcurrentQueue with the locked
+// commit protocol it used before, where every producer waits for the slower
+// producers that reserved slots ahead of it.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "rela/prioritized_replay.h"
+
+using namespace rela;
+
+namespace {
+
+struct Timer {
+  std::chrono::time_point<std::chrono::system_clock> start =
+      std::chrono::system_clock::now();
+
+  double tick() {
+    const auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    return diff.count();
+  }
+};
+
+// The append and pop paths of ConcurrentQueue before the ticket ring. The
+// lock is taken twice per block, and blocks are committed in the order they
+// were reserved.
+class LockedQueue {
+ public:
+  explicit LockedQueue(int capacity)
+      : capacity(capacity), weights_(capacity, 0) {}
+
+  int safeSize(float* sum) const {
+    std::unique_lock<std::mutex> lk(m_);
+    if (sum != nullptr) {
+      *sum = sum_;
+    }
+    return safeSize_;
+  }
+
+  int size() const {
+    std::unique_lock<std::mutex> lk(m_);
+    return size_;
+  }
+
+  void blockAppend(const ValueTransition& block, const torch::Tensor& weights) {
+    const std::vector<torch::Tensor> blockColumns = block.toVector();
+    int blockSize = weights.size(0);
+
+    std::unique_lock<std::mutex> lk(m_);
+    cvSize_.wait(lk, [=] { return size_ + blockSize <= capacity; });
+    if (columns_.empty()) {
+      for (const auto& column : blockColumns) {
+        auto shape = column.sizes().vec();
+        shape[0] = capacity;
+        columns_.push_back(torch::empty(shape, column.options()));
+      }
+    }
+    int start = tail_;
+    int end = (tail_ + blockSize) % capacity;
+    tail_ = end;
+    size_ += blockSize;
+    lk.unlock();
+
+    for (size_t c = 0; c < columns_.size(); ++c) {
+      const int firstPart = std::min(blockSize, capacity - start);
+      columns_[c].narrow(0, start, firstPart)
+          .copy_(blockColumns[c].narrow(0, 0, firstPart));
+      if (firstPart < blockSize) {
+        columns_[c].narrow(0, 0, blockSize - firstPart)
+            .copy_(blockColumns[c].narrow(0, firstPart, blockSize - firstPart));
+      }
+    }
+    float sum = 0;
+    auto weightAcc = weights.accessor<float, 1>();
+    for (int i = 0; i < blockSize; ++i) {
+      weights_[(start + i) % capacity] = weightAcc[i];
+      sum += weightAcc[i];
+    }
+
+    lk.lock();
+    cvTail_.wait(lk, [=] { return safeTail_ == start; });
+    safeTail_ = end;
+    safeSize_ += blockSize;
+    sum_ += sum;
+    lk.unlock();
+    cvTail_.notify_all();
+  }
+
+  void blockPop(int blockSize) {
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      for (int i = 0; i < blockSize; ++i) {
+        sum_ -= weights_[head_];
+        head_ = (head_ + 1) % capacity;
+      }
+      safeSize_ -= blockSize;
+      size_ -= blockSize;
+    }
+    cvSize_.notify_all();
+  }
+
+  const int capacity;
+
+ private:
+  mutable std::mutex m_;
+  std::condition_variable cvSize_;
+  std::condition_variable cvTail_;
+  int head_ = 0;
+  int tail_ = 0;
+  int size_ = 0;
+  int safeTail_ = 0;
+  int safeSize_ = 0;
+  double sum_ = 0;
+  std::vector<torch::Tensor> columns_;
+  std::vector<float> weights_;
+};
+
+// Returns appended rows per second. Every producer appends num_blocks blocks
+// of block_size rows. The consumer pops everything above `keep` rows of the
+// safe prefix, like the samplers of PrioritizedReplay.
+template <class Queue>
+double run(int num_producers, int num_blocks, int block_size, int query_size,
+           int values_size) {
+  const int keep = 1 << 14;
+  Queue queue(2 * keep);
+  const ValueTransition block(torch::zeros({block_size, query_size}),
+                              torch::zeros({block_size, values_size}));
+  const auto weights = torch::ones({block_size}, torch::kFloat32);
+
+  std::atomic<int> num_done(0);
+  std::thread consumer([&] {
+    while (num_done < num_producers) {
+      const int size = queue.safeSize(nullptr);
+      if (size > keep) {
+        queue.blockPop(size - keep);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  Timer t;
+  std::vector<std::thread> producers;
+  for (int p = 0; p < num_producers; ++p) {
+    producers.emplace_back([&] {
+      for (int i = 0; i < num_blocks; ++i) {
+        queue.blockAppend(block, weights);
+      }
+      ++num_done;
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  const double secs = t.tick();
+  consumer.join();
+  return double(num_producers) * num_blocks * block_size / secs;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int max_producers = 64;
+  int num_rows = 1 << 20;
+  int block_size = 2;
+  int query_size = 8;
+  int values_size = 36;
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--max_producers") {
+        assert(i + 1 < argc);
+        max_producers = std::stoi(argv[++i]);
+      } else if (arg == "--num_rows") {
+        assert(i + 1 < argc);
+        num_rows = std::stoi(argv[++i]);
+      } else if (arg == "--block_size") {
+        assert(i + 1 < argc);
+        block_size = std::stoi(argv[++i]);
+      } else if (arg == "--query_size") {
+        assert(i + 1 < argc);
+        query_size = std::stoi(argv[++i]);
+      } else {
+        std::cerr << "Unknown flag: " << arg << "\n";
+        return -1;
+      }
+    }
+  }
+
+  // Producers only contend for the ring if they run at the same time. With
+  // more threads than cores they take turns, and the numbers mostly measure
+  // the scheduler.
+  const int num_cores = std::thread::hardware_concurrency();
+  std::cout << "rows=" << num_rows << " block_size=" << block_size
+            << " cores=" << num_cores << "\n";
+  if (num_cores < 5) {
+    std::cout << "WARNING: fewer than 5 cores, runs with 4 producers and the "
+                 "consumer do not measure contention\n";
+  }
+  for (int num_producers = 1; num_producers <= max_producers;
+       num_producers *= 2) {
+    const int num_blocks = std::max(1, num_rows / block_size / num_producers);
+    const double locked = run<LockedQueue>(num_producers, num_blocks,
+                                           block_size, query_size, values_size);
+    const double ticket = run<ConcurrentQueue<ValueTransition>>(
+        num_producers, num_blocks, block_size, query_size, values_size);
+    std::cout << "producers=" << num_producers << " locked: " << locked / 1e6
+              << "M rows/s ticket_ring: " << ticket / 1e6 << "M rows/s ("
+              << ticket / locked << "x)"
+              << (num_producers + 1 > num_cores ? " oversubscribed" : "")
+              << "\n";
+  }
+}
@@ -0,0 +1,463 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cfr_kernels.h"
+
+#include <assert.h>
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "util.h"
+
+namespace poker_dice {
+
+namespace {
+
+// Writes `row` normalized the same way normalize_probabilities does to `out`.
+// `out` may alias `row`.
+template <class R, class T>
+inline void normalize_row(const R* row, int num_actions, T* out) {
+  double sum = 0;
+  for (int a = 0; a < num_actions; ++a) {
+    sum += row[a];
+  }
+  assert(sum >= kAlmostZero);
+  for (int a = 0; a < num_actions; ++a) {
+    out[a] = row[a] / sum;
+  }
+}
+
+// The vectorized kernels handle nodes with exactly three actions, all of them
+// legal, which is every non-final node of poker dice but the max-bid one.
+// Each lane holds one hand; Lanes::load and Lanes::store convert between the
+// [hand, action] layout and one vector per action.
+
+#if defined(__AVX512F__)
+
+struct Avx512Lanes {
+  using Vec = __m512d;
+  static constexpr int kWidth = 8;
+
+  // v0 = [a0 b0 c0 a1 b1 c1 a2 b2], v1 = [c2 a3 b3 c3 a4 b4 c4 a5],
+  // v2 = [b5 c5 a6 b6 c6 a7 b7 c7]. Each output takes two permutes: the first
+  // picks from two of the inputs (indices 8-15 select the second one), the
+  // second fills the remaining lanes from the third.
+  static Vec pick(Vec x, Vec y, Vec z, __m512i xy, __m512i tz) {
+    return _mm512_permutex2var_pd(_mm512_permutex2var_pd(x, xy, y), tz, z);
+  }
+  static void load(const double* p, Vec* a, Vec* b, Vec* c) {
+    const Vec v0 = _mm512_loadu_pd(p);
+    const Vec v1 = _mm512_loadu_pd(p + 8);
+    const Vec v2 = _mm512_loadu_pd(p + 16);
+    *a = pick(v0, v1, v2, _mm512_setr_epi64(0, 3, 6, 9, 12, 15, 0, 0),
+              _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 10, 13));
+    *b = pick(v0, v1, v2, _mm512_setr_epi64(1, 4, 7, 10, 13, 0, 0, 0),
+              _mm512_setr_epi64(0, 1, 2, 3, 4, 8, 11, 14));
+    *c = pick(v0, v1, v2, _mm512_setr_epi64(2, 5, 8, 11, 14, 0, 0, 0),
+              _mm512_setr_epi64(0, 1, 2, 3, 4, 9, 12, 15));
+  }
+  static void store(double* p, Vec a, Vec b, Vec c) {
+    _mm512_storeu_pd(
+        p, pick(a, b, c, _mm512_setr_epi64(0, 8, 0, 1, 9, 0, 2, 10),
+                _mm512_setr_epi64(0, 1, 8, 3, 4, 9, 6, 7)));
+    _mm512_storeu_pd(
+        p + 8, pick(a, b, c, _mm512_setr_epi64(0, 3, 11, 0, 4, 12, 0, 5),
+                    _mm512_setr_epi64(10, 1, 2, 11, 4, 5, 12, 7)));
+    _mm512_storeu_pd(
+        p + 16, pick(a, b, c, _mm512_setr_epi64(13, 0, 6, 14, 0, 7, 15, 0),
+                     _mm512_setr_epi64(0, 13, 2, 3, 14, 5, 6, 15)));
+  }
+  static Vec load_hands(const double* p) { return _mm512_loadu_pd(p); }
+  static Vec set1(double x) { return _mm512_set1_pd(x); }
+  static Vec add(Vec x, Vec y) { return _mm512_add_pd(x, y); }
+  static Vec mul(Vec x, Vec y) { return _mm512_mul_pd(x, y); }
+  static Vec div(Vec x, Vec y) { return _mm512_div_pd(x, y); }
+  // x < y ? y : x, like std::max.
+  static Vec max(Vec x, Vec y) {
+    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, y, _CMP_LT_OQ), x, y);
+  }
+  // x > 0 ? pos : neg.
+  static Vec select_positive(Vec x, Vec pos, Vec neg) {
+    const __mmask8 mask =
+        _mm512_cmp_pd_mask(x, _mm512_setzero_pd(), _CMP_GT_OQ);
+    return _mm512_mask_blend_pd(mask, neg, pos);
+  }
+};
+
+#endif
+
+#if defined(__AVX2__)
+
+struct Avx2Lanes {
+  using Vec = __m256d;
+  static constexpr int kWidth = 4;
+
+  // v0 = [a0 b0 c0 a1], v1 = [b1 c1 a2 b2], v2 = [c2 a3 b3 c3].
+  static void load(const double* p, Vec* a, Vec* b, Vec* c) {
+    const Vec v0 = _mm256_loadu_pd(p);
+    const Vec v1 = _mm256_loadu_pd(p + 4);
+    const Vec v2 = _mm256_loadu_pd(p + 8);
+    *a = _mm256_permute4x64_pd(
+        _mm256_blend_pd(_mm256_blend_pd(v0, v1, 0b0100), v2, 0b0010),
+        _MM_SHUFFLE(1, 2, 3, 0));
+    *b = _mm256_permute4x64_pd(
+        _mm256_blend_pd(_mm256_blend_pd(v1, v0, 0b0010), v2, 0b0100),
+        _MM_SHUFFLE(2, 3, 0, 1));
+    *c = _mm256_permute4x64_pd(
+        _mm256_blend_pd(_mm256_blend_pd(v2, v1, 0b0010), v0, 0b0100),
+        _MM_SHUFFLE(3, 0, 1, 2));
+  }
+  static void store(double* p, Vec a, Vec b, Vec c) {
+    const Vec ta = _mm256_permute4x64_pd(a, _MM_SHUFFLE(1, 2, 3, 0));
+    const Vec tb = _mm256_permute4x64_pd(b, _MM_SHUFFLE(2, 3, 0, 1));
+    const Vec tc = _mm256_permute4x64_pd(c, _MM_SHUFFLE(3, 0, 1, 2));
+    _mm256_storeu_pd(
+        p, _mm256_blend_pd(_mm256_blend_pd(ta, tb, 0b0010), tc, 0b0100));
+    _mm256_storeu_pd(
+        p + 4, _mm256_blend_pd(_mm256_blend_pd(tb, tc, 0b0010), ta, 0b0100));
+    _mm256_storeu_pd(
+        p + 8, _mm256_blend_pd(_mm256_blend_pd(tc, ta, 0b0010), tb, 0b0100));
+  }
+  static Vec load_hands(const double* p) { return _mm256_loadu_pd(p); }
+  static Vec set1(double x) { return _mm256_set1_pd(x); }
+  static Vec add(Vec x, Vec y) { return _mm256_add_pd(x, y); }
+  static Vec mul(Vec x, Vec y) { return _mm256_mul_pd(x, y); }
+  static Vec div(Vec x, Vec y) { return _mm256_div_pd(x, y); }
+  // x < y ? y : x, like std::max.
+  static Vec max(Vec x, Vec y) {
+    return _mm256_blendv_pd(x, y, _mm256_cmp_pd(x, y, _CMP_LT_OQ));
+  }
+  // x > 0 ? pos : neg.
+  static Vec select_positive(Vec x, Vec pos, Vec neg) {
+    return _mm256_blendv_pd(neg, pos,
+                            _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_GT_OQ));
+  }
+};
+
+#endif
+
+#if defined(__AVX2__)
+
+constexpr int kVectorizedNumActions = 3;
+
+bool can_vectorize(int num_actions, int action_begin, int action_end) {
+  return num_actions == kVectorizedNumActions && action_begin == 0 &&
+         action_end == kVectorizedNumActions;
+}
+
+// Returns the number of hands processed.
+template <class Lanes>
+int regret_matching_lanes(const double* regrets, int num_hands, double eps,
+                          double* strategy) {
+  const typename Lanes::Vec veps = Lanes::set1(eps);
+  int hand = 0;
+  for (; hand + Lanes::kWidth <= num_hands; hand += Lanes::kWidth) {
+    const int offset = hand * kVectorizedNumActions;
+    typename Lanes::Vec a, b, c;
+    Lanes::load(regrets + offset, &a, &b, &c);
+    a = Lanes::max(a, veps);
+    b = Lanes::max(b, veps);
+    c = Lanes::max(c, veps);
+    const typename Lanes::Vec sum = Lanes::add(Lanes::add(a, b), c);
+    Lanes::store(strategy + offset, Lanes::div(a, sum), Lanes::div(b, sum),
+                 Lanes::div(c, sum));
+  }
+  return hand;
+}
+
+// Returns the number of hands processed.
+template <class Lanes>
+int discount_and_accumulate_lanes(double* regrets, double* sum_strategies,
+                                  double* average_strategies,
+                                  const double* strategy,
+                                  const double* reaches, int num_hands,
+                                  double pos_discount, double neg_discount,
+                                  double strat_discount) {
+  const typename Lanes::Vec pos = Lanes::set1(pos_discount);
+  const typename Lanes::Vec neg = Lanes::set1(neg_discount);
+  const typename Lanes::Vec discount = Lanes::set1(strat_discount);
+  int hand = 0;
+  for (; hand + Lanes::kWidth <= num_hands; hand += Lanes::kWidth) {
+    const int offset = hand * kVectorizedNumActions;
+    typename Lanes::Vec ra, rb, rc;
+    Lanes::load(regrets + offset, &ra, &rb, &rc);
+    ra = Lanes::mul(ra, Lanes::select_positive(ra, pos, neg));
+    rb = Lanes::mul(rb, Lanes::select_positive(rb, pos, neg));
+    rc = Lanes::mul(rc, Lanes::select_positive(rc, pos, neg));
+    Lanes::store(regrets + offset, ra, rb, rc);
+
+    const typename Lanes::Vec reach = Lanes::load_hands(reaches + hand);
+    typename Lanes::Vec sa, sb, sc, la, lb, lc;
+    Lanes::load(sum_strategies + offset, &sa, &sb, &sc);
+    Lanes::load(strategy + offset, &la, &lb, &lc);
+    sa = Lanes::add(Lanes::mul(sa, discount), Lanes::mul(reach, la));
+    sb = Lanes::add(Lanes::mul(sb, discount), Lanes::mul(reach, lb));
+    sc = Lanes::add(Lanes::mul(sc, discount), Lanes::mul(reach, lc));
+    Lanes::store(sum_strategies + offset, sa, sb, sc);
+
+    const typename Lanes::Vec sum = Lanes::add(Lanes::add(sa, sb), sc);
+    Lanes::store(average_strategies + offset, Lanes::div(sa, sum),
+                 Lanes::div(sb, sum), Lanes::div(sc, sum));
+  }
+  return hand;
+}
+
+// Runs the widest lanes first and narrower ones on the remaining hands, e.g.
+// 36 hands are 4 blocks of 8 plus one block of 4 with AVX-512.
+int regret_matching_vectorized(const double* regrets, int num_hands,
+                               double eps, double* strategy) {
+  int done = 0;
+#if defined(__AVX512F__)
+  done = regret_matching_lanes<Avx512Lanes>(regrets, num_hands, eps, strategy);
+#endif
+  const int offset = done * kVectorizedNumActions;
+  return done + regret_matching_lanes<Avx2Lanes>(
+                    regrets + offset, num_hands - done, eps, strategy + offset);
+}
+
+int discount_and_accumulate_vectorized(
+    double* regrets, double* sum_strategies, double* average_strategies,
+    const double* strategy, const double* reaches, int num_hands,
+    double pos_discount, double neg_discount, double strat_discount) {
+  int done = 0;
+#if defined(__AVX512F__)
+  done = discount_and_accumulate_lanes<Avx512Lanes>(
+      regrets, sum_strategies, average_strategies, strategy, reaches,
+      num_hands, pos_discount, neg_discount, strat_discount);
+#endif
+  const int offset = done * kVectorizedNumActions;
+  return done + discount_and_accumulate_lanes<Avx2Lanes>(
+                    regrets + offset, sum_strategies + offset,
+                    average_strategies + offset, strategy + offset,
+                    reaches + done, num_hands - done, pos_discount,
+                    neg_discount, strat_discount);
+}
+
+#endif
+
+}  // namespace
+
+template <class R, class T>
+void regret_matching_scalar(const R* regrets, int num_hands, int num_actions,
+                            int action_begin, int action_end, double eps,
+                            T* strategy) {
+  for (int hand = 0; hand < num_hands; ++hand) {
+    const R* hand_regrets = regrets + hand * num_actions;
+    T* hand_strategy = strategy + hand * num_actions;
+    // Clipping in double keeps eps for float regrets and strategies.
+    double sum = 0;
+    for (int action = action_begin; action < action_end; ++action) {
+      sum += std::max<double>(hand_regrets[action], eps);
+    }
+    assert(sum >= kAlmostZero);
+    for (int action = action_begin; action < action_end; ++action) {
+      hand_strategy[action] = std::max<double>(hand_regrets[action], eps) / sum;
+    }
+  }
+}
+
+template <class R, class T>
+void discount_and_accumulate_scalar(
+    R* regrets, R* sum_strategies, T* average_strategies, const T* strategy,
+    const T* reaches, int num_hands, int num_actions, int action_begin,
+    int action_end, double pos_discount, double neg_discount,
+    double strat_discount) {
+  for (int hand = 0; hand < num_hands; ++hand) {
+    const int offset = hand * num_actions;
+    R* hand_regrets = regrets + offset;
+    R* hand_sum_strategies = sum_strategies + offset;
+    for (int a = action_begin; a < action_end; ++a) {
+      hand_regrets[a] *= hand_regrets[a] > 0 ? pos_discount : neg_discount;
+    }
+    for (int a = action_begin; a < action_end; ++a) {
+      hand_sum_strategies[a] *= strat_discount;
+    }
+    for (int a = action_begin; a < action_end; ++a) {
+      hand_sum_strategies[a] += static_cast<R>(reaches[hand]) *
+                                static_cast<R>(strategy[offset + a]);
+    }
+    normalize_row(hand_sum_strategies, num_actions,
+                  average_strategies + offset);
+  }
+}
+
+template <class R, class T>
+void normalize_action_major(const R* unnormed, const R* last, int num_hands,
+                            int num_actions, T* probs) {
+  constexpr int kChunk = 64;
+  double sums[kChunk], last_sums[kChunk];
+  for (int begin = 0; begin < num_hands; begin += kChunk) {
+    const int size = std::min(kChunk, num_hands - begin);
+    std::fill_n(sums, size, 0.0);
+    for (int a = 0; a < num_actions; ++a) {
+      const R* row = unnormed + a * num_hands + begin;
+      for (int h = 0; h < size; ++h) {
+        sums[h] += row[h];
+      }
+    }
+    if (last != nullptr) {
+      std::fill_n(last_sums, size, 0.0);
+      for (int a = 0; a < num_actions; ++a) {
+        const R* row = last + a * num_hands + begin;
+        for (int h = 0; h < size; ++h) {
+          last_sums[h] += row[h];
+        }
+      }
+      for (int h = 0; h < size; ++h) {
+        sums[h] += last_sums[h];
+      }
+    }
+    for (int h = 0; h < size; ++h) {
+      assert(sums[h] >= kAlmostZero);
+    }
+    for (int a = 0; a < num_actions; ++a) {
+      const int offset = a * num_hands + begin;
+      if (last != nullptr) {
+        for (int h = 0; h < size; ++h) {
+          probs[offset + h] =
+              (unnormed[offset + h] + last[offset + h]) / sums[h];
+        }
+      } else {
+        for (int h = 0; h < size; ++h) {
+          probs[offset + h] = unnormed[offset + h] / sums[h];
+        }
+      }
+    }
+  }
+}
+
+template <class R, class T>
+void regret_matching_action_major(const R* regrets, int num_hands,
+                                  int /*num_actions*/, int action_begin,
+                                  int action_end, double eps, T* strategy) {
+  constexpr int kChunk = 64;
+  double sums[kChunk];
+  for (int begin = 0; begin < num_hands; begin += kChunk) {
+    const int size = std::min(kChunk, num_hands - begin);
+    std::fill_n(sums, size, 0.0);
+    for (int a = action_begin; a < action_end; ++a) {
+      const R* row = regrets + a * num_hands + begin;
+      for (int h = 0; h < size; ++h) {
+        sums[h] += std::max<double>(row[h], eps);
+      }
+    }
+    for (int h = 0; h < size; ++h) {
+      assert(sums[h] >= kAlmostZero);
+    }
+    for (int a = action_begin; a < action_end; ++a) {
+      const R* row = regrets + a * num_hands + begin;
+      T* out = strategy + a * num_hands + begin;
+      for (int h = 0; h < size; ++h) {
+        out[h] = std::max<double>(row[h], eps) / sums[h];
+      }
+    }
+  }
+}
+
+template <class R, class T>
+void discount_and_accumulate_action_major(
+    R* regrets, R* sum_strategies, T* average_strategies, const T* strategy,
+    const T* reaches, int num_hands, int num_actions, int action_begin,
+    int action_end, double pos_discount, double neg_discount,
+    double strat_discount) {
+  for (int a = action_begin; a < action_end; ++a) {
+    const int offset = a * num_hands;
+    R* row_regrets = regrets + offset;
+    R* row_sums = sum_strategies + offset;
+    const T* row_strategy = strategy + offset;
+    for (int h = 0; h < num_hands; ++h) {
+      row_regrets[h] *= row_regrets[h] > 0 ? pos_discount : neg_discount;
+    }
+    for (int h = 0; h < num_hands; ++h) {
+      row_sums[h] *= strat_discount;
+    }
+    for (int h = 0; h < num_hands; ++h) {
+      row_sums[h] +=
+          static_cast<R>(reaches[h]) * static_cast<R>(row_strategy[h]);
+    }
+  }
+  normalize_action_major(sum_strategies, static_cast<const R*>(nullptr),
+                         num_hands, num_actions, average_strategies);
+}
+
+#define INSTANTIATE_CFR_KERNELS(R, T)                                         \
+  template void regret_matching_scalar<R, T>(const R*, int, int, int, int,    \
+                                             double, T*);                     \
+  template void discount_and_accumulate_scalar<R, T>(                         \
+      R*, R*, T*, const T*, const T*, int, int, int, int, double, double,     \
+      double);                                                                \
+  template void regret_matching_action_major<R, T>(const R*, int, int, int,   \
+                                                   int, double, T*);          \
+  template void discount_and_accumulate_action_major<R, T>(                   \
+      R*, R*, T*, const T*, const T*, int, int, int, int, double, double,     \
+      double);                                                                \
+  template void normalize_action_major<R, T>(const R*, const R*, int, int,    \
+                                             T*);
+
+INSTANTIATE_CFR_KERNELS(double, double)
+INSTANTIATE_CFR_KERNELS(float, float)
+INSTANTIATE_CFR_KERNELS(double, float)
+
+#undef INSTANTIATE_CFR_KERNELS
+
+void regret_matching(const double* regrets, int num_hands, int num_actions,
+                     int action_begin, int action_end, double eps,
+                     double* strategy) {
+  int done = 0;
+#if defined(__AVX2__)
+  if (can_vectorize(num_actions, action_begin, action_end)) {
+    done = regret_matching_vectorized(regrets, num_hands, eps, strategy);
+  }
+#endif
+  const int offset = done * num_actions;
+  regret_matching_scalar(regrets + offset, num_hands - done, num_actions,
+                         action_begin, action_end, eps, strategy + offset);
+}
+
+void discount_and_accumulate(double* regrets, double* sum_strategies,
+                             double* average_strategies,
+                             const double* strategy, const double* reaches,
+                             int num_hands, int num_actions, int action_begin,
+                             int action_end, double pos_discount,
+                             double neg_discount, double strat_discount) {
+  int done = 0;
+#if defined(__AVX2__)
+  if (can_vectorize(num_actions, action_begin, action_end)) {
+    done = discount_and_accumulate_vectorized(
+        regrets, sum_strategies, average_strategies, strategy, reaches,
+        num_hands, pos_discount, neg_discount, strat_discount);
+  }
+#endif
+  const int offset = done * num_actions;
+  discount_and_accumulate_scalar(
+      regrets + offset, sum_strategies + offset, average_strategies + offset,
+      strategy + offset, reaches + done, num_hands - done, num_actions,
+      action_begin, action_end, pos_discount, neg_discount, strat_discount);
+}
+
+const char* cfr_kernels_isa() {
+#if defined(__AVX512F__)
+  return "avx512";
+#elif defined(__AVX2__)
+  return "avx2";
+#else
+  return "scalar";
+#endif
+}
+
+}  // namespace poker_dice
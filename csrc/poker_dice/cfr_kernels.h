@@ -0,0 +1,85 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+Per-node kernels for the CFR strategy update.
+
+All arrays are the block of one node of a HandMajor strategy, i.e.,
+[num_hands, num_actions] (or [num_hands] for reaches). Only actions in
+[action_begin, action_end) are updated. The default entry points use AVX-512
+or AVX2 lanes across hands when the build targets them and fall back to the
+scalar versions otherwise. The *_action_major variants take
+[num_actions, num_hands] blocks of an ActionMajor strategy; their loops run
+over contiguous hands and are left to the compiler to vectorize.
+*/
+
+#pragma once
+
+namespace poker_dice {
+
+// strategy[h][a] := max(regrets[h][a], eps) normalized over the actions.
+void regret_matching(const double* regrets, int num_hands, int num_actions,
+                     int action_begin, int action_end, double eps,
+                     double* strategy);
+
+// For every hand:
+//   regrets[h][a] *= regrets[h][a] > 0 ? pos_discount : neg_discount;
+//   sum_strategies[h][a] = sum_strategies[h][a] * strat_discount +
+//                          reaches[h] * strategy[h][a];
+//   average_strategies[h] := normalized(sum_strategies[h]).
+void discount_and_accumulate(double* regrets, double* sum_strategies,
+                             double* average_strategies,
+                             const double* strategy, const double* reaches,
+                             int num_hands, int num_actions, int action_begin,
+                             int action_end, double pos_discount,
+                             double neg_discount, double strat_discount);
+
+// Scalar reference implementations. These and the *_action_major variants
+// are templates over the type of the regrets and sums (R) and of the
+// strategies and reaches (T). They are instantiated for <double, double>,
+// <float, float>, and <double, float>. Probabilities are normalized in double
+// for all of them, so eps is not lost to float underflow.
+template <class R, class T>
+void regret_matching_scalar(const R* regrets, int num_hands, int num_actions,
+                            int action_begin, int action_end, double eps,
+                            T* strategy);
+template <class R, class T>
+void discount_and_accumulate_scalar(
+    R* regrets, R* sum_strategies, T* average_strategies, const T* strategy,
+    const T* reaches, int num_hands, int num_actions, int action_begin,
+    int action_end, double pos_discount, double neg_discount,
+    double strat_discount);
+
+template <class R, class T>
+void regret_matching_action_major(const R* regrets, int num_hands,
+                                  int num_actions, int action_begin,
+                                  int action_end, double eps, T* strategy);
+template <class R, class T>
+void discount_and_accumulate_action_major(
+    R* regrets, R* sum_strategies, T* average_strategies, const T* strategy,
+    const T* reaches, int num_hands, int num_actions, int action_begin,
+    int action_end, double pos_discount, double neg_discount,
+    double strat_discount);
+
+// probs[a][h] := (unnormed[a][h] + last[a][h]) / sum_a'(...) for
+// [num_actions, num_hands] blocks. `last` may be null. Sums are accumulated
+// in the same order as normalize_probabilities. `probs` may alias `unnormed`.
+template <class R, class T>
+void normalize_action_major(const R* unnormed, const R* last, int num_hands,
+                            int num_actions, T* probs);
+
+// Name of the instruction set used by the default entry points.
+const char* cfr_kernels_isa();
+
+}  // namespace poker_dice
@@ -0,0 +1,151 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the scalar and vectorized CFR update kernels on a tree-sized
+// block of nodes using linear CFR and DCFR discounts.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "cfr_kernels.h"
+#include "poker_dice.h"
+#include "tree_strategy.h"
+
+using namespace poker_dice;
+
+namespace {
+
+struct Timer {
+  std::chrono::time_point<std::chrono::system_clock> start =
+      std::chrono::system_clock::now();
+
+  double tick() {
+    const auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    return diff.count();
+  }
+};
+
+struct Discounts {
+  std::string name;
+  double pos, neg, strat;
+};
+
+struct Buffers {
+  FlatTreeStrategy regrets, last, sum, average;
+  std::vector<double> reaches;
+};
+
+Buffers make_buffers(int num_nodes, int num_hands, int num_actions) {
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<double> dist(-1, 1);
+  Buffers b;
+  b.regrets = FlatTreeStrategy(num_nodes, num_hands, num_actions);
+  b.sum = FlatTreeStrategy(num_nodes, num_hands, num_actions);
+  b.last = FlatTreeStrategy(num_nodes, num_hands, num_actions);
+  b.average = FlatTreeStrategy(num_nodes, num_hands, num_actions);
+  const size_t total =
+      static_cast<size_t>(num_nodes) * num_hands * num_actions;
+  for (size_t i = 0; i < total; ++i) {
+    b.regrets.data()[i] = dist(gen);
+    b.sum.data()[i] = std::abs(dist(gen));
+  }
+  b.reaches.resize(static_cast<size_t>(num_nodes) * num_hands);
+  for (auto& r : b.reaches) r = std::abs(dist(gen));
+  return b;
+}
+
+// Runs `num_iters` CFR updates over every node and returns seconds per
+// iteration.
+template <class RegretMatching, class Accumulate>
+double run(Buffers* b, int num_iters, const Discounts& d,
+           RegretMatching regret_matching_fn, Accumulate accumulate_fn) {
+  const int num_nodes = b->regrets.num_nodes();
+  const int num_hands = b->regrets.num_hands();
+  const int num_actions = b->regrets.num_actions();
+  Timer t;
+  for (int iter = 0; iter < num_iters; ++iter) {
+    for (int node = 0; node < num_nodes; ++node) {
+      regret_matching_fn(b->regrets[node].data(), num_hands, num_actions, 0,
+                         num_actions, 1e-9, b->last[node].data());
+    }
+    for (int node = 0; node < num_nodes; ++node) {
+      accumulate_fn(b->regrets[node].data(), b->sum[node].data(),
+                    b->average[node].data(), b->last[node].data(),
+                    b->reaches.data() + node * num_hands, num_hands,
+                    num_actions, 0, num_actions, d.pos, d.neg, d.strat);
+    }
+  }
+  return t.tick() / num_iters;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int num_nodes = 4096;
+  int num_iters = 200;
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--num_nodes") {
+        assert(i + 1 < argc);
+        num_nodes = std::stoi(argv[++i]);
+      } else if (arg == "--num_iters") {
+        assert(i + 1 < argc);
+        num_iters = std::stoi(argv[++i]);
+      } else {
+        std::cerr << "Unknown flag: " << arg << "\n";
+        return -1;
+      }
+    }
+  }
+
+  const Game game(2, 6);
+  // Discounts after 10 iterations, see CFR::step.
+  const double t = 10;
+  const std::vector<Discounts> discounts = {
+      {"linear", t / (t + 1), t / (t + 1), t / (t + 1)},
+      {"dcfr", std::pow(t, 1.5) / (std::pow(t, 1.5) + 1), 0.5,
+       std::pow(t / (t + 1), 2)}};
+
+  std::cout << "ISA: " << cfr_kernels_isa() << " nodes=" << num_nodes
+            << " hands=" << game.num_hands()
+            << " actions=" << game.num_actions() << "\n";
+  for (const auto& d : discounts) {
+    Buffers scalar = make_buffers(num_nodes, game.num_hands(),
+                                  game.num_actions());
+    Buffers vectorized = scalar;
+    const double scalar_secs =
+        run(&scalar, num_iters, d, regret_matching_scalar<double, double>,
+            discount_and_accumulate_scalar<double, double>);
+    const double vectorized_secs =
+        run(&vectorized, num_iters, d, regret_matching,
+            discount_and_accumulate);
+    double max_diff = 0;
+    const size_t total = static_cast<size_t>(num_nodes) * game.num_hands() *
+                         game.num_actions();
+    for (size_t i = 0; i < total; ++i) {
+      max_diff = std::max(max_diff, std::abs(scalar.average.data()[i] -
+                                             vectorized.average.data()[i]));
+    }
+    std::cout << d.name << ": scalar=" << scalar_secs * 1e3
+              << "ms vectorized=" << vectorized_secs * 1e3
+              << "ms speedup=" << scalar_secs / vectorized_secs
+              << " max |diff|=" << max_diff << "\n";
+  }
+}
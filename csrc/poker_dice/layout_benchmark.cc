@@ -0,0 +1,117 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Times full-game solving over all 216 public hands with the solvers storing
+// regrets and strategies as [node][hand][action] (HandMajor) and as
+// [node][action][hand] (ActionMajor).
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "poker_dice.h"
+#include "subgame_solving.h"
+
+using namespace poker_dice;
+
+namespace {
+
+constexpr int kNumPublicHands = 216;
+
+struct Timer {
+  std::chrono::time_point<std::chrono::system_clock> start =
+      std::chrono::system_clock::now();
+
+  double tick() {
+    const auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    return diff.count();
+  }
+};
+
+// Returns seconds per full-game pass and the sum of all root values as a
+// checksum.
+template <class Layout>
+std::pair<double, double> run(const Game& game,
+                              const SubgameSolvingParams& params,
+                              int num_repeats) {
+  double checksum = 0;
+  Timer t;
+  for (int r = 0; r < num_repeats; ++r) {
+    for (int pub_hand = 0; pub_hand < kNumPublicHands; ++pub_hand) {
+      auto solver = build_solver<Layout>(game, game.get_initial_state(pub_hand),
+                                         get_initial_beliefs(game), params,
+                                         /*net=*/nullptr);
+      solver->multistep();
+      for (double v : solver->get_hand_values(0)) checksum += v;
+    }
+  }
+  return {t.tick() / num_repeats, checksum};
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int num_iters = 256;
+  int num_repeats = 3;
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--num_iters") {
+        assert(i + 1 < argc);
+        num_iters = std::stoi(argv[++i]);
+      } else if (arg == "--num_repeats") {
+        assert(i + 1 < argc);
+        num_repeats = std::stoi(argv[++i]);
+      } else {
+        std::cerr << "Unknown flag: " << arg << "\n";
+        return -1;
+      }
+    }
+  }
+
+  const Game game(2, 6);
+  std::vector<std::pair<std::string, SubgameSolvingParams>> configs;
+  {
+    SubgameSolvingParams params;
+    params.num_iters = num_iters;
+    params.max_depth = 100;
+    params.use_cfr = true;
+    params.linear_update = true;
+    configs.emplace_back("linear_cfr", params);
+    params.linear_update = false;
+    params.dcfr = true;
+    params.dcfr_alpha = 1.5;
+    params.dcfr_beta = 0;
+    params.dcfr_gamma = 2;
+    configs.emplace_back("dcfr", params);
+    params.dcfr = false;
+    params.use_cfr = false;
+    params.linear_update = true;
+    configs.emplace_back("linear_fp", params);
+  }
+
+  for (const auto& [name, params] : configs) {
+    const auto [hand_major_secs, hand_major_sum] =
+        run<HandMajor>(game, params, num_repeats);
+    const auto [action_major_secs, action_major_sum] =
+        run<ActionMajor>(game, params, num_repeats);
+    std::cout << name << ": hand_major=" << hand_major_secs * 1e3
+              << "ms action_major=" << action_major_secs * 1e3
+              << "ms ratio=" << hand_major_secs / action_major_secs
+              << " same_values=" << (hand_major_sum == action_major_sum)
+              << "\n";
+  }
+}
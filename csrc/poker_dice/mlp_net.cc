@@ -0,0 +1,221 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mlp_net.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <map>
+
+namespace poker_dice {
+namespace {
+
+// Same as torch.nn.LayerNorm.
+constexpr float kLayerNormEps = 1e-5;
+
+// The exact (erf) GELU, the default of torch.nn.functional.gelu.
+inline float gelu(float x) {
+  return 0.5f * x * (1.0f + std::erf(x * static_cast<float>(M_SQRT1_2)));
+}
+
+std::vector<float> to_vector(const torch::Tensor& tensor) {
+  const auto contiguous = tensor.to(torch::kFloat32).contiguous();
+  const float* data = contiguous.data_ptr<float>();
+  return std::vector<float>(data, data + contiguous.numel());
+}
+
+// Computes rows [0, R) and columns [col, col + kColBlock) of the product of
+// `input` and the packed weights plus bias. GELU is applied if `apply_gelu`.
+template <int R>
+void gemm_block(const float* __restrict__ input, int input_stride, int in_size,
+                const float* __restrict__ weight, const float* __restrict__ bias,
+                int padded_size, int col, bool apply_gelu,
+                float* __restrict__ output) {
+  constexpr int C = MlpNet::kColBlock;
+  float acc[R][C];
+  for (int r = 0; r < R; ++r) {
+    for (int j = 0; j < C; ++j) acc[r][j] = bias[col + j];
+  }
+  for (int k = 0; k < in_size; ++k) {
+    const float* __restrict__ w = weight + k * padded_size + col;
+    for (int r = 0; r < R; ++r) {
+      const float x = input[r * input_stride + k];
+      for (int j = 0; j < C; ++j) acc[r][j] += x * w[j];
+    }
+  }
+  for (int r = 0; r < R; ++r) {
+    float* __restrict__ out = output + r * padded_size + col;
+    if (apply_gelu) {
+      for (int j = 0; j < C; ++j) out[j] = gelu(acc[r][j]);
+    } else {
+      for (int j = 0; j < C; ++j) out[j] = acc[r][j];
+    }
+  }
+}
+
+}  // namespace
+
+std::vector<MlpLayer> load_mlp_layers(const std::string& path) {
+  return load_mlp_layers(torch::jit::load(path));
+}
+
+std::vector<MlpLayer> load_mlp_layers(const torch::jit::Module& module) {
+  // Parameters of body by index in the Sequential. Linear weights are 2D,
+  // LayerNorm weights are 1D.
+  std::map<int, std::map<std::string, torch::Tensor>> body;
+  std::map<std::string, torch::Tensor> output;
+  for (const auto& param : module.named_parameters(/*recurse=*/true)) {
+    const std::string& name = param.name;
+    const auto dot = name.rfind('.');
+    const std::string field = name.substr(dot + 1);
+    if (name.rfind("body.", 0) == 0) {
+      body[std::stoi(name.substr(5, dot - 5))][field] = param.value;
+    } else if (name.rfind("output.", 0) == 0) {
+      output[field] = param.value;
+    } else {
+      throw std::runtime_error("Unexpected parameter: " + name);
+    }
+  }
+  std::vector<MlpLayer> layers;
+  auto add_linear = [&](const std::map<std::string, torch::Tensor>& params,
+                        bool gelu) {
+    MlpLayer layer;
+    const auto& weight = params.at("weight");
+    layer.out_size = weight.size(0);
+    layer.in_size = weight.size(1);
+    layer.weight = to_vector(weight);
+    layer.bias = to_vector(params.at("bias"));
+    layer.gelu = gelu;
+    layers.push_back(std::move(layer));
+  };
+  for (const auto& [index, params] : body) {
+    if (params.at("weight").dim() == 2) {
+      add_linear(params, /*gelu=*/true);
+    } else {
+      assert(!layers.empty());
+      layers.back().norm_weight = to_vector(params.at("weight"));
+      layers.back().norm_bias = to_vector(params.at("bias"));
+    }
+  }
+  add_linear(output, /*gelu=*/false);
+  return layers;
+}
+
+MlpNet::MlpNet(const std::vector<MlpLayer>& layers) {
+  assert(!layers.empty());
+  for (const MlpLayer& layer : layers) {
+    assert(layers_.empty() || layers_.back().out_size == layer.in_size);
+    PackedLayer packed;
+    packed.in_size = layer.in_size;
+    packed.out_size = layer.out_size;
+    packed.padded_size =
+        (layer.out_size + kColBlock - 1) / kColBlock * kColBlock;
+    packed.weight.assign(layer.in_size * packed.padded_size, 0.0f);
+    for (int j = 0; j < layer.out_size; ++j) {
+      for (int k = 0; k < layer.in_size; ++k) {
+        packed.weight[k * packed.padded_size + j] =
+            layer.weight[j * layer.in_size + k];
+      }
+    }
+    packed.bias.assign(packed.padded_size, 0.0f);
+    std::copy(layer.bias.begin(), layer.bias.end(), packed.bias.begin());
+    packed.norm_weight = layer.norm_weight;
+    packed.norm_bias = layer.norm_bias;
+    packed.gelu = layer.gelu;
+    layers_.push_back(std::move(packed));
+  }
+}
+
+void MlpNet::run_layer(const PackedLayer& layer, const float* input,
+                       int input_stride, int num_rows, float* output) {
+  const bool has_norm = !layer.norm_weight.empty();
+  // With a LayerNorm the activation has to wait for the row statistics.
+  const bool fused_gelu = layer.gelu && !has_norm;
+  for (int col = 0; col < layer.padded_size; col += kColBlock) {
+    for (int row = 0; row < num_rows; row += kRowBlock) {
+      const float* in = input + row * input_stride;
+      float* out = output + row * layer.padded_size;
+      auto* block = &gemm_block<kRowBlock>;
+      switch (num_rows - row) {
+        case 1:
+          block = &gemm_block<1>;
+          break;
+        case 2:
+          block = &gemm_block<2>;
+          break;
+        case 3:
+          block = &gemm_block<3>;
+          break;
+      }
+      block(in, input_stride, layer.in_size, layer.weight.data(),
+            layer.bias.data(), layer.padded_size, col, fused_gelu, out);
+    }
+  }
+  if (!has_norm) return;
+  for (int row = 0; row < num_rows; ++row) {
+    float* out = output + row * layer.padded_size;
+    float mean = 0;
+    for (int j = 0; j < layer.out_size; ++j) mean += out[j];
+    mean /= layer.out_size;
+    float var = 0;
+    for (int j = 0; j < layer.out_size; ++j) {
+      var += (out[j] - mean) * (out[j] - mean);
+    }
+    const float scale = 1.0f / std::sqrt(var / layer.out_size + kLayerNormEps);
+    for (int j = 0; j < layer.out_size; ++j) {
+      const float y =
+          (out[j] - mean) * scale * layer.norm_weight[j] + layer.norm_bias[j];
+      out[j] = layer.gelu ? gelu(y) : y;
+    }
+  }
+}
+
+void MlpNet::forward(const float* input, int num_rows, float* output) const {
+  // Activations of the current and of the previous layer.
+  static thread_local std::vector<float, AlignedAllocator<float>> buffers[2];
+  const float* in = input;
+  int in_stride = input_size();
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    const PackedLayer& layer = layers_[i];
+    auto& buffer = buffers[i % 2];
+    if (buffer.size() < static_cast<size_t>(num_rows * layer.padded_size)) {
+      buffer.resize(num_rows * layer.padded_size);
+    }
+    run_layer(layer, in, in_stride, num_rows, buffer.data());
+    in = buffer.data();
+    in_stride = layer.padded_size;
+  }
+  const int size = output_size();
+  for (int row = 0; row < num_rows; ++row) {
+    std::copy(in + row * in_stride, in + row * in_stride + size,
+              output + row * size);
+  }
+}
+
+torch::Tensor MlpNet::compute_values(const torch::Tensor queries) {
+  auto values = torch::empty({queries.size(0), output_size()}, torch::kFloat32);
+  compute_values_into(queries, values);
+  return values;
+}
+
+void MlpNet::compute_values_into(const torch::Tensor queries,
+                                 torch::Tensor values) {
+  assert(queries.size(1) == input_size());
+  assert(values.is_contiguous());
+  const auto input = queries.to(torch::kFloat32).contiguous();
+  forward(input.data_ptr<float>(), input.size(0), values.data_ptr<float>());
+}
+
+}  // namespace poker_dice
@@ -0,0 +1,105 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/*
+Inference-only CPU executor for the value nets of cfvpy/models.py.
+*/
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <torch/script.h>
+
+#include "net_interface.h"
+#include "tree_strategy.h"
+
+namespace poker_dice {
+
+// A torch.nn.Linear, optionally followed by a LayerNorm and a GELU.
+struct MlpLayer {
+  int in_size = 0;
+  int out_size = 0;
+  // [out_size, in_size] as in torch.nn.Linear.
+  std::vector<float> weight;
+  std::vector<float> bias;
+  // Empty if the layer has no LayerNorm.
+  std::vector<float> norm_weight;
+  std::vector<float> norm_bias;
+  bool gelu = true;
+};
+
+// Reads the layers of a Net2 or Net2Poker saved with torch.jit.save. Every
+// Linear of `body` is followed by GELU, the `output` Linear is not.
+std::vector<MlpLayer> load_mlp_layers(const std::string& path);
+
+// Same as above for a module that is already loaded, e.g., a replica of a
+// ModelLocker. Copies the current weights.
+std::vector<MlpLayer> load_mlp_layers(const torch::jit::Module& module);
+
+// Runs an MLP on the CPU without going through torch::jit, to avoid the
+// dispatch overhead of a TorchScript module on the small batches of data
+// generation and evaluation. It has not been timed against TorchScript yet;
+// mlp_net_benchmark compares the two on a saved net. Outputs match the
+// TorchScript module up to float rounding. Thread safe.
+class MlpNet : public IValueNet {
+ public:
+  explicit MlpNet(const std::vector<MlpLayer>& layers);
+
+  torch::Tensor compute_values(const torch::Tensor queries) override;
+  void compute_values_into(const torch::Tensor queries,
+                           torch::Tensor values) override;
+
+  void add_training_example(const torch::Tensor /*queries*/,
+                            const torch::Tensor /*values*/) override {
+    throw std::runtime_error("Cannot update MlpNet, only query");
+  }
+
+  // Computes `num_rows` rows of output_size() values from rows of
+  // input_size() floats.
+  void forward(const float* input, int num_rows, float* output) const;
+
+  int input_size() const { return layers_.front().in_size; }
+  int output_size() const { return layers_.back().out_size; }
+
+  // Output columns computed per pass over the weights. Layers are padded to a
+  // multiple of it.
+  static constexpr int kColBlock = 32;
+  // Rows that share every load of a weight.
+  static constexpr int kRowBlock = 4;
+
+ private:
+  struct PackedLayer {
+    int in_size;
+    int out_size;
+    int padded_size;
+    // [in_size, padded_size], i.e., transposed so that a block of output
+    // columns reads consecutive weights.
+    std::vector<float, AlignedAllocator<float>> weight;
+    std::vector<float, AlignedAllocator<float>> bias;
+    std::vector<float> norm_weight;
+    std::vector<float> norm_bias;
+    bool gelu;
+  };
+
+  // Writes rows of padded_size values with stride padded_size.
+  static void run_layer(const PackedLayer& layer, const float* input,
+                        int input_stride, int num_rows, float* output);
+
+  std::vector<PackedLayer> layers_;
+};
+
+}  // namespace poker_dice
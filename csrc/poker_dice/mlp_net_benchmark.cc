@@ -0,0 +1,106 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Times value queries of 1 to max_batch_size rows on the CPU, as made by the
+// solvers during data generation and evaluation, for the TorchScript net and
+// for MlpNet running the same weights. Expects a Net2 or Net2Poker saved with
+// torch.jit.save, e.g., by cfvpy/selfplay.py.
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <torch/torch.h>
+
+#include "mlp_net.h"
+#include "real_net.h"
+
+using namespace poker_dice;
+
+namespace {
+
+struct Timer {
+  std::chrono::time_point<std::chrono::system_clock> start =
+      std::chrono::system_clock::now();
+
+  double tick() {
+    const auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    return diff.count();
+  }
+};
+
+// Returns microseconds per query.
+double run(IValueNet& net, const torch::Tensor& queries, torch::Tensor values,
+           int num_queries) {
+  // Warm up.
+  net.compute_values_into(queries, values);
+  Timer t;
+  for (int i = 0; i < num_queries; ++i) {
+    net.compute_values_into(queries, values);
+  }
+  return t.tick() / num_queries * 1e6;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  std::string net_path;
+  int max_batch_size = 1024;
+  int num_rows = 1 << 16;
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--net") {
+        assert(i + 1 < argc);
+        net_path = argv[++i];
+      } else if (arg == "--max_batch_size") {
+        assert(i + 1 < argc);
+        max_batch_size = std::stoi(argv[++i]);
+      } else if (arg == "--num_rows") {
+        assert(i + 1 < argc);
+        num_rows = std::stoi(argv[++i]);
+      } else {
+        std::cerr << "Unknown flag: " << arg << "\n";
+        return -1;
+      }
+    }
+  }
+  if (net_path.empty()) {
+    std::cerr << "--net is required\n";
+    return -1;
+  }
+  torch::set_num_threads(1);
+
+  auto torchscript_net = create_torchscript_net(net_path, "cpu");
+  MlpNet mlp_net(load_mlp_layers(net_path));
+  std::cout << "input_size=" << mlp_net.input_size()
+            << " output_size=" << mlp_net.output_size() << "\n";
+  for (int batch_size = 1; batch_size <= max_batch_size; batch_size *= 2) {
+    const auto queries = torch::rand({batch_size, mlp_net.input_size()});
+    auto expected = torch::empty({batch_size, mlp_net.output_size()});
+    auto values = torch::empty({batch_size, mlp_net.output_size()});
+    const int num_queries = std::max(1, num_rows / batch_size);
+    const double torchscript =
+        run(*torchscript_net, queries, expected, num_queries);
+    const double mlp = run(mlp_net, queries, values, num_queries);
+    const float max_diff = (values - expected).abs().max().item<float>();
+    std::cout << "batch_size=" << batch_size << " torchscript: " << torchscript
+              << "us mlp_net: " << mlp << "us (" << torchscript / mlp
+              << "x) max_diff=" << max_diff << "\n";
+  }
+}
@@ -14,6 +14,8 @@
 
 #pragma once
 
+#include <future>
+
 #include <torch/torch.h>
 
 
@@ -28,6 +30,28 @@ class IValueNet {
   // values [batch, belief_size].
   virtual torch::Tensor compute_values(const torch::Tensor queries) = 0;
 
+  // Same as compute_values, but writes the values into `values`, a
+  // preallocated float tensor [batch, belief_size] owned by the caller. Nets
+  // that can produce the output in place override it to skip the allocation
+  // and the copy of the result.
+  virtual void compute_values_into(const torch::Tensor queries,
+                                   torch::Tensor values) {
+    values.copy_(compute_values(queries));
+  }
+
+  // Starts compute_values_into and returns a future that is ready once
+  // `values` is written, so the caller can keep working in the meantime.
+  // `queries` and `values` must stay alive and untouched until then, so the
+  // caller waits for the future even if it no longer needs the values. Nets
+  // that compute on another thread must not return a deferred future. By
+  // default the values are computed on the thread that waits for the future.
+  virtual std::future<void> compute_values_async(const torch::Tensor queries,
+                                                 torch::Tensor values) {
+    return std::async(std::launch::deferred, [this, queries, values] {
+      compute_values_into(queries, values);
+    });
+  }
+
   // Callback to pass the true value for the query to the trainer.
   virtual void add_training_example(const torch::Tensor queries,
                                     const torch::Tensor values) = 0;
@@ -4,6 +4,7 @@
 
 #include <limits>
 #include <memory>
+#include <numeric>
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -40,6 +41,17 @@ struct PartialPublicState {
 };
 
 
+// Showdown ranking of the private hands for a single public hand. Views into
+// a table owned by Game.
+struct ShowdownRanking {
+  // Private hands sorted by increasing score: [num_hands].
+  const int* order;
+  // Hands order[class_begin[c]], ..., order[class_begin[c + 1] - 1] have equal
+  // scores and tie with each other: [num_classes + 1].
+  const int* class_begin;
+  int num_classes;
+};
+
 class Game {
  public:
   const int num_dice = 2;
@@ -54,7 +66,7 @@ class Game {
   Game(int num_dice, int num_faces)
       : 
         num_hands_(int_pow(num_faces, num_dice))
-         {build_score_table();}
+         {build_score_table(); build_showdown_table();}
 
   // Number of dice for all the players.
   //int total_num_dice() const { return total_num_dice_; } // TODO
@@ -66,6 +78,9 @@ class Game {
   // words, number of different realization of the chance nodes.
   int num_hands() const { return num_hands_; }
 
+  // Number of distinct realizations of the three public dice.
+  int num_public_hands() const { return num_faces * num_faces * num_faces; }
+
   // Upper bound for how deep game tree could be.
   int max_depth() const { return max_bid; } // TODO
 
@@ -176,6 +191,42 @@ class Game {
     }}}}}
   }
 
+  // Sorts private hands by score for every public hand and records the tie
+  // classes. The table is shared between copies of the game.
+  void build_showdown_table()
+  {
+    auto table = std::make_shared<ShowdownTable>();
+    table->order.resize(num_public_hands() * num_hands_);
+    table->class_begin.resize(num_public_hands() * (num_hands_ + 1));
+    table->num_classes.resize(num_public_hands());
+    for (int public_hand = 0; public_hand < num_public_hands(); ++public_hand)
+    {
+      int* order = &table->order[public_hand * num_hands_];
+      int* class_begin = &table->class_begin[public_hand * (num_hands_ + 1)];
+      std::iota(order, order + num_hands_, 0);
+      std::sort(order, order + num_hands_, [&](int a, int b) {
+        return score(a, public_hand) < score(b, public_hand);
+      });
+      int num_classes = 0;
+      for (int i = 0; i < num_hands_; ++i)
+      {
+        if (i == 0 || score(order[i], public_hand) != score(order[i - 1], public_hand))
+          class_begin[num_classes++] = i;
+      }
+      class_begin[num_classes] = num_hands_;
+      table->num_classes[public_hand] = num_classes;
+    }
+    showdown_table_ = std::move(table);
+  }
+
+  ShowdownRanking showdown_ranking(int public_hand) const
+  {
+    return ShowdownRanking{
+        &showdown_table_->order[public_hand * num_hands_],
+        &showdown_table_->class_begin[public_hand * (num_hands_ + 1)],
+        showdown_table_->num_classes[public_hand]};
+  }
+
   void print_score(double s) const
   {
       int tmp; int ss =s;
@@ -217,8 +268,8 @@ class Game {
 
   double utility(int myhand, int ophand, int public_hand) const
   {
-    double my_score = score(myhand, public_hand);
-    double op_score = score(ophand, public_hand);
+    const int my_score = score(myhand, public_hand);
+    const int op_score = score(ophand, public_hand);
     //print_score(my_score);
     //print_score(op_score);
     if (op_score == my_score) return 0.5;
@@ -316,6 +367,15 @@ class Game {
 
 
  private:
+  struct ShowdownTable {
+    // Indexed by [public_hand, position].
+    std::vector<int> order;
+    // Indexed by [public_hand, class], num_hands + 1 entries per public hand.
+    std::vector<int> class_begin;
+    // Indexed by [public_hand].
+    std::vector<int> num_classes;
+  };
+
   static int int_pow(int base, int power) {
     if (power == 0) return 1;
     const int half_power = int_pow(base, power / 2);
@@ -329,6 +389,7 @@ class Game {
   }
 
   const int num_hands_;
+  std::shared_ptr<const ShowdownTable> showdown_table_;
 };
 
 }  // namespace
@@ -20,6 +20,7 @@
 #include <torch/script.h>
 #include <torch/torch.h>
 
+#include "mlp_net.h"
 #include "poker_dice.h"
 #include "net_interface.h"
 #include "subgame_solving.h"
@@ -41,6 +42,15 @@ class ZeroOutputNet : public IValueNet {
     return torch::zeros({num_queries, output_size_});
   }
 
+  void compute_values_into(const torch::Tensor query,
+                           torch::Tensor values) override {
+    if (verbose_) {
+      std::cerr << "Called ZeroOutputNet::handle_nn_query() with num_queries="
+                << query.size(0) << std::endl;
+    }
+    values.zero_();
+  }
+
   void add_training_example(const torch::Tensor query,
                             const torch::Tensor /*values*/) override {
     if (verbose_) {
@@ -71,9 +81,13 @@ class TorchScriptNet : public IValueNet {
   }
 
   torch::Tensor compute_values(const torch::Tensor query) override {
-    std::vector<torch::jit::IValue> inputs = {query.to(device_)};
-    auto results = module_.forward(inputs);
-    return results.toTensor().to(torch::kCPU);
+    return forward(query).to(torch::kCPU);
+  }
+
+  // Copies the output straight from the device into `values`.
+  void compute_values_into(const torch::Tensor query,
+                           torch::Tensor values) override {
+    values.copy_(forward(query));
   }
 
   void add_training_example(const torch::Tensor /*query*/,
@@ -82,6 +96,11 @@ class TorchScriptNet : public IValueNet {
   }
 
  private:
+  torch::Tensor forward(const torch::Tensor& query) {
+    std::vector<torch::jit::IValue> inputs = {query.to(device_)};
+    return module_.forward(inputs).toTensor();
+  }
+
   torch::jit::script::Module module_;
   const torch::Device device_;
 };
@@ -92,14 +111,22 @@ class OracleNetSolver : public IValueNet {
       : game(game), params(params) {}
 
   torch::Tensor compute_values(const torch::Tensor queries) override {
+    auto values = torch::empty({queries.size(0), game.num_hands()});
+    compute_values_into(queries, values);
+    return values;
+  }
+
+  void compute_values_into(const torch::Tensor queries,
+                           torch::Tensor values) override {
     const int num_queries = queries.size(0);
-    std::vector<torch::Tensor> values;
+    auto values_acc = values.accessor<float, 2>();
     for (int query_id = 0; query_id < num_queries; ++query_id) {
       auto row = queries[query_id];
-      auto row_values = compute_values(row.data_ptr<float>());
-      values.push_back(torch::tensor(row_values).to(torch::kFloat32));
+      const auto row_values = compute_values(row.data_ptr<float>());
+      for (size_t i = 0; i < row_values.size(); ++i) {
+        values_acc[query_id][i] = row_values[i];
+      }
     }
-    return torch::stack(values, 0);
   }
 
   // Callback to pass the true value for the query to the trainer.
@@ -135,6 +162,12 @@ std::shared_ptr<IValueNet> create_torchscript_net(const std::string& path,
   return std::make_shared<TorchScriptNet>(path, device);
 }
 
+std::shared_ptr<IValueNet> create_mlp_net(const std::string& path) {
+  auto net = std::make_shared<MlpNet>(load_mlp_layers(path));
+  std::cerr << "Loaded: " << path << std::endl;
+  return net;
+}
+
 std::shared_ptr<IValueNet> create_oracle_value_predictor(
     const Game& game, const SubgameSolvingParams& params) {
   return std::make_shared<OracleNetSolver>(game, params);
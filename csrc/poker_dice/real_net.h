@@ -30,6 +30,10 @@ std::shared_ptr<IValueNet> create_torchscript_net(const std::string& path);
 std::shared_ptr<IValueNet> create_torchscript_net(const std::string& path,
                                                   const std::string& device);
 
+// Creates a CPU net that runs the Net2 or Net2Poker in the TorchScript file
+// without torch::jit. See MlpNet.
+std::shared_ptr<IValueNet> create_mlp_net(const std::string& path);
+
 // Create virtual value net that run a solver for each query.
 std::shared_ptr<IValueNet> create_oracle_value_predictor(
     const Game& game, const SubgameSolvingParams& params);
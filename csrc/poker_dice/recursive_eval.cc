@@ -80,37 +80,22 @@ int get_depth(const Tree& tree, int root = 0) {
   }
   return depth;
 }
-torch::Tensor tree_strategy_to_tensor(const TreeStrategy& strategy) {
-  torch::Tensor tensor =
-      torch::zeros({(int64_t)strategy.size(), (int64_t)strategy[0].size(),
-                    (int64_t)strategy[0][0].size()});
-  auto acc = tensor.accessor<float, 3>();
-
-  for (size_t node = 0; node < strategy.size(); ++node) {
-    for (size_t hand = 0; hand < strategy[node].size(); ++hand) {
-      for (size_t action = 0; action < strategy[node][hand].size(); ++action) {
-        acc[node][hand][action] = strategy[node][hand][action];
-      }
-    }
-  }
-  return tensor;
+// Returns a [node, hand, action] double tensor that takes ownership of the
+// strategy buffer without copying it.
+torch::Tensor tree_strategy_to_tensor(TreeStrategy strategy) {
+  auto* owner = new TreeStrategy(std::move(strategy));
+  return torch::from_blob(
+      owner->data(),
+      {(int64_t)owner->num_nodes(), (int64_t)owner->num_hands(),
+       (int64_t)owner->num_actions()},
+      [owner](void*) { delete owner; }, torch::kDouble);
 }
 
 TreeStrategy tensor_to_tree_strategy(const torch::Tensor tensor) {
-  TreeStrategy strategy(tensor.size(0));
-  const int num_hands = tensor.size(1);
-  const int num_values = tensor.size(2);
-  auto acc = tensor.accessor<float, 3>();
-
-  for (size_t node = 0; node < strategy.size(); ++node) {
-    strategy[node].resize(num_hands);
-    for (size_t hand = 0; hand < strategy[node].size(); ++hand) {
-      strategy[node][hand].resize(num_values);
-      for (size_t action = 0; action < strategy[node][hand].size(); ++action) {
-        strategy[node][hand][action] = acc[node][hand][action];
-      }
-    }
-  }
+  const auto contiguous = tensor.to(torch::kDouble).contiguous();
+  TreeStrategy strategy(tensor.size(0), tensor.size(1), tensor.size(2));
+  std::copy_n(contiguous.data_ptr<double>(), contiguous.numel(),
+              strategy.data());
   return strategy;
 }
 
@@ -135,9 +120,9 @@ struct ParallerSampledStrategyComputor {
         }
         auto sampled_strategy = compute_sampled_strategy_recursive_to_leaf(
             game, params, net, /*seed=*/strategy_id, root_only);
-        auto sampled_strategy_tensor =
-            tree_strategy_to_tensor(sampled_strategy);
         const auto stats = compute_stategy_stats(game, sampled_strategy);
+        auto sampled_strategy_tensor =
+            tree_strategy_to_tensor(std::move(sampled_strategy));
         // Weigting infoset (node, hand) by probability to get the hand and
         // reach the infoset by player(node).
         std::vector<float> reaches;
@@ -197,6 +182,8 @@ int main(int argc, char* argv[]) {
   int mdp_depth = -1;
   int num_repeats = -1;
   std::string net_path;
+  // Run the net for the repeats with MlpNet instead of TorchScript.
+  bool mlp_net = false;
   bool repeat_oracle_net = false;
   bool no_linear = false;
   bool root_only = false;
@@ -234,6 +221,8 @@ int main(int argc, char* argv[]) {
       } else if (arg == "--net") {
         assert(i + 1 < argc);
         net_path = argv[++i];
+      } else if (arg == "--mlp_net") {
+        mlp_net = true;
       } else if (arg == "--print_regret") {
         print_regret = true;
       } else if (arg == "--print_regret_summary") {
@@ -333,7 +322,8 @@ int main(int argc, char* argv[]) {
           return poker_dice::create_oracle_value_predictor(game,
                                                            oracle_net_params);
         } else {
-          return poker_dice::create_torchscript_net(net_path, "cpu");
+          return mlp_net ? poker_dice::create_mlp_net(net_path)
+                         : poker_dice::create_torchscript_net(net_path, "cpu");
         }
       };
 
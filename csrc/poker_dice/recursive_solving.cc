@@ -55,7 +55,7 @@ void compute_strategy_recursive(const Game& game, const Tree& tree, int node_id,
 
   auto solver = solver_builder(game, node_id, state, beliefs);
   solver->multistep();
-  strategy->at(node_id) = solver->get_strategy()[0];
+  strategy->copy_node(node_id, solver->get_strategy(), 0);
 
   for (auto child_node_id = node.children_begin;
        child_node_id < node.children_end; ++child_node_id) {
@@ -106,7 +106,7 @@ void compute_strategy_recursive_to_leaf(
     auto [full_node_id, partial_node_id, node_reaches] =
         std::move(traversal_queue.front());
     traversal_queue.pop_front();
-    (*strategy)[full_node_id] = partial_strategy[partial_node_id];
+    strategy->copy_node(full_node_id, partial_strategy, partial_node_id);
     const auto& full_node = tree[full_node_id];
     const auto& partial_node = partial_tree[partial_node_id];
     assert(partial_node.num_children() == 0 ||
@@ -136,8 +136,9 @@ void compute_strategy_recursive_to_leaf(
 
 TreeStrategy compute_strategy_with_solver(
     const Game& game, const SubgameSolverBuilder& solver_builder, int pub_hand) {
-  const Tree tree = unroll_tree(game, pub_hand);
-  TreeStrategy strategy(tree.size());
+  const auto tree_ptr = get_cached_tree(game, pub_hand);
+  const Tree& tree = *tree_ptr;
+  TreeStrategy strategy(tree.size(), game.num_hands(), game.num_actions());
   const auto beliefs = get_initial_beliefs(game);
   compute_strategy_recursive(game, tree, /*node_id=*/0, beliefs, solver_builder, pub_hand,
                              &strategy);
@@ -147,8 +148,9 @@ TreeStrategy compute_strategy_with_solver(
 TreeStrategy compute_strategy_with_solver_to_leaf(
     const Game& game, const SubgameSolverBuilder& solver_builder, int pub_hand,
     bool use_samplig_strategy = false) {
-  const Tree tree = unroll_tree(game, pub_hand);
-  TreeStrategy strategy(tree.size());
+  const auto tree_ptr = get_cached_tree(game, pub_hand);
+  const Tree& tree = *tree_ptr;
+  TreeStrategy strategy(tree.size(), game.num_hands(), game.num_actions());
   const auto beliefs = get_initial_beliefs(game);
   compute_strategy_recursive_to_leaf(game, tree, /*node_id=*/0, beliefs,
                                      solver_builder, pub_hand, use_samplig_strategy,
@@ -158,32 +160,49 @@ TreeStrategy compute_strategy_with_solver_to_leaf(
 
 }  // namespace
 
-void RlRunner::step() {
+void RlRunner::step() { run_episode(/*wait_for_net=*/true); }
 
-  int rand_pub_hand = rand() % 216;
-  //int rand_pub_hand = 152;
+bool RlRunner::advance() { return run_episode(/*wait_for_net=*/false); }
 
-  state_ = game_.get_initial_state(rand_pub_hand);
-  beliefs_[0].assign(game_.num_hands(), 1.0 / game_.num_hands());
-  beliefs_[1].assign(game_.num_hands(), 1.0 / game_.num_hands());
-  // std::cout << "state: " << game_.state_to_string(state_) << "\n";
-  while (!game_.is_terminal(state_)) {
-    auto solver = build_solver(game_, state_, beliefs_, subgame_params_, net_);
+bool RlRunner::run_episode(bool wait_for_net) {
+  if (!in_episode_) {
+    int rand_pub_hand = rand() % 216;
+    //int rand_pub_hand = 152;
 
-    const int act_iteration =
-        std::uniform_int_distribution<>(0, subgame_params_.num_iters)(gen_);
-    for (int iter = 0; iter < act_iteration; ++iter) {
-      solver->step(/*traverser=*/iter % 2);
+    state_ = game_.get_initial_state(rand_pub_hand);
+    beliefs_[0].assign(game_.num_hands(), 1.0 / game_.num_hands());
+    beliefs_[1].assign(game_.num_hands(), 1.0 / game_.num_hands());
+    in_episode_ = true;
+  }
+  // std::cout << "state: " << game_.state_to_string(state_) << "\n";
+  while (solver_ != nullptr || !game_.is_terminal(state_)) {
+    if (solver_ == nullptr) {
+      solver_ = solver_pool_.acquire(state_, beliefs_);
+      iter_ = 0;
+      act_iteration_ =
+          std::uniform_int_distribution<>(0, subgame_params_.num_iters)(gen_);
     }
-    // Sample a new state to explore.
-    sample_state(solver.get());
-    for (int iter = act_iteration; iter < subgame_params_.num_iters; ++iter) {
-      solver->step(/*traverser=*/iter % 2);
+    while (true) {
+      // Sample a new state to explore.
+      if (iter_ == act_iteration_) {
+        sample_state(solver_);
+        // Not sampled again when advance() comes back to this iteration.
+        act_iteration_ = -1;
+      }
+      if (iter_ == subgame_params_.num_iters) break;
+      if (!wait_for_net && !solver_->prepare_step(/*traverser=*/iter_ % 2)) {
+        return false;
+      }
+      solver_->step(/*traverser=*/iter_ % 2);
+      ++iter_;
     }
 
     // Collect the values at the top of the tree.
-    solver->update_value_network();
+    solver_->update_value_network();
+    solver_ = nullptr;
   }
+  in_episode_ = false;
+  return true;
 }
 
 //**************************************
@@ -278,7 +297,7 @@ void RlRunner::sample_state_to_leaf(const ISubgameSolver* solver) {
         const auto& beliefs = sampling_beliefs[state.player_id];
         std::discrete_distribution<> dis(beliefs.begin(), beliefs.end());
         const int hand = dis(gen_);
-        const std::vector<double>& policy = strategy[node_id][hand];
+        const auto policy = strategy[node_id][hand];
         std::discrete_distribution<> action_dis(policy.begin(), policy.end());
         action = action_dis(gen_);
         assert(action >= action_begin && action < action_end);
@@ -325,8 +344,7 @@ void RlRunner::sample_state_single(const ISubgameSolver* solver) {
     const auto& beliefs = beliefs_[state_.player_id];
     std::discrete_distribution<> dis(beliefs.begin(), beliefs.end());
     const int hand = dis(gen_);
-    const std::vector<double>& policy =
-        solver->get_sampling_strategy()[0][hand];
+    const auto policy = solver->get_sampling_strategy()[0][hand];
     std::discrete_distribution<> action_dis(policy.begin(), policy.end());
     action = action_dis(gen_);
   }
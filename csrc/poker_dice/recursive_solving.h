@@ -46,6 +46,7 @@ class RlRunner {
         random_action_prob_(params.random_action_prob),
         sample_leaf_(params.sample_leaf),
         net_(net),
+        solver_pool_(game_, subgame_params_, net_),
         gen_(seed) {}
 
   // Deprecated constructor.
@@ -53,7 +54,16 @@ class RlRunner {
            std::shared_ptr<IValueNet> net, int seed)
       : RlRunner(build_params(game, params), net, seed) {}
 
+  // Plays a full episode.
   void step();
+
+  // Resumable version of step(). Plays the episode until the current solver
+  // has to wait for the value net and returns false, or until the episode is
+  // over and returns true. The next call continues where the last one
+  // stopped. With a net that answers queries asynchronously, many runners
+  // can take turns on one thread while their queries are served together.
+  bool advance();
+
   float step_test(int pub_hand, int iterations);
   TreeStrategy get_full_game_cfr_strategy(int pub_hand);
 
@@ -67,6 +77,10 @@ class RlRunner {
     return params;
   }
 
+  // Runs the episode until the episode is over or, unless wait_for_net is
+  // set, until the solver has to wait. Returns whether the episode is over.
+  bool run_episode(bool wait_for_net);
+
   // Samples new state_ from the solver and update beliefs.
   void sample_state(const ISubgameSolver* solver);
   void sample_state_single(const ISubgameSolver* solver);
@@ -78,12 +92,21 @@ class RlRunner {
   const float random_action_prob_;
   const bool sample_leaf_;
   std::shared_ptr<IValueNet> net_;
+  // Solvers reused across subgames and steps.
+  SolverPool solver_pool_;
 
   // Current state.
   PartialPublicState state_;
   // Buffer to the beliefs.
   Pair<std::vector<double>> beliefs_;
 
+  // Progress of the episode that advance() left off. The solver is null
+  // between subgames.
+  bool in_episode_ = false;
+  ISubgameSolver* solver_ = nullptr;
+  int iter_ = 0;
+  int act_iteration_ = 0;
+
   std::mt19937 gen_;
 };
 
@@ -27,21 +27,77 @@
 // limitations under the License.
 #include <math.h>
 
+#include <random>
+
 #include <gtest/gtest.h>
 
+#include "mlp_net.h"
 #include "real_net.h"
 #include "recursive_solving.h"
+#include "stats.h"
 
 using namespace poker_dice;
 
+namespace {
+
+// Net with values that depend on the query. With `manual` asynchronous
+// queries are only answered by flush(). Records the training examples.
+class ManualNet : public IValueNet {
+ public:
+  ManualNet(int num_hands, bool manual)
+      : num_hands_(num_hands), manual_(manual) {}
+
+  torch::Tensor compute_values(const torch::Tensor queries) override {
+    auto values = torch::zeros({queries.size(0), num_hands_});
+    auto query_acc = queries.accessor<float, 2>();
+    auto value_acc = values.accessor<float, 2>();
+    for (int64_t row = 0; row < queries.size(0); ++row) {
+      for (int hand = 0; hand < num_hands_; ++hand) {
+        value_acc[row][hand] =
+            query_acc[row][(hand * 7) % queries.size(1)] - 0.01 * hand;
+      }
+    }
+    return values;
+  }
+
+  std::future<void> compute_values_async(const torch::Tensor queries,
+                                         torch::Tensor values) override {
+    if (!manual_) return IValueNet::compute_values_async(queries, values);
+    pending_.emplace_back(queries, values, std::promise<void>());
+    return std::get<2>(pending_.back()).get_future();
+  }
+
+  void add_training_example(const torch::Tensor /*queries*/,
+                            const torch::Tensor values) override {
+    const float* data = values.data_ptr<float>();
+    examples.emplace_back(data, data + values.numel());
+  }
+
+  void flush() {
+    for (auto& [queries, values, promise] : pending_) {
+      values.copy_(compute_values(queries));
+      promise.set_value();
+    }
+    pending_.clear();
+  }
+
+  std::vector<std::vector<float>> examples;
+
+ private:
+  const int num_hands_;
+  const bool manual_;
+  std::vector<std::tuple<torch::Tensor, torch::Tensor, std::promise<void>>>
+      pending_;
+};
+
+}  // namespace
+
 TEST(Mdp, TestZeroNet) {
-  const int num_dice = 1;
-  const int num_faces = 3;
   SubgameSolvingParams params;
   params.num_iters = 100;
   params.max_depth = 1;
   params.linear_update = true;
-  const Game game(num_dice, num_faces);
+  const Game game(2, 6);
   auto net = create_zero_net(game.num_hands());
   RlRunner runner(game, params, net, /*seed=*/0);
 
@@ -56,8 +112,8 @@ TEST(Mdp, TestZeroNetSampleLeaf) {
   params.subgame_params.max_depth = 2;
   params.subgame_params.linear_update = true;
   params.sample_leaf = true;
-  params.num_dice = 1;
-  params.num_faces = 3;
+  params.num_dice = 2;
+  params.num_faces = 6;
   const Game game(params.num_dice, params.num_faces);
   auto net = create_zero_net(game.num_hands());
   RlRunner runner(params, net, /*seed=*/0);
@@ -68,32 +124,30 @@ TEST(Mdp, TestZeroNetSampleLeaf) {
 }
 
 TEST(Mdp, TestZeroNetComputeStrategy) {
-  const int num_dice = 1;
-  const int num_faces = 3;
   SubgameSolvingParams params;
   params.num_iters = 100;
   params.max_depth = 1;
   params.linear_update = true;
-  const Game game(num_dice, num_faces);
+  const Game game(2, 6);
   auto net = create_zero_net(game.num_hands());
 
-  auto strategy = compute_strategy_recursive(game, params, net);
-  auto full_tree = unroll_tree(game);
+  auto strategy =
+      compute_strategy_recursive(game, params, /*pub_hand=*/17, net);
+  auto full_tree = unroll_tree(game, /*pub_hand=*/17);
   ASSERT_EQ(strategy.size(), full_tree.size());
 }
 
 TEST(Mdp, TestZeroNetComputeStrategyToLeaf) {
-  const int num_dice = 1;
-  const int num_faces = 3;
   SubgameSolvingParams params;
   params.num_iters = 100;
   params.max_depth = 3;
   params.linear_update = true;
-  const Game game(num_dice, num_faces);
+  const Game game(2, 6);
   auto net = create_zero_net(game.num_hands());
 
-  auto strategy = compute_strategy_recursive_to_leaf(game, params, net);
-  auto full_tree = unroll_tree(game);
+  auto strategy =
+      compute_strategy_recursive_to_leaf(game, params, /*pub_hand=*/17, net);
+  auto full_tree = unroll_tree(game, /*pub_hand=*/17);
   ASSERT_EQ(strategy.size(), full_tree.size());
   for (size_t i = 0; i < strategy.size(); ++i) {
     if (game.is_terminal(full_tree[i].state)) continue;
@@ -105,3 +159,123 @@ TEST(Mdp, TestZeroNetComputeStrategyToLeaf) {
     }
   }
 }
+
+TEST(Mdp, TestAdvanceMatchesStep) {
+  RecursiveSolvingParams params;
+  params.num_dice = 2;
+  params.num_faces = 6;
+  params.subgame_params.use_cfr = true;
+  params.subgame_params.num_iters = 6;
+  params.subgame_params.max_depth = 2;
+  const Game game(params.num_dice, params.num_faces);
+
+  auto blocking_net = std::make_shared<ManualNet>(game.num_hands(), false);
+  srand(0);
+  RlRunner blocking_runner(params, blocking_net, /*seed=*/0);
+  for (int i = 0; i < 5; ++i) {
+    blocking_runner.step();
+  }
+
+  auto manual_net = std::make_shared<ManualNet>(game.num_hands(), true);
+  srand(0);
+  RlRunner runner(params, manual_net, /*seed=*/0);
+  int num_suspensions = 0;
+  for (int i = 0; i < 5; ++i) {
+    while (!runner.advance()) {
+      ++num_suspensions;
+      manual_net->flush();
+    }
+  }
+  EXPECT_GT(num_suspensions, 0);
+  ASSERT_FALSE(manual_net->examples.empty());
+  EXPECT_EQ(manual_net->examples, blocking_net->examples);
+}
+
+TEST(Mdp, TestExploitabilitySweepIsDeterministic) {
+  const Game game(2, 6);
+  SubgameSolvingParams params;
+  params.use_cfr = true;
+  params.num_iters = 8;
+  params.max_depth = 2;
+  params.linear_update = true;
+  auto net_factory = [&game]() {
+    return create_zero_net(game.num_hands(), /*verbose=*/false);
+  };
+  const auto serial =
+      compute_exploitability_sweep(game, params, net_factory, 1);
+  const auto parallel =
+      compute_exploitability_sweep(game, params, net_factory, 4);
+  ASSERT_EQ(serial.exploitabilities.size(),
+            static_cast<size_t>(game.num_public_hands()));
+  EXPECT_EQ(serial.exploitabilities, parallel.exploitabilities);
+  EXPECT_EQ(serial.mean_exploitability, parallel.mean_exploitability);
+}
+
+TEST(MlpNetTest, TestMatchesReference) {
+  // Sizes that are not multiples of the blocks, with and without LayerNorm.
+  const std::vector<int> sizes = {13, 37, 70, 7};
+  std::mt19937 gen(0);
+  std::normal_distribution<float> dist(0, 0.3);
+  for (bool use_layer_norm : {false, true}) {
+    std::vector<MlpLayer> layers;
+    for (size_t i = 0; i + 1 < sizes.size(); ++i) {
+      MlpLayer layer;
+      layer.in_size = sizes[i];
+      layer.out_size = sizes[i + 1];
+      for (int j = 0; j < layer.in_size * layer.out_size; ++j) {
+        layer.weight.push_back(dist(gen));
+      }
+      for (int j = 0; j < layer.out_size; ++j) {
+        layer.bias.push_back(dist(gen));
+        if (use_layer_norm && i + 2 < sizes.size()) {
+          layer.norm_weight.push_back(1 + dist(gen));
+          layer.norm_bias.push_back(dist(gen));
+        }
+      }
+      layer.gelu = i + 2 < sizes.size();
+      layers.push_back(layer);
+    }
+    MlpNet net(layers);
+    for (int num_rows = 1; num_rows <= 9; ++num_rows) {
+      auto queries = torch::empty({num_rows, sizes.front()});
+      auto queries_acc = queries.accessor<float, 2>();
+      for (int row = 0; row < num_rows; ++row) {
+        for (int j = 0; j < sizes.front(); ++j) {
+          queries_acc[row][j] = dist(gen);
+        }
+      }
+      const auto values = net.compute_values(queries);
+      auto values_acc = values.accessor<float, 2>();
+      for (int row = 0; row < num_rows; ++row) {
+        std::vector<double> x(queries.data_ptr<float>() + row * sizes.front(),
+                              queries.data_ptr<float>() +
+                                  (row + 1) * sizes.front());
+        for (const auto& layer : layers) {
+          std::vector<double> y(layer.bias.begin(), layer.bias.end());
+          for (int j = 0; j < layer.out_size; ++j) {
+            for (int k = 0; k < layer.in_size; ++k) {
+              y[j] += layer.weight[j * layer.in_size + k] * x[k];
+            }
+          }
+          if (!layer.norm_weight.empty()) {
+            double mean = 0, var = 0;
+            for (double v : y) mean += v / y.size();
+            for (double v : y) var += (v - mean) * (v - mean) / y.size();
+            for (int j = 0; j < layer.out_size; ++j) {
+              y[j] = (y[j] - mean) / sqrt(var + 1e-5) * layer.norm_weight[j] +
+                     layer.norm_bias[j];
+            }
+          }
+          if (layer.gelu) {
+            for (double& v : y) v = 0.5 * v * (1 + erf(v / sqrt(2.0)));
+          }
+          x = y;
+        }
+        ASSERT_EQ(values.size(1), static_cast<int64_t>(x.size()));
+        for (size_t j = 0; j < x.size(); ++j) {
+          EXPECT_NEAR(values_acc[row][j], x[j], 1e-5);
+        }
+      }
+    }
+  }
+}
@@ -16,10 +16,12 @@
 
 #include <atomic>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 #include "recursive_solving.h"
 #include "rela/thread_loop.h"
+#include "rela/work_stealing_pool.h"
 
 namespace rela {
 /*
@@ -57,9 +59,25 @@ class Test {
 
 };
 
+// Runs a set of thread loops.
+//
+// By default every loop gets an OS thread of its own. With numWorkers > 0 the
+// loops that have a step() are run as tasks on a WorkStealingPool of
+// numWorkers workers instead: every task runs one step and resubmits the
+// loop, so any number of loops share the cores and loops with slow steps do
+// not hold the others back. Loops without a step() still get their own
+// threads.
 class Context {
  public:
-  Context() : started_(false), numTerminatedThread_(0) {}
+  Context() : Context(/*numWorkers=*/0) {}
+
+  // maxThreads bounds the number of pool threads, including the ones started
+  // to replace workers blocked on a value net. Defaults to 4 * numWorkers.
+  explicit Context(int numWorkers, int maxThreads = 0)
+      : started_(false),
+        numTerminatedThread_(0),
+        numWorkers_(numWorkers),
+        maxThreads_(maxThreads > 0 ? maxThreads : 4 * numWorkers) {}
 
   Context(const Context&) = delete;
   Context& operator=(const Context&) = delete;
@@ -68,6 +86,10 @@ class Context {
     for (auto& v : loops_) {
       v->terminate();
     }
+    // Lets the running steps finish and drops the queued ones.
+    if (pool_ != nullptr) {
+      pool_->stop();
+    }
     for (auto& v : threads_) {
       v.join();
     }
@@ -80,11 +102,18 @@ class Context {
   }
 
   void start() {
+    if (numWorkers_ > 0) {
+      pool_ = std::make_unique<WorkStealingPool>(numWorkers_, maxThreads_);
+    }
     for (int i = 0; i < (int)loops_.size(); ++i) {
-      threads_.emplace_back([this, i]() {
-        loops_[i]->mainLoop();
-        ++numTerminatedThread_;
-      });
+      if (pool_ != nullptr && loops_[i]->hasStep()) {
+        pool_->submit([this, i] { runStep(i); });
+      } else {
+        threads_.emplace_back([this, i]() {
+          loops_[i]->mainLoop();
+          ++numTerminatedThread_;
+        });
+      }
     }
   }
 
@@ -98,12 +127,15 @@ class Context {
     for (auto& v : loops_) {
       v->resume();
     }
+    resubmitParked();
   }
 
   void terminate() {
     for (auto& v : loops_) {
       v->terminate();
     }
+    // Parked loops are run once more to be counted as terminated.
+    resubmitParked();
   }
 
   bool terminated() {
@@ -112,9 +144,46 @@ class Context {
   }
 
  private:
+  void resubmitParked() {
+    if (pool_ == nullptr) return;
+    std::vector<int> parked;
+    {
+      std::lock_guard<std::mutex> lk(mParked_);
+      parked.swap(parked_);
+    }
+    for (int i : parked) {
+      pool_->submit([this, i] { runStep(i); });
+    }
+  }
+
+  // One iteration of the mainLoop of the i-th loop on the pool. A paused loop
+  // is parked instead of blocking a worker, and resubmitted by resume().
+  void runStep(int i) {
+    auto& loop = loops_[i];
+    if (loop->terminated()) {
+      ++numTerminatedThread_;
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lk(mParked_);
+      if (loop->paused()) {
+        parked_.push_back(i);
+        return;
+      }
+    }
+    loop->step();
+    pool_->submit([this, i] { runStep(i); });
+  }
+
   bool started_;
   std::atomic<int> numTerminatedThread_;
   std::vector<std::shared_ptr<ThreadLoop>> loops_;
   std::vector<std::thread> threads_;
+
+  const int numWorkers_;
+  const int maxThreads_;
+  std::unique_ptr<WorkStealingPool> pool_;
+  std::mutex mParked_;
+  std::vector<int> parked_;
 };
 }  // namespace rela
@@ -14,9 +14,19 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <thread>
+
 #include "net_interface.h"
 #include "recursive_solving.h"
 #include "rela/thread_loop.h"
+#include "rela/work_stealing_pool.h"
 
 namespace rela {
 
@@ -26,10 +36,33 @@ class CVNetBufferConnector : public IValueNet {
                        std::shared_ptr<ValuePrioritizedReplay> replayBuffer)
       : modelLocker_(std::move(modelLocker)), replayBuffer_(replayBuffer) {}
 
+  CVNetBufferConnector(const CVNetBufferConnector&) = delete;
+  CVNetBufferConnector& operator=(const CVNetBufferConnector&) = delete;
+
+  // Serves all queued asynchronous queries and stops the worker.
+  ~CVNetBufferConnector() {
+    {
+      std::lock_guard<std::mutex> lk(mAsync_);
+      stopAsync_ = true;
+    }
+    cvAsync_.notify_all();
+    if (asyncWorker_.joinable()) {
+      asyncWorker_.join();
+    }
+  }
+
   torch::Tensor compute_values(const torch::Tensor queries) {
+    return compute_values(queries, /*version=*/nullptr);
+  }
+
+  // Same as above, and writes the model version that computed the values to
+  // `version`. If the model was updated in between chunks, this is the
+  // oldest version used.
+  torch::Tensor compute_values(const torch::Tensor queries, int64_t* version) {
     torch::NoGradGuard ng;
-    const int kMaxSize = 1 << 12;
+    int64_t minVersion = std::numeric_limits<int64_t>::max();
     const int size = queries.size(0);
+    torch::Tensor values;
     if (size > kMaxSize) {
       std::vector<int64_t> sizes;
       for (int start = 0; start < size; start += kMaxSize) {
@@ -39,12 +72,45 @@ class CVNetBufferConnector : public IValueNet {
       auto chunks = torch::split_with_sizes(queries, sizesArray, 0);
       std::vector<torch::Tensor> results;
       for (auto input : chunks) {
-        results.push_back(modelLocker_->forward(input));
+        results.push_back(forward(input, &minVersion));
       }
-      return torch::cat(results, 0);
+      values = torch::cat(results, 0);
     } else {
-      return modelLocker_->forward(queries);
+      values = forward(queries, &minVersion);
     }
+    if (version != nullptr) *version = minVersion;
+    return values;
+  }
+
+  // Copies the output of every chunk into its rows of `values` instead of
+  // concatenating the chunks.
+  void compute_values_into(const torch::Tensor queries, torch::Tensor values) {
+    torch::NoGradGuard ng;
+    const int size = queries.size(0);
+    for (int start = 0; start < size; start += kMaxSize) {
+      const int rows = std::min(kMaxSize, size - start);
+      values.narrow(0, start, rows)
+          .copy_(forward(queries.narrow(0, start, rows), nullptr));
+    }
+  }
+
+  // Queues the query for the worker thread of this connector, so a solver
+  // can keep updating its strategies while the query waits for the model
+  // lock and the device. The returned future is ready once the worker has
+  // written `values`; the caller waits for it inside a BlockingScope.
+  std::future<void> compute_values_async(const torch::Tensor queries,
+                                         torch::Tensor values) {
+    AsyncRequest request{queries, values, std::promise<void>()};
+    auto result = request.promise.get_future();
+    {
+      std::lock_guard<std::mutex> lk(mAsync_);
+      if (!asyncWorker_.joinable()) {
+        asyncWorker_ = std::thread([this] { asyncLoop(); });
+      }
+      asyncRequests_.push_back(std::move(request));
+    }
+    cvAsync_.notify_one();
+    return result;
   }
 
   void add_training_example(const torch::Tensor queries,
@@ -54,31 +120,206 @@ class CVNetBufferConnector : public IValueNet {
     replayBuffer_->add(transition, priority);
   }
 
+  // Model version used by the latest forward pass of this connector.
+  int64_t lastModelVersion() const { return lastModelVersion_; }
+
+  // Queries are run in chunks of at most this many rows.
+  static constexpr int kMaxSize = 1 << 12;
+
   std::shared_ptr<ModelLocker> modelLocker_;
   std::shared_ptr<ValuePrioritizedReplay> replayBuffer_;
+
+ private:
+  // Waiting for a free model and the device does not hold a core of the
+  // Context pool. Lowers *minVersion to the model version used, if given.
+  torch::Tensor forward(const torch::Tensor& queries, int64_t* minVersion) {
+    WorkStealingPool::BlockingScope blocking;
+    int64_t version;
+    auto values = modelLocker_->forward(queries, /*model_id=*/-1, &version);
+    lastModelVersion_ = version;
+    if (minVersion != nullptr) *minVersion = std::min(*minVersion, version);
+    return values;
+  }
+
+  struct AsyncRequest {
+    torch::Tensor queries;
+    torch::Tensor values;
+    std::promise<void> promise;
+  };
+
+  // Runs the asynchronous queries in submission order. Started by the first
+  // of them, so connectors that are only queried synchronously have no
+  // worker.
+  void asyncLoop() {
+    while (true) {
+      AsyncRequest request;
+      {
+        std::unique_lock<std::mutex> lk(mAsync_);
+        cvAsync_.wait(lk,
+                      [this] { return stopAsync_ || !asyncRequests_.empty(); });
+        if (asyncRequests_.empty()) {
+          // Stopped and drained.
+          return;
+        }
+        request = std::move(asyncRequests_.front());
+        asyncRequests_.pop_front();
+      }
+      try {
+        compute_values_into(request.queries, request.values);
+        request.promise.set_value();
+      } catch (...) {
+        request.promise.set_exception(std::current_exception());
+      }
+    }
+  }
+
+  std::atomic<int64_t> lastModelVersion_{-1};
+
+  std::mutex mAsync_;
+  std::condition_variable cvAsync_;
+  std::deque<AsyncRequest> asyncRequests_;
+  bool stopAsync_ = false;
+  std::thread asyncWorker_;
 };
 
 class DataThreadLoop : public ThreadLoop {
  public:
-  DataThreadLoop(std::shared_ptr<CVNetBufferConnector> connector,
+  DataThreadLoop(std::shared_ptr<IValueNet> connector,
                  const poker_dice::RecursiveSolvingParams& cfg, int seed)
       : connector_(std::move(connector)), cfg_(cfg), seed_(seed) {}
 
   virtual void mainLoop() final {
-    auto runner =
-        std::make_unique<poker_dice::RlRunner>(cfg_, connector_, seed_);
     while (!terminated()) {
       if (paused()) {
         waitUntilResume();
       }
-      runner->step();
+      step();
+    }
+  }
+
+  virtual bool hasStep() const final { return true; }
+
+  virtual void step() final {
+    if (runner_ == nullptr) {
+      runner_ =
+          std::make_unique<poker_dice::RlRunner>(cfg_, connector_, seed_);
     }
+    runner_->step();
   }
 
  private:
   std::shared_ptr<IValueNet> connector_;
   const poker_dice::RecursiveSolvingParams cfg_;
   const int seed_;
+  std::unique_ptr<poker_dice::RlRunner> runner_;
+};
+
+// Value net for runners that take turns on one thread. Asynchronous queries
+// are only collected, and flush() runs all of them through the wrapped net as
+// a single batch. Synchronous queries go to the wrapped net right away. Not
+// thread safe.
+class QueryBatcher : public IValueNet {
+ public:
+  explicit QueryBatcher(std::shared_ptr<IValueNet> net)
+      : net_(std::move(net)) {}
+
+  torch::Tensor compute_values(const torch::Tensor queries) override {
+    return net_->compute_values(queries);
+  }
+
+  std::future<void> compute_values_async(const torch::Tensor queries,
+                                         torch::Tensor values) override {
+    pending_.push_back({queries, values, std::promise<void>()});
+    return pending_.back().promise.get_future();
+  }
+
+  void add_training_example(const torch::Tensor queries,
+                            const torch::Tensor values) override {
+    net_->add_training_example(queries, values);
+  }
+
+  int numPending() const { return pending_.size(); }
+
+  void flush() {
+    if (pending_.empty()) return;
+    std::vector<Request> batch;
+    batch.swap(pending_);
+    torch::Tensor values;
+    try {
+      std::vector<torch::Tensor> queries;
+      for (const auto& request : batch) {
+        queries.push_back(request.queries);
+      }
+      values = net_->compute_values(torch::cat(queries, 0));
+    } catch (...) {
+      for (auto& request : batch) {
+        request.promise.set_exception(std::current_exception());
+      }
+      return;
+    }
+    int64_t offset = 0;
+    for (auto& request : batch) {
+      const int64_t rows = request.queries.size(0);
+      request.values.copy_(values.narrow(0, offset, rows));
+      request.promise.set_value();
+      offset += rows;
+    }
+  }
+
+ private:
+  struct Request {
+    torch::Tensor queries;
+    torch::Tensor values;
+    std::promise<void> promise;
+  };
+
+  std::shared_ptr<IValueNet> net_;
+  std::vector<Request> pending_;
+};
+
+// Plays numEpisodes episodes at a time on one thread. Every step advances
+// each runner until its solver waits for the value net, and then serves the
+// queries of all runners as one batch.
+class MultiEpisodeThreadLoop : public ThreadLoop {
+ public:
+  MultiEpisodeThreadLoop(std::shared_ptr<IValueNet> connector,
+                         const poker_dice::RecursiveSolvingParams& cfg,
+                         int seed, int numEpisodes)
+      : batcher_(std::make_shared<QueryBatcher>(std::move(connector))),
+        cfg_(cfg),
+        seed_(seed),
+        numEpisodes_(numEpisodes) {}
+
+  virtual void mainLoop() final {
+    while (!terminated()) {
+      if (paused()) {
+        waitUntilResume();
+      }
+      step();
+    }
+  }
+
+  virtual bool hasStep() const final { return true; }
+
+  virtual void step() final {
+    if (runners_.empty()) {
+      for (int i = 0; i < numEpisodes_; ++i) {
+        runners_.push_back(std::make_unique<poker_dice::RlRunner>(
+            cfg_, batcher_, seed_ * numEpisodes_ + i));
+      }
+    }
+    for (auto& runner : runners_) {
+      runner->advance();
+    }
+    batcher_->flush();
+  }
+
+ private:
+  std::shared_ptr<QueryBatcher> batcher_;
+  const poker_dice::RecursiveSolvingParams cfg_;
+  const int seed_;
+  const int numEpisodes_;
+  std::vector<std::unique_ptr<poker_dice::RlRunner>> runners_;
 };
 
 }  // namespace rela
@@ -0,0 +1,233 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "net_interface.h"
+#include "rela/work_stealing_pool.h"
+
+namespace rela {
+
+// Value net that merges queries from many solver threads into large batches.
+//
+// Callers submit query tensors and receive futures. Inference workers take
+// the pending requests once they add up to maxBatchSize rows or once the
+// oldest one has waited for the deadline, run them through the wrapped net
+// as a single batch, and split the result back. compute_values is the
+// blocking version of submit, so the server can be used anywhere an
+// IValueNet is expected.
+class InferenceServer : public IValueNet {
+ public:
+  InferenceServer(std::shared_ptr<IValueNet> net, int maxBatchSize,
+                  double deadlineMs, int numWorkers)
+      : net_(std::move(net)),
+        maxBatchSize_(maxBatchSize),
+        deadline_(std::chrono::microseconds(
+            static_cast<int64_t>(deadlineMs * 1000))) {
+    assert(maxBatchSize_ > 0);
+    assert(numWorkers > 0);
+    for (int i = 0; i < numWorkers; ++i) {
+      workers_.emplace_back([this] { workerLoop(); });
+    }
+  }
+
+  InferenceServer(const InferenceServer&) = delete;
+  InferenceServer& operator=(const InferenceServer&) = delete;
+
+  // Serves all pending requests and stops the workers.
+  ~InferenceServer() {
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Queries that wrap memory they do not own, e.g., made with from_blob, are
+  // copied, as the caller may free that memory before the batch runs.
+  std::future<torch::Tensor> submit(torch::Tensor queries) {
+    Request request;
+    request.queries =
+        queries.storage().data_ptr().get_context() == nullptr
+            ? queries.clone()
+            : std::move(queries);
+    auto future = request.promise.get_future();
+    enqueue(std::move(request));
+    return future;
+  }
+
+  // Waits for the batch, so the queries are not copied.
+  torch::Tensor compute_values(const torch::Tensor queries) override {
+    Request request;
+    request.queries = queries;
+    auto result = request.promise.get_future();
+    enqueue(std::move(request));
+    WorkStealingPool::BlockingScope blocking;
+    return result.get();
+  }
+
+  // The queries join the next batch right away. The worker that runs the
+  // batch copies the rows into `values` before the future is ready.
+  std::future<void> compute_values_async(const torch::Tensor queries,
+                                         torch::Tensor values) override {
+    Request request;
+    request.queries = queries;
+    request.values = values;
+    auto written = request.written.get_future();
+    enqueue(std::move(request));
+    return written;
+  }
+
+  void add_training_example(const torch::Tensor queries,
+                            const torch::Tensor values) override {
+    net_->add_training_example(queries, values);
+  }
+
+  int64_t numBatches() const { return numBatches_; }
+
+  int64_t numRows() const { return numRows_; }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Request {
+    torch::Tensor queries;
+    // If defined, the values are copied here and `written` is set instead of
+    // `promise`.
+    torch::Tensor values;
+    std::promise<torch::Tensor> promise;
+    std::promise<void> written;
+    Clock::time_point enqueued;
+  };
+
+  void enqueue(Request request) {
+    request.enqueued = Clock::now();
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      if (stop_) {
+        throw std::runtime_error("InferenceServer is stopped");
+      }
+      pendingRows_ += request.queries.size(0);
+      pending_.push_back(std::move(request));
+    }
+    // Wake both idle workers and the one waiting for the batch to fill.
+    cv_.notify_all();
+  }
+
+  void workerLoop() {
+    while (true) {
+      std::vector<Request> batch;
+      {
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait(lk, [this] { return stop_ || !pending_.empty(); });
+        if (pending_.empty()) {
+          // Stopped and drained.
+          return;
+        }
+        const auto deadline = pending_.front().enqueued + deadline_;
+        cv_.wait_until(lk, deadline, [this] {
+          return stop_ || pending_.empty() || pendingRows_ >= maxBatchSize_;
+        });
+        int64_t rows = 0;
+        // A single request larger than maxBatchSize_ is run on its own.
+        while (!pending_.empty() &&
+               (batch.empty() ||
+                rows + pending_.front().queries.size(0) <= maxBatchSize_)) {
+          rows += pending_.front().queries.size(0);
+          batch.push_back(std::move(pending_.front()));
+          pending_.pop_front();
+        }
+        pendingRows_ -= rows;
+      }
+      if (!batch.empty()) {
+        runBatch(&batch);
+      }
+    }
+  }
+
+  void runBatch(std::vector<Request>* batch) {
+    // Requests whose promise is set.
+    size_t numDone = 0;
+    try {
+      torch::NoGradGuard ng;
+      torch::Tensor values;
+      if (batch->size() == 1) {
+        values = net_->compute_values(batch->front().queries);
+      } else {
+        std::vector<torch::Tensor> queries;
+        for (const auto& request : *batch) {
+          queries.push_back(request.queries);
+        }
+        values = net_->compute_values(torch::cat(queries, 0));
+      }
+      ++numBatches_;
+      numRows_ += values.size(0);
+      int64_t offset = 0;
+      for (auto& request : *batch) {
+        const int64_t rows = request.queries.size(0);
+        if (request.values.defined()) {
+          request.values.copy_(values.narrow(0, offset, rows));
+          request.written.set_value();
+        } else {
+          request.promise.set_value(values.narrow(0, offset, rows));
+        }
+        offset += rows;
+        ++numDone;
+      }
+    } catch (...) {
+      for (size_t i = numDone; i < batch->size(); ++i) {
+        auto& request = (*batch)[i];
+        if (request.values.defined()) {
+          request.written.set_exception(std::current_exception());
+        } else {
+          request.promise.set_exception(std::current_exception());
+        }
+      }
+    }
+  }
+
+
+  std::shared_ptr<IValueNet> net_;
+  const int64_t maxBatchSize_;
+  const Clock::duration deadline_;
+
+  std::mutex m_;
+  std::condition_variable cv_;
+  std::deque<Request> pending_;
+  int64_t pendingRows_ = 0;
+  bool stop_ = false;
+
+  std::atomic<int64_t> numBatches_{0};
+  std::atomic<int64_t> numRows_{0};
+
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace rela
@@ -14,92 +14,216 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
-#include <stack>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
 
 #include <pybind11/pybind11.h>
 
+#include "mlp_net.h"
 #include "rela/types.h"
 
 namespace rela {
 
-template <class T>
-class Stack {
- public:
-  Stack() {}
-
-  void push(T value) {
-    {
-      std::lock_guard<std::mutex> lk(m_);
-      data_.push(value);
-    }
-    cv_.notify_one();
-  }
-
-  T pop() {
-    std::unique_lock<std::mutex> lk(m_);
-    cv_.wait(lk, [this] { return !data_.empty(); });
-    auto value = data_.top();
-    data_.pop();
-    return value;
-  }
-
- private:
-  std::stack<T> data_;
-  std::mutex m_;
-  std::condition_variable cv_;
-};
-
+// Hands out model replicas to the threads that run forward passes.
+//
+// The replicas are kept in two banks: one serves forwards while updateModel
+// loads new weights into the other and then makes it the current one by
+// bumping the version. Forwards are never paused by an update. The ones that
+// started before the switch finish on the old weights, which are only
+// overwritten by the update after the next one, once those forwards are done.
+//
+// Threads claim a replica by flipping its busy flag, and a claim only counts
+// if the version did not change in between. Threads only block when every
+// replica of the current bank is busy.
 class ModelLocker {
  public:
+  // The second bank holds deep copies of pyModels.
   ModelLocker(std::vector<pybind11::object> pyModels, const std::string& device)
-      : device(torch::Device(device)), pyModels_(pyModels) {
-    for (size_t i = 0; i < pyModels_.size(); ++i) {
-      models_.push_back(pyModels_[i].attr("_c").cast<TorchJitModel*>());
-      availableModels_.push(i);
+      : device(torch::Device(device)), numSlots_(pyModels.size()) {
+    auto deepcopy = pybind11::module::import("copy").attr("deepcopy");
+    pyModels_[0] = pyModels;
+    for (const auto& model : pyModels) {
+      pyModels_[1].push_back(deepcopy(model));
+    }
+    for (int bank : {0, 1}) {
+      slots_[bank].reset(new Slot[numSlots_]);
+      for (int i = 0; i < numSlots_; ++i) {
+        slots_[bank][i].model =
+            pyModels_[bank][i].attr("_c").cast<TorchJitModel*>();
+      }
     }
   }
 
+  // The second bank holds clones of models. Without python models
+  // updateModel only bumps the version.
   ModelLocker(std::vector<TorchJitModel*> models, const std::string& device)
-      : device(torch::Device(device)), models_(models) {
-    for (size_t i = 0; i < models.size(); ++i) availableModels_.push(i);
+      : device(torch::Device(device)), numSlots_(models.size()) {
+    for (int bank : {0, 1}) {
+      slots_[bank].reset(new Slot[numSlots_]);
+    }
+    for (int i = 0; i < numSlots_; ++i) {
+      clones_.push_back(std::make_unique<TorchJitModel>(models[i]->clone()));
+      slots_[0][i].model = models[i];
+      slots_[1][i].model = clones_.back().get();
+    }
   }
 
+  // Runs the forwards with an MlpNet built from the weights of each bank
+  // instead of the TorchScript replicas. The nets are rebuilt by every
+  // updateModel. CPU only, and the models have to be a Net2 or Net2Poker.
+  // Call before the first forward.
+  void useMlpNet() {
+    if (!device.is_cpu()) {
+      throw std::runtime_error("MlpNet only runs on the CPU");
+    }
+    std::lock_guard<std::mutex> lk(mUpdate_);
+    for (int bank : {0, 1}) {
+      loadMlpNet(bank);
+    }
+  }
+
+  // Loads the weights of pyModel into the replicas that are not in use and
+  // makes them current. Waits only for the forwards still running on the
+  // weights from two updates ago.
   void updateModel(pybind11::object pyModel) {
-    for (size_t i = 0; i < pyModels_.size(); ++i) {
-      availableModels_.pop();
+    std::lock_guard<std::mutex> lk(mUpdate_);
+    const int64_t version = version_.load();
+    const int standby = 1 - version % 2;
+    for (int i = 0; i < numSlots_; ++i) {
+      while (slots_[standby][i].busy.load()) {
+        std::this_thread::yield();
+      }
     }
-    for (auto& model : pyModels_) {
-      model.attr("load_state_dict")(pyModel.attr("state_dict")());
+    if (!pyModels_[standby].empty()) {
+      auto stateDict = pyModel.attr("state_dict")();
+      for (auto& model : pyModels_[standby]) {
+        model.attr("load_state_dict")(stateDict);
+      }
     }
-    for (size_t i = 0; i < pyModels_.size(); ++i) {
-      availableModels_.push(i);
+    if (mlpNets_[standby] != nullptr) {
+      loadMlpNet(standby);
     }
+    version_.store(version + 1);
+    // Threads waiting for a busy replica of the old bank can take the new
+    // ones.
+    std::lock_guard<std::mutex> lkWait(mWait_);
+    cvWait_.notify_all();
   }
 
-  int lock() { return availableModels_.pop(); }
+  // Number of updates so far.
+  int64_t version() const { return version_.load(); }
+
+  // Claims a replica of the current version for the caller. The returned id
+  // is passed to forward and unlock.
+  int lock(int64_t* version = nullptr) {
+    int id = tryLock(version);
+    if (id >= 0) return id;
+    std::unique_lock<std::mutex> lk(mWait_);
+    ++numWaiting_;
+    while ((id = tryLock(version)) < 0) {
+      cvWait_.wait(lk);
+    }
+    --numWaiting_;
+    return id;
+  }
 
-  void unlock(int id) { availableModels_.push(id); }
+  void unlock(int id) {
+    slot(id).busy.store(false);
+    if (numWaiting_.load() > 0) {
+      std::lock_guard<std::mutex> lk(mWait_);
+      cvWait_.notify_one();
+    }
+  }
 
-  torch::Tensor forward(torch::Tensor query, int model_id = -1) {
+  // Runs the query on a free replica, or on replica model_id claimed with
+  // lock. The version of the weights used is written to `version`.
+  torch::Tensor forward(torch::Tensor query, int model_id = -1,
+                        int64_t* version = nullptr) {
     const bool lock = model_id == -1;
-    const int id = lock ? availableModels_.pop() : model_id;
-    std::vector<torch::jit::IValue> inputs = {query.to(device)};
-    auto results = models_[id]->forward(inputs);
-    // Detach is needed to free the memory allocated to gradients. Either this
-    // or torch::NoGradGuard.
-    auto results_cpu = torch::detach(results.toTensor().to(torch::kCPU));
-    if (lock) availableModels_.push(id);
+    int64_t lockedVersion = -1;
+    const int id = lock ? this->lock(&lockedVersion) : model_id;
+    if (version != nullptr) {
+      *version = lock ? lockedVersion : slot(id).version.load();
+    }
+    torch::Tensor results_cpu;
+    if (mlpNets_[id / numSlots_] != nullptr) {
+      results_cpu = mlpNets_[id / numSlots_]->compute_values(query);
+    } else {
+      std::vector<torch::jit::IValue> inputs = {query.to(device)};
+      auto results = slot(id).model->forward(inputs);
+      // Detach is needed to free the memory allocated to gradients. Either
+      // this or torch::NoGradGuard.
+      results_cpu = torch::detach(results.toTensor().to(torch::kCPU));
+    }
+    if (lock) unlock(id);
     return results_cpu;
   }
 
   const torch::Device device;
 
  private:
-  std::vector<pybind11::object> pyModels_;
-  std::vector<TorchJitModel*> models_;
-  Stack<int> availableModels_;
+  struct alignas(64) Slot {
+    std::atomic<bool> busy{false};
+    // Version of the weights of the claim, set by the claiming thread.
+    std::atomic<int64_t> version{0};
+    TorchJitModel* model = nullptr;
+  };
+
+  Slot& slot(int id) { return slots_[id / numSlots_][id % numSlots_]; }
+
+  // All replicas of a bank hold the same weights, so they share one net.
+  // Requires mUpdate_.
+  void loadMlpNet(int bank) {
+    mlpNets_[bank] = std::make_unique<poker_dice::MlpNet>(
+        poker_dice::load_mlp_layers(*slots_[bank][0].model));
+  }
+
+  // Returns -1 if all the replicas of the current version are busy.
+  int tryLock(int64_t* version) {
+    while (true) {
+      const int64_t current = version_.load();
+      const int bank = current % 2;
+      int claimed = -1;
+      for (int i = 0; i < numSlots_ && claimed < 0; ++i) {
+        bool expected = false;
+        if (slots_[bank][i].busy.compare_exchange_strong(expected, true)) {
+          claimed = i;
+        }
+      }
+      if (claimed < 0) {
+        if (version_.load() == current) return -1;
+        continue;
+      }
+      if (version_.load() != current) {
+        // The bank may be getting new weights already.
+        slots_[bank][claimed].busy.store(false);
+        continue;
+      }
+      slots_[bank][claimed].version.store(current);
+      if (version != nullptr) *version = current;
+      return bank * numSlots_ + claimed;
+    }
+  }
+
+  const int numSlots_;
+  std::vector<pybind11::object> pyModels_[2];
+  std::vector<std::unique_ptr<TorchJitModel>> clones_;
+  std::unique_ptr<Slot[]> slots_[2];
+  // Set by useMlpNet. A bank's net is only replaced while none of its
+  // replicas is claimed.
+  std::unique_ptr<poker_dice::MlpNet> mlpNets_[2];
+  std::atomic<int64_t> version_{0};
+
+  // Serializes updates.
+  std::mutex mUpdate_;
+  // Only used by threads that found all replicas busy.
+  std::mutex mWait_;
+  std::condition_variable cvWait_;
+  std::atomic<int> numWaiting_{0};
 };
 
 }  // namespace rela
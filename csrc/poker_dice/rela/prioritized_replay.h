@@ -15,84 +15,127 @@
 #pragma once
 
 #include <stdio.h>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <vector>
 
 #include <torch/extension.h>
 
+#include "rela/replay_snapshot.h"
+#include "rela/sum_tree.h"
 #include "rela/types.h"
 
 namespace rela {
 
 using ExtractedData = std::vector<torch::Tensor>;
 
+// Ring buffer of DataType elements with weights.
+//
+// Elements are stored column-wise: every tensor of DataType::toVector() gets
+// one preallocated [capacity, ...] tensor, allocated on the first append with
+// the shapes and dtypes of the appended block. Appends copy whole blocks into
+// these columns and reads gather rows with index_select, so no per-element
+// tensors are kept.
+//
+// Appends do not take the lock unless the ring is full. Every appended row
+// gets a ticket, its position in the sequence of all rows ever appended, from
+// an atomic counter. The row is stored in slot ticket % capacity, and once it
+// is written the ticket is published in the per-slot sequence number. Readers
+// only see the safe prefix: the rows up to the first slot whose ticket is not
+// published yet. The prefix is extended under the lock by the readers
+// themselves, so a slow producer delays the visibility of later rows but
+// never blocks the other producers.
 template <class DataType>
 class ConcurrentQueue {
  public:
-  ConcurrentQueue(int capacity)
+  // With `useSumTree` the weights are also kept in a SumTree so that
+  // findSlots can sample in O(log n) per element.
+  ConcurrentQueue(int capacity, bool useSumTree = false)
       : capacity(capacity),
         head_(0),
         tail_(0),
-        size_(0),
+        popped_(0),
         allow_write_(true),
+        columnsReady_(false),
+        seq_(new std::atomic<int64_t>[capacity]),
         safeTail_(0),
-        safeSize_(0),
         sum_(0),
         evicted_(capacity, false),
-        elements_(capacity),
-        weights_(capacity, 0) {}
+        weights_(capacity, 0),
+        useSumTree_(useSumTree),
+        tree_(useSumTree ? SumTree(capacity) : SumTree()) {
+    for (int i = 0; i < capacity; ++i) {
+      seq_[i].store(-1, std::memory_order_relaxed);
+    }
+  }
 
   int safeSize(float* sum) const {
     std::unique_lock<std::mutex> lk(m_);
+    advanceSafeTail();
     if (sum != nullptr) {
       *sum = sum_;
     }
-    return safeSize_;
+    return safeTail_ - popped_.load();
   }
 
-  int size() const {
-    std::unique_lock<std::mutex> lk(m_);
-    return size_;
-  }
+  // Number of rows appended or being appended, including the ones that are
+  // not in the safe prefix yet.
+  int size() const { return tail_.load() - popped_.load(); }
 
   void blockAppend(const std::vector<DataType>& block,
                    const torch::Tensor& weights) {
-    int blockSize = block.size();
-
-    std::unique_lock<std::mutex> lk(m_);
-    cvSize_.wait(lk,
-                 [=] { return size_ + blockSize <= capacity && allow_write_; });
+    blockAppend(DataType::makeBatch(block, "cpu"), weights);
+  }
 
-    int start = tail_;
-    int end = (tail_ + blockSize) % capacity;
+  // Appends a batched element, i.e., each of its tensors has a leading
+  // dimension of the size of `weights`.
+  void blockAppend(const DataType& block, const torch::Tensor& weights) {
+    const std::vector<torch::Tensor> blockColumns = block.toVector();
+    int blockSize = weights.size(0);
 
-    tail_ = end;
-    size_ += blockSize;
-    checkSize(head_, tail_, size_);
+    if (!columnsReady_.load()) {
+      std::lock_guard<std::mutex> lk(m_);
+      if (columns_.empty()) {
+        for (const auto& column : blockColumns) {
+          auto shape = column.sizes().vec();
+          shape[0] = capacity;
+          columns_.push_back(torch::empty(shape, column.options()));
+        }
+      }
+      columnsReady_ = true;
+    }
 
-    lk.unlock();
+    const int64_t ticket = reserve(blockSize);
+    const int start = ticket % capacity;
+
+    assert(blockColumns.size() == columns_.size());
+    for (size_t c = 0; c < columns_.size(); ++c) {
+      assert(blockColumns[c].size(0) == blockSize);
+      // The block may wrap around the end of the ring.
+      const int firstPart = std::min(blockSize, capacity - start);
+      columns_[c].narrow(0, start, firstPart)
+          .copy_(blockColumns[c].narrow(0, 0, firstPart));
+      if (firstPart < blockSize) {
+        columns_[c].narrow(0, 0, blockSize - firstPart)
+            .copy_(blockColumns[c].narrow(0, firstPart, blockSize - firstPart));
+      }
+    }
 
-    float sum = 0;
     auto weightAcc = weights.accessor<float, 1>();
     assert(weightAcc.size(0) == blockSize);
     for (int i = 0; i < blockSize; ++i) {
-      int j = (start + i) % capacity;
-      elements_[j] = block[i];
-      weights_[j] = weightAcc[i];
-      sum += weightAcc[i];
+      weights_[(start + i) % capacity] = weightAcc[i];
+    }
+    // Publish after all the rows are written, so that the readers that see
+    // one ticket also see the rest of the block.
+    for (int i = 0; i < blockSize; ++i) {
+      seq_[(start + i) % capacity].store(ticket + i, std::memory_order_release);
     }
-
-    lk.lock();
-
-    cvTail_.wait(lk, [=] { return safeTail_ == start; });
-    safeTail_ = end;
-    safeSize_ += blockSize;
-    sum_ += sum;
-    checkSize(head_, safeTail_, safeSize_);
-
-    lk.unlock();
-    cvTail_.notify_all();
   }
 
   // ------------------------------------------------------------- //
@@ -100,51 +143,96 @@ class ConcurrentQueue {
   // but they are NOT thread-safe against each other
 
   void blockPop(int blockSize) {
-    double diff = 0;
-    int head = head_;
-    for (int i = 0; i < blockSize; ++i) {
-      diff -= weights_[head];
-      evicted_[head] = true;
-      head = (head + 1) % capacity;
-    }
-
     {
       std::lock_guard<std::mutex> lk(m_);
+      advanceSafeTail();
+      assert(blockSize <= safeTail_ - popped_.load());
+      double diff = 0;
+      int head = head_;
+      for (int i = 0; i < blockSize; ++i) {
+        diff -= weights_[head];
+        evicted_[head] = true;
+        if (useSumTree_) {
+          tree_.set(head, 0);
+        }
+        head = (head + 1) % capacity;
+      }
       sum_ += diff;
       head_ = head;
-      safeSize_ -= blockSize;
-      size_ -= blockSize;
-      assert(safeSize_ >= 0);
-      checkSize(head_, safeTail_, safeSize_);
+      // Hands the slots over to the producers.
+      popped_ += blockSize;
     }
     cvSize_.notify_all();
   }
 
-  void save(const std::string& fpath) {
+  // Writes every stride-th element, up to maxSize of them if positive, as a
+  // ReplaySnapshot. The priority column holds weights ** weightExponent.
+  void save(const std::string& fpath, int stride, int maxSize,
+            float weightExponent) {
+    assert(stride > 0);
     std::lock_guard<std::mutex> lk(m_);
-    FILE* stream = fopen(fpath.c_str(), "wb");
-    for (int i = 0; i < size_; ++i) {
-      elements_[i].write(stream);
+    advanceSafeTail();
+    int numRows = (safeTail_ - popped_.load() + stride - 1) / stride;
+    if (maxSize > 0) {
+      numRows = std::min(numRows, maxSize);
     }
-    fclose(stream);
+    std::vector<ReplaySnapshotColumn> specs;
+    for (const auto& column : columns_) {
+      auto shape = column.sizes().vec();
+      shape.erase(shape.begin());
+      specs.push_back({column.scalar_type(), shape});
+    }
+    specs.push_back({torch::kFloat32, {}});
+    ReplaySnapshotWriter writer(fpath, specs, numRows);
+
+    const int kChunkSize = 1 << 16;
+    for (int c = 0; c <= (int)columns_.size(); ++c) {
+      for (int start = 0; start < numRows; start += kChunkSize) {
+        const int chunkSize = std::min(kChunkSize, numRows - start);
+        std::vector<int> ids(chunkSize);
+        for (int i = 0; i < chunkSize; ++i) {
+          ids[i] = (head_ + (start + i) * stride) % capacity;
+        }
+        if (c < (int)columns_.size()) {
+          writer.writeRows(c, stride == 1 ? contiguousRows(c, ids)
+                                          : columns_[c].index_select(
+                                                0, indexTensor(ids)));
+        } else {
+          auto priorities = torch::empty({chunkSize}, torch::kFloat32);
+          auto priorityAcc = priorities.accessor<float, 1>();
+          for (int i = 0; i < chunkSize; ++i) {
+            priorityAcc[i] = std::pow(weights_[ids[i]], weightExponent);
+          }
+          writer.writeRows(c, priorities);
+        }
+      }
+    }
+    writer.close();
+  }
+
+  // Rows `ids` of column c, which are consecutive slots up to a wrap of the
+  // ring. Written without a gather copy where they do not wrap.
+  torch::Tensor contiguousRows(int c, const std::vector<int>& ids) const {
+    const int first = std::min<int>(ids.size(), capacity - ids.front());
+    auto rows = columns_[c].narrow(0, ids.front(), first);
+    if (first == (int)ids.size()) return rows;
+    return torch::cat({rows, columns_[c].narrow(0, 0, ids.size() - first)}, 0);
   }
 
   ExtractedData extract() {
     std::cerr << "Starting extract" << std::endl;
-    const int size = safeSize_;
+    const int size = safeSize(nullptr);
 
     // Create data dump.
-    std::vector<DataType> data;
+    std::vector<int> ids(size);
     std::vector<float> weights;
-    data.reserve(size);
     for (int i = 0; i < size; ++i) {
-      const auto index = (i + head_) % capacity;
-      data.push_back(elements_[index]);
-      weights.push_back(weights_[index]);
+      ids[i] = (i + head_) % capacity;
+      weights.push_back(weights_[ids[i]]);
     }
     torch::Tensor weights_tensor =
         torch::from_blob(weights.data(), {(long long)weights.size()}).clone();
-    auto batched = DataType::makeBatch(data, "cpu").toVector();
+    auto batched = gather(ids);
 
     blockPop(size);
     batched.push_back(weights_tensor);
@@ -164,16 +252,42 @@ class ConcurrentQueue {
     }
 
     std::lock_guard<std::mutex> lk_(m_);
+    if (useSumTree_) {
+      for (auto id : ids) {
+        if (!evicted_[id]) {
+          tree_.set(id, weights_[id]);
+        }
+      }
+    }
     sum_ += diff;
   }
 
+  // For each fraction in [0, 1) finds the slot where the cumulative weight of
+  // the stored elements reaches fraction * sum. Returns the number of stored
+  // elements, and the sum of their weights at lookup time through `sum`.
+  // Requires useSumTree.
+  int findSlots(const std::vector<double>& fractions, std::vector<int>* ids,
+                double* sum) const {
+    assert(useSumTree_);
+    std::lock_guard<std::mutex> lk(m_);
+    advanceSafeTail();
+    *sum = tree_.total();
+    ids->resize(fractions.size());
+    for (size_t i = 0; i < fractions.size(); ++i) {
+      (*ids)[i] = tree_.find(fractions[i] * *sum);
+    }
+    return safeTail_ - popped_.load();
+  }
+
   // ------------------------------------------------------------- //
   // accessing elements is never locked, operate safely!
 
-  DataType getElementAndMark(int idx) {
-    int id = (head_ + idx) % capacity;
-    evicted_[id] = false;
-    return elements_[id];
+  // Copies the elements in slots `ids` into a batch and marks them as sampled.
+  DataType getSlotsAndMark(const std::vector<int>& ids) {
+    for (auto id : ids) {
+      evicted_[id] = false;
+    }
+    return DataType::fromVector(gather(ids));
   }
 
   float getWeight(int idx, int* id) {
@@ -182,51 +296,102 @@ class ConcurrentQueue {
     return weights_[*id];
   }
 
+  // Same as getWeight, but takes a slot id as returned by findSlots.
+  float getSlotWeight(int id) const { return weights_[id]; }
+
   const int capacity;
 
  private:
-  void checkSize(int head, int tail, int size) {
-    if (size == 0) {
-      assert(tail == head);
-    } else if (tail > head) {
-      if (tail - head != size) {
-        std::cout << "tail-head: " << tail - head << " vs size: " << size
-                  << std::endl;
+  static torch::Tensor indexTensor(const std::vector<int>& ids) {
+    auto index = torch::empty({(int64_t)ids.size()}, torch::kLong);
+    auto indexAcc = index.accessor<int64_t, 1>();
+    for (size_t i = 0; i < ids.size(); ++i) {
+      indexAcc[i] = ids[i];
+    }
+    return index;
+  }
+
+  std::vector<torch::Tensor> gather(const std::vector<int>& ids) const {
+    const auto index = indexTensor(ids);
+    std::vector<torch::Tensor> rows;
+    for (const auto& column : columns_) {
+      rows.push_back(column.index_select(0, index));
+    }
+    return rows;
+  }
+
+  // Claims blockSize consecutive tickets. Waits for blockPop while the ring
+  // has no room for the block.
+  int64_t reserve(int blockSize) {
+    int64_t ticket = tail_.load();
+    while (true) {
+      if (ticket + blockSize - popped_.load() > capacity || !allow_write_) {
+        std::unique_lock<std::mutex> lk(m_);
+        cvSize_.wait(lk, [&] {
+          ticket = tail_.load();
+          return ticket + blockSize - popped_.load() <= capacity &&
+                 allow_write_;
+        });
       }
-      assert(tail - head == size);
-    } else {
-      if (tail + capacity - head != size) {
-        std::cout << "tail-head: " << tail + capacity - head
-                  << " vs size: " << size << std::endl;
+      if (tail_.compare_exchange_weak(ticket, ticket + blockSize)) {
+        return ticket;
+      }
+    }
+  }
+
+  // Extends the safe prefix over the rows whose tickets are published and
+  // adds them to sum_ and the sum tree. Requires m_.
+  void advanceSafeTail() const {
+    while (true) {
+      const int slot = safeTail_ % capacity;
+      if (seq_[slot].load(std::memory_order_acquire) != safeTail_) {
+        break;
+      }
+      sum_ += weights_[slot];
+      if (useSumTree_) {
+        tree_.set(slot, weights_[slot]);
       }
-      assert(tail + capacity - head == size);
+      ++safeTail_;
     }
   }
 
   mutable std::mutex m_;
   std::condition_variable cvSize_;
-  std::condition_variable cvTail_;
 
+  // Slot of the oldest row. Only changed by blockPop.
   int head_;
-  int tail_;
-  int size_;
+  // Tickets handed out to producers and rows popped so far.
+  std::atomic<int64_t> tail_;
+  std::atomic<int64_t> popped_;
   std::atomic_bool allow_write_;
+  std::atomic_bool columnsReady_;
 
-  int safeTail_;
-  int safeSize_;
-  double sum_;
+  // Ticket of the row last written to each slot, -1 for none.
+  std::unique_ptr<std::atomic<int64_t>[]> seq_;
+
+  // End of the safe prefix in tickets, and the sum of its weights. Guarded by
+  // m_ and advanced lazily by the readers.
+  mutable int64_t safeTail_;
+  mutable double sum_;
   std::vector<bool> evicted_;
 
-  std::vector<DataType> elements_;
+  std::vector<torch::Tensor> columns_;
   std::vector<float> weights_;
+
+  // Mirrors weights_ for the elements in the safe prefix. Guarded by m_.
+  const bool useSumTree_;
+  mutable SumTree tree_;
 };
 
 template <class DataType>
 class PrioritizedReplay {
  public:
+  // If use_sum_tree is set, prioritized sampling looks elements up in a sum
+  // tree in O(log n) instead of scanning the whole buffer.
   PrioritizedReplay(int capacity, int seed, float alpha, float beta,
                     int prefetch, bool use_priority,
-                    bool compressed_values = false)
+                    bool compressed_values = false,
+                    bool use_sum_tree = false)
       : alpha_(alpha)  // priority exponent
         ,
         beta_(beta)  // importance sampling exponent
@@ -235,7 +400,8 @@ class PrioritizedReplay {
         capacity_(capacity),
         use_priority_(use_priority),
         compressed_values_(compressed_values),
-        storage_(int(1.25 * capacity)),
+        use_sum_tree_(use_sum_tree),
+        storage_(int(1.25 * capacity), use_sum_tree),
         numAdd_(0) {
     rng_.seed(seed);
   }
@@ -251,13 +417,12 @@ class PrioritizedReplay {
     numAdd_ += priority.size(0);
   }
 
+  // Adds a batched element with one priority per row.
   void add(const DataType& sample, const torch::Tensor& priority) {
-    std::vector<DataType> vec;
-    int n = priority.size(0);
-    for (int i = 0; i < n; ++i) {
-      vec.push_back(sample.index(i));
-    }
-    add(vec, priority);
+    assert(priority.dim() == 1);
+    auto weights = use_priority_ ? torch::pow(priority, alpha_) : priority;
+    storage_.blockAppend(sample, weights);
+    numAdd_ += priority.size(0);
   }
 
   std::tuple<DataType, torch::Tensor> sample(int batchsize,
@@ -316,8 +481,16 @@ class PrioritizedReplay {
 
   int numAdd() const { return numAdd_; }
 
+  // Adds every stride-th element of a file written by save(), up to max_size
+  // of them if positive. All elements get `priority`; a non-positive value
+  // keeps the priorities stored in the snapshot. Files in the older
+  // per-record format are still accepted.
   void load(const std::string& fpath, float priority, int max_size,
             int stride) {
+    if (ReplaySnapshotReader::isSnapshot(fpath)) {
+      loadSnapshot_(fpath, priority, max_size, stride);
+      return;
+    }
     FILE* stream = fopen(fpath.c_str(), "rb");
     torch::Tensor priority_tensor = torch::ones(1) * priority;
     for (int added = 0, i = 0;; ++i) {
@@ -332,7 +505,9 @@ class PrioritizedReplay {
     fclose(stream);
   }
 
-  void save(const std::string& fpath) { storage_.save(fpath); }
+  void save(const std::string& fpath, int stride = 1, int max_size = -1) {
+    storage_.save(fpath, stride, max_size, use_priority_ ? 1 / alpha_ : 1);
+  }
 
   // Get context of the buffer as a vector of tensors.
   ExtractedData extract() {
@@ -361,16 +536,54 @@ class PrioritizedReplay {
   }
 
  private:
+  void loadSnapshot_(const std::string& fpath, float priority, int max_size,
+                     int stride) {
+    ReplaySnapshotReader reader(fpath);
+    const int numColumns = reader.columns().size() - 1;
+    int64_t numRows = (reader.numRows() + stride - 1) / stride;
+    if (max_size > 0) {
+      numRows = std::min<int64_t>(numRows, max_size);
+    }
+    // The storage copies the rows straight from the mapping.
+    const int64_t kChunkSize = 1 << 14;
+    for (int64_t start = 0; start < numRows; start += kChunkSize) {
+      const int64_t chunkSize = std::min(kChunkSize, numRows - start);
+      std::vector<torch::Tensor> columns;
+      for (int c = 0; c < numColumns; ++c) {
+        columns.push_back(reader.rows(c, start * stride, chunkSize, stride));
+      }
+      const torch::Tensor priorities =
+          priority > 0
+              ? torch::full({chunkSize}, priority, torch::kFloat32)
+              : reader.rows(numColumns, start * stride, chunkSize, stride)
+                    .contiguous();
+      add(DataType::fromVector(columns), priorities);
+    }
+  }
+
   using SampleWeightIds = std::tuple<DataType, torch::Tensor, std::vector<int>>;
 
   SampleWeightIds sample_(int batchsize, const std::string& device) {
-    if (use_priority_) {
+    if (use_priority_ && use_sum_tree_) {
+      return sample_with_sum_tree_(batchsize, device);
+    } else if (use_priority_) {
       return sample_with_priorities_(batchsize, device);
     } else {
       return sample_no_priorities_(batchsize, device);
     }
   }
 
+  static DataType toDevice_(const DataType& batch, const std::string& device) {
+    if (device == "cpu") {
+      return batch;
+    }
+    std::vector<torch::Tensor> tensors;
+    for (const auto& tensor : batch.toVector()) {
+      tensors.push_back(tensor.to(torch::Device(device)));
+    }
+    return DataType::fromVector(tensors);
+  }
+
   SampleWeightIds sample_with_priorities_(int batchsize,
                                           const std::string& device) {
     std::unique_lock<std::mutex> lk(mSampler_);
@@ -383,7 +596,6 @@ class PrioritizedReplay {
     float segment = sum / batchsize;
     std::uniform_real_distribution<float> dist(0.0, segment);
 
-    std::vector<DataType> samples;
     auto weights = torch::zeros({batchsize}, torch::kFloat32);
     auto weightAcc = weights.accessor<float, 1>();
     std::vector<int> ids(batchsize);
@@ -404,8 +616,6 @@ class PrioritizedReplay {
           assert(nextIdx >= 1);
           // std::cout << "\tfound: " << nextIdx - 1 << ", " << id << ", " <<
           // accSum << std::endl;
-          DataType element = storage_.getElementAndMark(nextIdx - 1);
-          samples.push_back(element);
           weightAcc[i] = w;
           ids[i] = id;
           break;
@@ -424,7 +634,52 @@ class PrioritizedReplay {
         ++nextIdx;
       }
     }
-    assert((int)samples.size() == batchsize);
+    auto batch = storage_.getSlotsAndMark(ids);
+
+    // pop storage if full
+    size = storage_.size();
+    if (size > capacity_) {
+      storage_.blockPop(size - capacity_);
+    }
+
+    // safe to unlock, because <batch> contains copys
+    lk.unlock();
+
+    weights = weights / sum;
+    weights = torch::pow(size * weights, -beta_);
+    weights /= weights.max();
+    if (device != "cpu") {
+      weights = weights.to(torch::Device(device));
+    }
+    batch = toDevice_(batch, device);
+    if (compressed_values_) {
+      batch.values = rela::dequantize(batch.values);
+    }
+    return std::make_tuple(batch, weights, ids);
+  }
+
+  // Same stratified sampling as sample_with_priorities_, but the elements are
+  // found with a sum tree lookup.
+  SampleWeightIds sample_with_sum_tree_(int batchsize,
+                                        const std::string& device) {
+    std::unique_lock<std::mutex> lk(mSampler_);
+
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    std::vector<double> fractions(batchsize);
+    for (int i = 0; i < batchsize; i++) {
+      fractions[i] = (i + dist(rng_)) / batchsize;
+    }
+    std::vector<int> ids;
+    double sum;
+    int size = storage_.findSlots(fractions, &ids, &sum);
+    assert(size > 0);
+
+    auto weights = torch::zeros({batchsize}, torch::kFloat32);
+    auto weightAcc = weights.accessor<float, 1>();
+    for (int i = 0; i < batchsize; i++) {
+      weightAcc[i] = storage_.getSlotWeight(ids[i]);
+    }
+    auto batch = storage_.getSlotsAndMark(ids);
 
     // pop storage if full
     size = storage_.size();
@@ -432,7 +687,7 @@ class PrioritizedReplay {
       storage_.blockPop(size - capacity_);
     }
 
-    // safe to unlock, because <samples> contains copys
+    // safe to unlock, because <batch> contains copys
     lk.unlock();
 
     weights = weights / sum;
@@ -441,7 +696,7 @@ class PrioritizedReplay {
     if (device != "cpu") {
       weights = weights.to(torch::Device(device));
     }
-    auto batch = DataType::makeBatch(samples, device);
+    batch = toDevice_(batch, device);
     if (compressed_values_) {
       batch.values = rela::dequantize(batch.values);
     }
@@ -458,17 +713,14 @@ class PrioritizedReplay {
 
     std::uniform_int_distribution<> dist(0, size - 1);
 
-    std::vector<DataType> samples;
     auto weights = torch::zeros({batchsize}, torch::kFloat32);
     auto weightAcc = weights.accessor<float, 1>();
     std::vector<int> ids(batchsize);
     for (int i = 0; i < batchsize; i++) {
       const int index = dist(rng_);
       weightAcc[i] = storage_.getWeight(index, &ids[i]);
-      DataType element = storage_.getElementAndMark(index);
-      samples.push_back(element);
     }
-    assert((int)samples.size() == batchsize);
+    auto batch = storage_.getSlotsAndMark(ids);
 
     // pop storage if full
     size = storage_.size();
@@ -476,9 +728,9 @@ class PrioritizedReplay {
       storage_.blockPop(size - capacity_);
     }
 
-    // safe to unlock, because <samples> contains copys
+    // safe to unlock, because <batch> contains copys
     lk.unlock();
-    auto batch = DataType::makeBatch(samples, device);
+    batch = toDevice_(batch, device);
     if (compressed_values_) {
       batch.values = rela::dequantize(batch.values);
     }
@@ -491,6 +743,7 @@ class PrioritizedReplay {
   const int capacity_;
   const bool use_priority_;
   const bool compressed_values_;
+  const bool use_sum_tree_;
 
   ConcurrentQueue<DataType> storage_;
   std::atomic<int> numAdd_;
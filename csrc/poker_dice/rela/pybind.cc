@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <stdio.h>
+#include <numeric>
 
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
@@ -25,6 +26,7 @@
 
 #include "rela/context.h"
 #include "rela/data_loop.h"
+#include "rela/inference_server.h"
 #include "rela/prioritized_replay.h"
 #include "rela/thread_loop.h"
 
@@ -33,13 +35,36 @@ using namespace rela;
 
 namespace {
 
+// With num_episodes > 1 the thread interleaves that many episodes and batches
+// their value queries.
+std::shared_ptr<ThreadLoop> create_data_loop(
+    std::shared_ptr<IValueNet> connector,
+    const poker_dice::RecursiveSolvingParams& cfg, int seed,
+    int num_episodes) {
+  if (num_episodes > 1) {
+    return std::make_shared<MultiEpisodeThreadLoop>(std::move(connector), cfg,
+                                                    seed, num_episodes);
+  }
+  return std::make_shared<DataThreadLoop>(std::move(connector), cfg, seed);
+}
+
 std::shared_ptr<ThreadLoop> create_cfr_thread(
     std::shared_ptr<ModelLocker> modelLocker,
     std::shared_ptr<ValuePrioritizedReplay> replayBuffer,
-    const poker_dice::RecursiveSolvingParams& cfg, int seed) {
+    const poker_dice::RecursiveSolvingParams& cfg, int seed,
+    int num_episodes) {
   auto connector =
       std::make_shared<CVNetBufferConnector>(modelLocker, replayBuffer);
-  return std::make_shared<DataThreadLoop>(std::move(connector), cfg, seed);
+  return create_data_loop(std::move(connector), cfg, seed, num_episodes);
+}
+
+// Same as above, but all value queries of the thread go through a shared
+// batched inference server.
+std::shared_ptr<ThreadLoop> create_cfr_thread_with_server(
+    std::shared_ptr<InferenceServer> server,
+    const poker_dice::RecursiveSolvingParams& cfg, int seed,
+    int num_episodes) {
+  return create_data_loop(std::move(server), cfg, seed, num_episodes);
 }
 
 float compute_exploitability(poker_dice::RecursiveSolvingParams params,
@@ -55,28 +80,25 @@ float compute_exploitability(poker_dice::RecursiveSolvingParams params,
   return poker_dice::compute_exploitability(game, tree_strategy, 152);
 }
 
+// Returns (mean exploitability, mse_net_traverse, mse_full_traverse,
+// per-public-hand exploitabilities, hands per second). The MSEs are not
+// computed and are always 0. With use_mlp_net the net runs on the CPU
+// without torch::jit, see poker_dice::MlpNet.
 auto compute_stats_with_net(poker_dice::RecursiveSolvingParams params,
-                            const std::string& model_path) {
+                            const std::string& model_path, int num_threads,
+                            bool use_mlp_net) {
   py::gil_scoped_release release;
   poker_dice::Game game(params.num_dice, params.num_faces);
-  std::shared_ptr<IValueNet> net =
-      poker_dice::create_torchscript_net(model_path);
-  
-  //poker_dice::print_strategy(game, unroll_tree(game), net_strategy);
-
-  float explotability_sum = 0;
-  for (int pub_hand=0 ; pub_hand < 216 ; pub_hand++)
-  {
-    const auto net_strategy =
-      compute_strategy_recursive_to_leaf(game, params.subgame_params, pub_hand, net);
-    float explotability =
-      poker_dice::compute_exploitability(game, net_strategy, pub_hand);
-    explotability_sum += explotability;
-  }
-
-
-  //return std::make_tuple(explotability_sum / 216, mse_net_traverse, mse_full_traverse);
-  return std::make_tuple(explotability_sum / 216, 0., 0.);
+  // Every worker loads its own replica of the net.
+  const auto sweep = poker_dice::compute_exploitability_sweep(
+      game, params.subgame_params,
+      [&model_path, use_mlp_net]() {
+        return use_mlp_net ? poker_dice::create_mlp_net(model_path)
+                           : poker_dice::create_torchscript_net(model_path);
+      },
+      num_threads);
+  return std::make_tuple(sweep.mean_exploitability, 0., 0.,
+                         sweep.exploitabilities, sweep.hands_per_second);
 }
 
 float compute_full_game_cfr(int pub_hand, int iterations)
@@ -91,6 +113,29 @@ float compute_full_game_cfr(int pub_hand, int iterations)
     return runner->step_test(pub_hand, iterations);
 }
 
+// Same as compute_full_game_cfr for every public hand, solving all of them in
+// one batched solver. Returns the exploitability for each public hand.
+std::vector<float> compute_full_game_cfr_all(int iterations) {
+  py::gil_scoped_release release;
+  poker_dice::Game game(2, 6);
+  poker_dice::SubgameSolvingParams params;
+  params.num_iters = iterations;
+  params.max_depth = 100;
+  params.use_cfr = true;
+  params.linear_update = true;
+  std::vector<int> public_hands(216);
+  std::iota(public_hands.begin(), public_hands.end(), 0);
+  auto solver =
+      poker_dice::build_batched_full_game_solver(game, public_hands, params);
+  solver->multistep();
+  std::vector<float> exploitabilities;
+  for (size_t i = 0; i < public_hands.size(); ++i) {
+    exploitabilities.push_back(poker_dice::compute_exploitability(
+        game, solver->get_strategy(i), public_hands[i]));
+  }
+  return exploitabilities;
+}
+
 int get_node_id(const poker_dice::Tree & tree, const poker_dice::PartialPublicState & search_state)
 {
   for (size_t node_id = 0; node_id < tree.size(); ++node_id) {
@@ -287,16 +332,17 @@ PYBIND11_MODULE(rela, m) {
                     int,    // seed,
                     float,  // alpha, priority exponent
                     float,  // beta, importance sampling exponent
-                    int, bool, bool>(),
+                    int, bool, bool, bool>(),
            py::arg("capacity"), py::arg("seed"), py::arg("alpha"),
            py::arg("beta"), py::arg("prefetch"), py::arg("use_priority"),
-           py::arg("compressed_values"))
+           py::arg("compressed_values"), py::arg("use_sum_tree") = false)
       .def("size", &ValuePrioritizedReplay::size)
       .def("num_add", &ValuePrioritizedReplay::numAdd)
       .def("sample", &ValuePrioritizedReplay::sample)
       .def("pop_until", &ValuePrioritizedReplay::popUntil)
       .def("load", &ValuePrioritizedReplay::load)
-      .def("save", &ValuePrioritizedReplay::save)
+      .def("save", &ValuePrioritizedReplay::save, py::arg("path"),
+           py::arg("stride") = 1, py::arg("max_size") = -1)
       .def("extract", &ValuePrioritizedReplay::extract)
       .def("push", &ValuePrioritizedReplay::push,
            py::call_guard<py::gil_scoped_release>())
@@ -313,12 +359,22 @@ PYBIND11_MODULE(rela, m) {
       .def_readwrite("optimistic",
                      &poker_dice::SubgameSolvingParams::optimistic)
       .def_readwrite("use_cfr", &poker_dice::SubgameSolvingParams::use_cfr)
+      .def_readwrite("num_threads",
+                     &poker_dice::SubgameSolvingParams::num_threads)
+      .def_readwrite("use_float", &poker_dice::SubgameSolvingParams::use_float)
+      .def_readwrite("float_accumulators",
+                     &poker_dice::SubgameSolvingParams::float_accumulators)
       .def_readwrite("dcfr", &poker_dice::SubgameSolvingParams::dcfr)
       .def_readwrite("dcfr_alpha",
                      &poker_dice::SubgameSolvingParams::dcfr_alpha)
       .def_readwrite("dcfr_beta", &poker_dice::SubgameSolvingParams::dcfr_beta)
       .def_readwrite("dcfr_gamma",
-                     &poker_dice::SubgameSolvingParams::dcfr_gamma);
+                     &poker_dice::SubgameSolvingParams::dcfr_gamma)
+      .def_readwrite("prune_threshold",
+                     &poker_dice::SubgameSolvingParams::prune_threshold)
+      .def_readwrite(
+          "prune_full_pass_interval",
+          &poker_dice::SubgameSolvingParams::prune_full_pass_interval);
 
   py::class_<poker_dice::RecursiveSolvingParams>(m, "RecursiveSolvingParams")
       .def(py::init<>())
@@ -340,6 +396,8 @@ PYBIND11_MODULE(rela, m) {
 
   py::class_<rela::Context>(m, "Context")
       .def(py::init<>())
+      .def(py::init<int, int>(), py::arg("num_workers"),
+           py::arg("max_threads") = 0)
       .def("push_env_thread", &rela::Context::pushThreadLoop,
            py::keep_alive<1, 2>())
       .def("start", &rela::Context::start)
@@ -350,7 +408,25 @@ PYBIND11_MODULE(rela, m) {
 
   py::class_<ModelLocker, std::shared_ptr<ModelLocker>>(m, "ModelLocker")
       .def(py::init<std::vector<py::object>, const std::string&>())
-      .def("update_model", &ModelLocker::updateModel);
+      .def("update_model", &ModelLocker::updateModel)
+      .def("use_mlp_net", &ModelLocker::useMlpNet)
+      .def("version", &ModelLocker::version);
+
+  py::class_<InferenceServer, std::shared_ptr<InferenceServer>>(
+      m, "InferenceServer")
+      .def(py::init([](std::shared_ptr<ModelLocker> modelLocker,
+                       std::shared_ptr<ValuePrioritizedReplay> replayBuffer,
+                       int maxBatchSize, double deadlineMs, int numWorkers) {
+             return std::make_shared<InferenceServer>(
+                 std::make_shared<CVNetBufferConnector>(modelLocker,
+                                                        replayBuffer),
+                 maxBatchSize, deadlineMs, numWorkers);
+           }),
+           py::arg("model_locker"), py::arg("replay"),
+           py::arg("max_batch_size") = 4096, py::arg("deadline_ms") = 1.0,
+           py::arg("num_workers") = 1)
+      .def("num_batches", &InferenceServer::numBatches)
+      .def("num_rows", &InferenceServer::numRows);
 
   m.def("compute_exploitability_fp", &compute_exploitability_no_net,
         py::arg("params"));
@@ -359,7 +435,8 @@ PYBIND11_MODULE(rela, m) {
         py::arg("params"), py::arg("model_path"));
 
   m.def("compute_stats_with_net", &compute_stats_with_net, py::arg("params"),
-        py::arg("model_path"));
+        py::arg("model_path"), py::arg("num_threads") = 0,
+        py::arg("use_mlp_net") = false);
 
 
   m.def("play_poker_dice", &play_poker_dice, py::arg("params"),
@@ -367,9 +444,16 @@ PYBIND11_MODULE(rela, m) {
 
 
   m.def("compute_full_game_cfr", &compute_full_game_cfr, py::arg("pub_hand"), py::arg("iterations"));
+  m.def("compute_full_game_cfr_all", &compute_full_game_cfr_all,
+        py::arg("iterations"));
 
   m.def("create_cfr_thread", &create_cfr_thread, py::arg("model_locker"),
-        py::arg("replay"), py::arg("cfg"), py::arg("seed"));
+        py::arg("replay"), py::arg("cfg"), py::arg("seed"),
+        py::arg("num_episodes") = 1);
+
+  m.def("create_cfr_thread", &create_cfr_thread_with_server,
+        py::arg("inference_server"), py::arg("cfg"), py::arg("seed"),
+        py::arg("num_episodes") = 1);
 
   //   m.def("create_value_policy_agent", &create_value_policy_agent,
   //         py::arg("model_locker"), py::arg("replay"),
@@ -0,0 +1,340 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <torch/extension.h>
+
+namespace rela {
+
+// Versioned columnar file format for replay buffers.
+//
+//   header   "RELASNAP", uint32 version, uint32 num_columns, int64 num_rows,
+//            then for every column: int32 dtype code, int32 row rank,
+//            int64 row shape[rank]
+//   columns  for every column, num_rows contiguous fixed-size rows starting
+//            at a 64-byte aligned offset
+//
+// The last column holds the float32 priorities of the rows. Integers are
+// stored in native byte order. As every column is a dense
+// [num_rows, row shape...] array, a reader can map the file and use the
+// columns as tensors without parsing individual records.
+struct ReplaySnapshotColumn {
+  torch::ScalarType dtype;
+  std::vector<int64_t> rowShape;
+
+  int64_t rowNumel() const {
+    int64_t numel = 1;
+    for (auto dim : rowShape) numel *= dim;
+    return numel;
+  }
+
+  int64_t rowBytes() const { return rowNumel() * dtypeSize(dtype); }
+
+  // Codes are part of the format: only append new ones.
+  static int32_t dtypeCode(torch::ScalarType dtype) {
+    switch (dtype) {
+      case torch::kFloat32:
+        return 0;
+      case torch::kByte:
+        return 1;
+      case torch::kDouble:
+        return 2;
+      case torch::kInt64:
+        return 3;
+      default:
+        throw std::runtime_error("Unsupported replay snapshot dtype");
+    }
+  }
+
+  static torch::ScalarType dtypeFromCode(int32_t code) {
+    switch (code) {
+      case 0:
+        return torch::kFloat32;
+      case 1:
+        return torch::kByte;
+      case 2:
+        return torch::kDouble;
+      case 3:
+        return torch::kInt64;
+      default:
+        throw std::runtime_error("Bad replay snapshot dtype code");
+    }
+  }
+
+  static int64_t dtypeSize(torch::ScalarType dtype) {
+    static const int64_t kSizes[] = {4, 1, 8, 8};
+    return kSizes[dtypeCode(dtype)];
+  }
+};
+
+namespace snapshot_detail {
+
+constexpr char kMagic[8] = {'R', 'E', 'L', 'A', 'S', 'N', 'A', 'P'};
+constexpr uint32_t kVersion = 1;
+constexpr int64_t kAlignment = 64;
+
+inline int64_t align(int64_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+inline int64_t headerBytes(const std::vector<ReplaySnapshotColumn>& columns) {
+  int64_t bytes = sizeof(kMagic) + 2 * sizeof(uint32_t) + sizeof(int64_t);
+  for (const auto& column : columns) {
+    bytes += 2 * sizeof(int32_t) + column.rowShape.size() * sizeof(int64_t);
+  }
+  return bytes;
+}
+
+inline std::vector<int64_t> columnOffsets(
+    const std::vector<ReplaySnapshotColumn>& columns, int64_t numRows) {
+  std::vector<int64_t> offsets;
+  int64_t offset = align(headerBytes(columns));
+  for (const auto& column : columns) {
+    offsets.push_back(offset);
+    offset = align(offset + numRows * column.rowBytes());
+  }
+  return offsets;
+}
+
+}  // namespace snapshot_detail
+
+// Writes a snapshot. Rows must be written column by column, and every column
+// must be complete before close().
+class ReplaySnapshotWriter {
+ public:
+  ReplaySnapshotWriter(const std::string& path,
+                       std::vector<ReplaySnapshotColumn> columns,
+                       int64_t numRows)
+      : columns_(std::move(columns)),
+        numRows_(numRows),
+        offsets_(snapshot_detail::columnOffsets(columns_, numRows)),
+        written_(columns_.size(), 0) {
+    stream_ = fopen(path.c_str(), "wb");
+    if (stream_ == nullptr) {
+      throw std::runtime_error("Cannot open for writing: " + path);
+    }
+    const uint32_t version = snapshot_detail::kVersion;
+    const uint32_t numColumns = columns_.size();
+    write(snapshot_detail::kMagic, sizeof(snapshot_detail::kMagic));
+    write(&version, sizeof(version));
+    write(&numColumns, sizeof(numColumns));
+    write(&numRows_, sizeof(numRows_));
+    for (const auto& column : columns_) {
+      const int32_t code = ReplaySnapshotColumn::dtypeCode(column.dtype);
+      const int32_t rank = column.rowShape.size();
+      write(&code, sizeof(code));
+      write(&rank, sizeof(rank));
+      write(column.rowShape.data(), rank * sizeof(int64_t));
+    }
+  }
+
+  ReplaySnapshotWriter(const ReplaySnapshotWriter&) = delete;
+  ReplaySnapshotWriter& operator=(const ReplaySnapshotWriter&) = delete;
+
+  ~ReplaySnapshotWriter() {
+    if (stream_ != nullptr) fclose(stream_);
+  }
+
+  // Appends a [n, row shape...] block to `column`.
+  void writeRows(int column, const torch::Tensor& rows) {
+    assert(column >= 0 && column < (int)columns_.size());
+    const auto& spec = columns_[column];
+    const int64_t n = rows.size(0);
+    assert(written_[column] + n <= numRows_);
+    const torch::Tensor data = rows.to(spec.dtype).contiguous();
+    assert(data.numel() == n * spec.rowNumel());
+    padTo(offsets_[column] + written_[column] * spec.rowBytes());
+    write(data.data_ptr(), n * spec.rowBytes());
+    written_[column] += n;
+  }
+
+  void close() {
+    for (int64_t written : written_) {
+      if (written != numRows_) {
+        throw std::runtime_error("Replay snapshot column is incomplete");
+      }
+    }
+    const bool failed = fclose(stream_) != 0;
+    stream_ = nullptr;
+    if (failed) {
+      throw std::runtime_error("Failed to write replay snapshot");
+    }
+  }
+
+ private:
+  void write(const void* data, size_t bytes) {
+    if (bytes > 0 && fwrite(data, 1, bytes, stream_) != bytes) {
+      throw std::runtime_error("Failed to write replay snapshot");
+    }
+    pos_ += bytes;
+  }
+
+  void padTo(int64_t offset) {
+    assert(offset >= pos_);
+    static const char kZeros[snapshot_detail::kAlignment] = {};
+    while (pos_ < offset) {
+      write(kZeros, std::min<int64_t>(offset - pos_, sizeof(kZeros)));
+    }
+  }
+
+  const std::vector<ReplaySnapshotColumn> columns_;
+  const int64_t numRows_;
+  const std::vector<int64_t> offsets_;
+  std::vector<int64_t> written_;
+  FILE* stream_ = nullptr;
+  int64_t pos_ = 0;
+};
+
+// Maps a snapshot into memory and exposes its columns as tensors that alias
+// the mapping. The tensors must not outlive the reader.
+class ReplaySnapshotReader {
+ public:
+  explicit ReplaySnapshotReader(const std::string& path) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      throw std::runtime_error("Cannot open replay snapshot: " + path);
+    }
+    struct stat st;
+    fstat(fd_, &st);
+    bytes_ = st.st_size;
+    if (bytes_ > 0) {
+      void* data = mmap(nullptr, bytes_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd_);
+        throw std::runtime_error("Cannot mmap replay snapshot: " + path);
+      }
+      data_ = static_cast<char*>(data);
+      madvise(data_, bytes_, MADV_SEQUENTIAL);
+    }
+    try {
+      parseHeader(path);
+    } catch (...) {
+      unmap();
+      throw;
+    }
+  }
+
+  ReplaySnapshotReader(const ReplaySnapshotReader&) = delete;
+  ReplaySnapshotReader& operator=(const ReplaySnapshotReader&) = delete;
+
+  ~ReplaySnapshotReader() { unmap(); }
+
+  // Whether the file starts with the snapshot magic.
+  static bool isSnapshot(const std::string& path) {
+    char magic[sizeof(snapshot_detail::kMagic)];
+    FILE* stream = fopen(path.c_str(), "rb");
+    if (stream == nullptr) return false;
+    const bool matches =
+        fread(magic, 1, sizeof(magic), stream) == sizeof(magic) &&
+        memcmp(magic, snapshot_detail::kMagic, sizeof(magic)) == 0;
+    fclose(stream);
+    return matches;
+  }
+
+  int64_t numRows() const { return numRows_; }
+
+  const std::vector<ReplaySnapshotColumn>& columns() const {
+    return columns_;
+  }
+
+  // Returns rows start, start + stride, ..., n of them, of `column` as a
+  // [n, row shape...] view of the mapping.
+  torch::Tensor rows(int column, int64_t start, int64_t n,
+                     int64_t stride) const {
+    assert(n == 0 || start + (n - 1) * stride < numRows_);
+    const auto& spec = columns_[column];
+    std::vector<int64_t> shape = {n};
+    shape.insert(shape.end(), spec.rowShape.begin(), spec.rowShape.end());
+    std::vector<int64_t> strides(shape.size(), 1);
+    for (int d = (int)shape.size() - 2; d >= 1; --d) {
+      strides[d] = strides[d + 1] * shape[d + 1];
+    }
+    strides[0] = stride * spec.rowNumel();
+    char* begin = data_ + offsets_[column] + start * spec.rowBytes();
+    return torch::from_blob(begin, shape, strides,
+                            torch::TensorOptions().dtype(spec.dtype));
+  }
+
+ private:
+  void unmap() {
+    if (data_ != nullptr) munmap(data_, bytes_);
+    data_ = nullptr;
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+  }
+
+  template <class T>
+  T read(int64_t* pos) const {
+    if (*pos + (int64_t)sizeof(T) > bytes_) {
+      throw std::runtime_error("Truncated replay snapshot header");
+    }
+    T value;
+    memcpy(&value, data_ + *pos, sizeof(T));
+    *pos += sizeof(T);
+    return value;
+  }
+
+  void parseHeader(const std::string& path) {
+    if (bytes_ < (int64_t)sizeof(snapshot_detail::kMagic) ||
+        memcmp(data_, snapshot_detail::kMagic,
+               sizeof(snapshot_detail::kMagic)) != 0) {
+      throw std::runtime_error("Not a replay snapshot: " + path);
+    }
+    int64_t pos = sizeof(snapshot_detail::kMagic);
+    const auto version = read<uint32_t>(&pos);
+    if (version != snapshot_detail::kVersion) {
+      throw std::runtime_error("Unsupported replay snapshot version " +
+                               std::to_string(version) + ": " + path);
+    }
+    const auto numColumns = read<uint32_t>(&pos);
+    numRows_ = read<int64_t>(&pos);
+    for (uint32_t c = 0; c < numColumns; ++c) {
+      ReplaySnapshotColumn column;
+      column.dtype = ReplaySnapshotColumn::dtypeFromCode(read<int32_t>(&pos));
+      const auto rank = read<int32_t>(&pos);
+      for (int32_t d = 0; d < rank; ++d) {
+        column.rowShape.push_back(read<int64_t>(&pos));
+      }
+      columns_.push_back(column);
+    }
+    offsets_ = snapshot_detail::columnOffsets(columns_, numRows_);
+    if (!columns_.empty() &&
+        offsets_.back() + numRows_ * columns_.back().rowBytes() > bytes_) {
+      throw std::runtime_error("Truncated replay snapshot: " + path);
+    }
+  }
+
+  int fd_ = -1;
+  char* data_ = nullptr;
+  int64_t bytes_ = 0;
+  int64_t numRows_ = 0;
+  std::vector<ReplaySnapshotColumn> columns_;
+  std::vector<int64_t> offsets_;
+};
+
+}  // namespace rela
@@ -0,0 +1,77 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <cassert>
+#include <vector>
+
+namespace rela {
+
+// Binary tree over a fixed number of non-negative weights where every inner
+// node holds the sum of its children. Both updating a weight and finding the
+// slot that covers a given cumulative weight take O(log n).
+class SumTree {
+ public:
+  SumTree() = default;
+
+  explicit SumTree(int size) : numLeaves_(1) {
+    while (numLeaves_ < size) {
+      numLeaves_ *= 2;
+    }
+    nodes_.assign(2 * numLeaves_, 0.0);
+  }
+
+  int size() const { return numLeaves_; }
+
+  double total() const { return nodes_[1]; }
+
+  double get(int slot) const { return nodes_[numLeaves_ + slot]; }
+
+  void set(int slot, double weight) {
+    assert(weight >= 0);
+    int node = numLeaves_ + slot;
+    nodes_[node] = weight;
+    // Recompute sums instead of adding deltas so that rounding errors do not
+    // accumulate over many updates.
+    for (node /= 2; node >= 1; node /= 2) {
+      nodes_[node] = nodes_[2 * node] + nodes_[2 * node + 1];
+    }
+  }
+
+  // Returns the first slot at which the cumulative weight exceeds `target`.
+  // The result always has a positive weight as long as total() > 0, even if
+  // `target` is outside of [0, total()) due to rounding.
+  int find(double target) const {
+    assert(total() > 0);
+    int node = 1;
+    while (node < numLeaves_) {
+      const double left = nodes_[2 * node];
+      if (left > 0 && (target < left || nodes_[2 * node + 1] <= 0)) {
+        node = 2 * node;
+      } else {
+        target -= left;
+        node = 2 * node + 1;
+      }
+    }
+    return node - numLeaves_;
+  }
+
+ private:
+  int numLeaves_ = 0;
+  std::vector<double> nodes_;
+};
+
+}  // namespace rela
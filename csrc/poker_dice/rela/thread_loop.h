@@ -54,10 +54,20 @@ class ThreadLoop {
 
   virtual bool terminated() { return terminated_; }
 
-  virtual bool paused() { return paused_; }
+  virtual bool paused() {
+    std::lock_guard<std::mutex> lk(mPaused_);
+    return paused_;
+  }
 
   virtual void mainLoop() = 0;
 
+  // Loops that return true here implement step() as one iteration of
+  // mainLoop. Context can then run them as tasks on a shared pool of workers
+  // instead of on threads of their own.
+  virtual bool hasStep() const { return false; }
+
+  virtual void step() {}
+
  private:
   std::atomic_bool terminated_{false};
 
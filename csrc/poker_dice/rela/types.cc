@@ -40,7 +40,7 @@ ValueTransition ValueTransition::makeBatch(
   return batch;
 }
 
-std::vector<torch::Tensor> ValueTransition::toVector() {
+std::vector<torch::Tensor> ValueTransition::toVector() const {
   return std::vector<torch::Tensor>{query, values};
 }
 
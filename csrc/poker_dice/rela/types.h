@@ -43,7 +43,7 @@ class ValueTransition {
   ValueTransition(const torch::Tensor& query, const torch::Tensor& values)
       : query(query), values(values) {}
 
-  std::vector<torch::Tensor> toVector();
+  std::vector<torch::Tensor> toVector() const;
   static ValueTransition fromVector(const std::vector<torch::Tensor>& tensors);
 
   static ValueTransition makeBatch(
@@ -0,0 +1,247 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rela {
+
+// Runs tasks on a fixed number of workers, usually one per core.
+//
+// Every thread has its own deque of tasks. Tasks submitted from a pool
+// thread go to the deque of that thread, and threads that run out of tasks
+// steal from the other end of the deques of the others. Tasks are run in
+// submission order within a deque, so tasks that resubmit themselves take
+// turns.
+//
+// At most numWorkers tasks run at a time. A task that waits for something
+// outside of the pool, e.g., for a value net, should do so inside a
+// BlockingScope: the scope hands the core over to another task, starting an
+// extra thread if none is idle, and takes a core back when the wait is over.
+// At most maxThreads threads are started in total.
+class WorkStealingPool {
+ public:
+  using Task = std::function<void()>;
+
+  WorkStealingPool(int numWorkers, int maxThreads)
+      : maxThreads_(std::max(numWorkers, maxThreads)),
+        freeCores_(numWorkers),
+        queues_(maxThreads_) {
+    assert(numWorkers > 0);
+    for (auto& queue : queues_) {
+      queue = std::make_unique<Queue>();
+    }
+    std::lock_guard<std::mutex> lk(m_);
+    for (int i = 0; i < numWorkers; ++i) {
+      startThread();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  ~WorkStealingPool() { stop(); }
+
+  // Waits for the running tasks to finish. Queued tasks and the tasks
+  // submitted from now on are dropped.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (size_t i = 0;; ++i) {
+      std::thread* thread;
+      {
+        std::lock_guard<std::mutex> lk(m_);
+        if (i == threads_.size()) break;
+        thread = &threads_[i];
+      }
+      if (thread->joinable()) thread->join();
+    }
+  }
+
+  void submit(Task task) {
+    int index;
+    if (current().pool == this) {
+      index = current().index;
+    } else {
+      // Only the deques of started threads are served without stealing, and
+      // threads only steal once their own deque is empty.
+      std::lock_guard<std::mutex> lk(m_);
+      index = nextQueue_++ % threads_.size();
+    }
+    {
+      std::lock_guard<std::mutex> lk(queues_[index]->m);
+      queues_[index]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      ++numQueued_;
+      maybeStartThread();
+    }
+    cv_.notify_all();
+  }
+
+  int numThreads() const {
+    std::lock_guard<std::mutex> lk(m_);
+    return threads_.size();
+  }
+
+  // Marks the current task as waiting. Does nothing outside of pool threads.
+  class BlockingScope {
+   public:
+    BlockingScope() : pool_(current().pool) {
+      if (pool_ != nullptr) {
+        pool_->releaseCore();
+      }
+    }
+
+    ~BlockingScope() {
+      if (pool_ != nullptr) {
+        pool_->acquireCore();
+      }
+    }
+
+    BlockingScope(const BlockingScope&) = delete;
+    BlockingScope& operator=(const BlockingScope&) = delete;
+
+   private:
+    WorkStealingPool* const pool_;
+  };
+
+ private:
+  struct Queue {
+    std::mutex m;
+    std::deque<Task> tasks;
+  };
+
+  struct Current {
+    WorkStealingPool* pool = nullptr;
+    int index = 0;
+  };
+
+  static Current& current() {
+    static thread_local Current current;
+    return current;
+  }
+
+  // Requires m_.
+  void startThread() {
+    const int index = threads_.size();
+    ++numIdle_;
+    threads_.emplace_back([this, index] { workerLoop(index); });
+  }
+
+  // Starts a thread if there are a free core and a queued task, but no
+  // thread to run it. Requires m_.
+  void maybeStartThread() {
+    if (!stop_ && freeCores_ > numResuming_ && numQueued_ > 0 &&
+        numIdle_ == 0 && (int)threads_.size() < maxThreads_) {
+      startThread();
+    }
+  }
+
+  void workerLoop(int index) {
+    current() = {this, index};
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lk(m_);
+        cv_.wait(lk, [this] {
+          return stop_ || (freeCores_ > numResuming_ && numQueued_ > 0);
+        });
+        if (stop_) return;
+        --numIdle_;
+        --freeCores_;
+        --numQueued_;
+      }
+      take(index)();
+      {
+        std::lock_guard<std::mutex> lk(m_);
+        ++numIdle_;
+        ++freeCores_;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  // Pops the oldest task of the own queue or steals the newest task of
+  // another one. The caller has claimed one of the numQueued_ tasks, so one is
+  // found eventually.
+  Task take(int index) {
+    while (true) {
+      for (int i = 0; i < maxThreads_; ++i) {
+        Queue& queue = *queues_[(index + i) % maxThreads_];
+        std::lock_guard<std::mutex> lk(queue.m);
+        if (queue.tasks.empty()) continue;
+        Task task;
+        if (i == 0) {
+          task = std::move(queue.tasks.front());
+          queue.tasks.pop_front();
+        } else {
+          task = std::move(queue.tasks.back());
+          queue.tasks.pop_back();
+        }
+        return task;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  void releaseCore() {
+    {
+      std::lock_guard<std::mutex> lk(m_);
+      ++freeCores_;
+      maybeStartThread();
+    }
+    cv_.notify_all();
+  }
+
+  // Tasks coming back from a wait get the next free core before queued
+  // tasks.
+  void acquireCore() {
+    std::unique_lock<std::mutex> lk(m_);
+    ++numResuming_;
+    cv_.wait(lk, [this] { return stop_ || freeCores_ > 0; });
+    --numResuming_;
+    if (!stop_) --freeCores_;
+  }
+
+  const int maxThreads_;
+
+  mutable std::mutex m_;
+  std::condition_variable cv_;
+  int freeCores_;
+  int numQueued_ = 0;
+  int numResuming_ = 0;
+  // Threads that are not running a task.
+  int numIdle_ = 0;
+  bool stop_ = false;
+  std::deque<std::thread> threads_;
+  // Deque for the next task submitted from outside of the pool.
+  int nextQueue_ = 0;
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+};
+
+}  // namespace rela
@@ -0,0 +1,724 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rela/context.h"
+#include "rela/data_loop.h"
+#include "rela/inference_server.h"
+#include "rela/model_locker.h"
+#include "rela/prioritized_replay.h"
+#include "rela/replay_snapshot.h"
+#include "rela/work_stealing_pool.h"
+
+using namespace rela;
+
+namespace {
+
+// Returns twice the first column of every row and records the batch sizes.
+class DoublingNet : public IValueNet {
+ public:
+  torch::Tensor compute_values(const torch::Tensor queries) override {
+    {
+      std::lock_guard<std::mutex> lk(m);
+      batch_sizes.push_back(queries.size(0));
+    }
+    auto values = torch::empty({queries.size(0), 1});
+    auto queries_acc = queries.accessor<float, 2>();
+    auto values_acc = values.accessor<float, 2>();
+    for (int i = 0; i < queries.size(0); ++i) {
+      values_acc[i][0] = 2 * queries_acc[i][0];
+    }
+    return values;
+  }
+
+  void add_training_example(const torch::Tensor /*queries*/,
+                            const torch::Tensor /*values*/) override {}
+
+  std::mutex m;
+  std::vector<int64_t> batch_sizes;
+};
+
+// Rows with ids first, first + 1, ... in the first column.
+torch::Tensor make_queries(int first, int num_rows) {
+  auto queries = torch::zeros({num_rows, 3});
+  auto acc = queries.accessor<float, 2>();
+  for (int i = 0; i < num_rows; ++i) {
+    acc[i][0] = first + i;
+  }
+  return queries;
+}
+
+// Rows first, ..., first + num_rows - 1 with query [i, 100 + i, 200 + i],
+// values [i / 2, -i], and priority i + 1.
+void add_rows(ValuePrioritizedReplay* replay, int first, int num_rows) {
+  auto query = torch::empty({num_rows, 3});
+  auto values = torch::empty({num_rows, 2});
+  auto priority = torch::empty({num_rows});
+  auto query_acc = query.accessor<float, 2>();
+  auto values_acc = values.accessor<float, 2>();
+  auto priority_acc = priority.accessor<float, 1>();
+  for (int r = 0; r < num_rows; ++r) {
+    const int i = first + r;
+    for (int c = 0; c < 3; ++c) query_acc[r][c] = 100 * c + i;
+    values_acc[r][0] = i / 2.0;
+    values_acc[r][1] = -i;
+    priority_acc[r] = i + 1;
+  }
+  replay->add(ValueTransition(query, values), priority);
+}
+
+// Checks that `data`, as returned by extract, holds rows `ids` in order.
+// Expects priorities i + 1 if `priority` is not positive.
+void expect_rows(const ExtractedData& data, const std::vector<int>& ids,
+                 float priority) {
+  ASSERT_EQ(data.size(), 3u);
+  ASSERT_EQ(data[0].size(0), (int64_t)ids.size());
+  auto query_acc = data[0].accessor<float, 2>();
+  auto values_acc = data[1].accessor<float, 2>();
+  auto priority_acc = data[2].accessor<float, 1>();
+  for (size_t r = 0; r < ids.size(); ++r) {
+    const int i = ids[r];
+    for (int c = 0; c < 3; ++c) EXPECT_EQ(query_acc[r][c], 100 * c + i);
+    EXPECT_EQ(values_acc[r][0], i / 2.0);
+    EXPECT_EQ(values_acc[r][1], -i);
+    EXPECT_NEAR(priority_acc[r], priority > 0 ? priority : i + 1, 1e-4);
+  }
+}
+
+// Weight of the row with the given id, an integer so that sums are exact.
+float row_weight(int id) { return id % 7 + 1; }
+
+// num_rows rows with ids first, first + 1, ... in every column.
+ValueTransition make_block(int first, int num_rows) {
+  auto query = torch::empty({num_rows, 2});
+  auto values = torch::empty({num_rows, 1});
+  auto query_acc = query.accessor<float, 2>();
+  auto values_acc = values.accessor<float, 2>();
+  for (int i = 0; i < num_rows; ++i) {
+    query_acc[i][0] = query_acc[i][1] = values_acc[i][0] = first + i;
+  }
+  return ValueTransition(query, values);
+}
+
+// Polls `condition` for up to ten seconds.
+template <class Condition>
+bool wait_until(Condition condition) {
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!condition()) {
+    if (std::chrono::steady_clock::now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+// Counts its steps and whether two of them ever ran at the same time, which
+// would mean that the loop was submitted twice.
+class CountingLoop : public ThreadLoop {
+ public:
+  void mainLoop() override {
+    while (!terminated()) {
+      if (paused()) {
+        waitUntilResume();
+      }
+      step();
+    }
+  }
+
+  bool hasStep() const override { return true; }
+
+  void step() override {
+    if (running.exchange(true)) ++num_overlaps;
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    ++num_steps;
+    running = false;
+  }
+
+  std::atomic<int> num_steps{0};
+  std::atomic<int> num_overlaps{0};
+  std::atomic<bool> running{false};
+};
+
+// A TorchScript module that returns its input.
+TorchJitModel make_identity_model() {
+  TorchJitModel model("IdentityNet");
+  model.define(R"(
+    def forward(self, x):
+        return x
+  )");
+  return model;
+}
+
+// A torch.nn.Linear with all weights equal to `weight` and zero biases.
+TorchJitModel make_linear(int in_size, int out_size, float weight) {
+  TorchJitModel linear("Linear");
+  linear.register_parameter("weight", torch::full({out_size, in_size}, weight),
+                            /*is_buffer=*/false);
+  linear.register_parameter("bias", torch::zeros({out_size}),
+                            /*is_buffer=*/false);
+  return linear;
+}
+
+std::string temp_path(const std::string& name) {
+  return "/tmp/rela_test_" + std::to_string(getpid()) + "_" + name;
+}
+
+}  // namespace
+
+TEST(InferenceServerTest, TestEveryRequestGetsItsRows) {
+  auto net = std::make_shared<DoublingNet>();
+  const int num_threads = 4;
+  const int num_requests = 50;
+  const int max_batch_size = 16;
+  std::atomic<int> num_wrong{0};
+  {
+    InferenceServer server(net, max_batch_size, /*deadlineMs=*/1.0,
+                           /*numWorkers=*/2);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&, t] {
+        std::vector<std::pair<int, std::future<torch::Tensor>>> futures;
+        for (int i = 0; i < num_requests; ++i) {
+          const int first = (t * num_requests + i) * 100;
+          const int num_rows = (t + i) % 5 + 1;
+          futures.emplace_back(first,
+                               server.submit(make_queries(first, num_rows)));
+        }
+        for (int i = 0; i < num_requests; ++i) {
+          auto values = futures[i].second.get();
+          const int num_rows = (t + i) % 5 + 1;
+          if (values.size(0) != num_rows) {
+            ++num_wrong;
+            continue;
+          }
+          auto acc = values.accessor<float, 2>();
+          for (int row = 0; row < num_rows; ++row) {
+            if (acc[row][0] != 2 * (futures[i].first + row)) ++num_wrong;
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  EXPECT_EQ(num_wrong, 0);
+  int64_t total_rows = 0;
+  for (int64_t size : net->batch_sizes) {
+    EXPECT_LE(size, max_batch_size);
+    total_rows += size;
+  }
+  int64_t expected_rows = 0;
+  for (int t = 0; t < num_threads; ++t) {
+    for (int i = 0; i < num_requests; ++i) expected_rows += (t + i) % 5 + 1;
+  }
+  EXPECT_EQ(total_rows, expected_rows);
+}
+
+TEST(InferenceServerTest, TestDeadlineFlushesPartialBatch) {
+  auto net = std::make_shared<DoublingNet>();
+  const auto deadline = std::chrono::milliseconds(20);
+  InferenceServer server(net, /*maxBatchSize=*/1000, /*deadlineMs=*/20.0,
+                         /*numWorkers=*/1);
+  const auto start = std::chrono::steady_clock::now();
+  auto future = server.submit(make_queries(7, 3));
+  ASSERT_EQ(future.wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+  EXPECT_GE(std::chrono::steady_clock::now() - start, deadline);
+  const auto values = future.get();
+  ASSERT_EQ(values.size(0), 3);
+  EXPECT_EQ((values.accessor<float, 2>()[2][0]), 18);
+  EXPECT_EQ(net->batch_sizes, (std::vector<int64_t>{3}));
+}
+
+TEST(InferenceServerTest, TestAsyncValuesAreWrittenBeforeReady) {
+  auto net = std::make_shared<DoublingNet>();
+  InferenceServer server(net, /*maxBatchSize=*/1000, /*deadlineMs=*/20.0,
+                         /*numWorkers=*/1);
+  auto values = torch::zeros({3, 1});
+  auto written = server.compute_values_async(make_queries(5, 3), values);
+  // The batch waits for the deadline on the worker, not for the caller.
+  EXPECT_EQ(written.wait_for(std::chrono::seconds(0)),
+            std::future_status::timeout);
+  ASSERT_EQ(written.wait_for(std::chrono::seconds(10)),
+            std::future_status::ready);
+  written.get();
+  EXPECT_EQ((values.accessor<float, 2>()[2][0]), 14);
+}
+
+TEST(InferenceServerTest, TestSubmitCopiesBorrowedQueries) {
+  auto net = std::make_shared<DoublingNet>();
+  InferenceServer server(net, /*maxBatchSize=*/1000, /*deadlineMs=*/20.0,
+                         /*numWorkers=*/1);
+  std::vector<float> buffer = {1, 0, 0, 2, 0, 0};
+  auto result = server.submit(torch::from_blob(buffer.data(), {2, 3}));
+  // The batch only runs after the deadline.
+  std::fill(buffer.begin(), buffer.end(), -1);
+  const auto values = result.get();
+  EXPECT_EQ((values.accessor<float, 2>()[0][0]), 2);
+  EXPECT_EQ((values.accessor<float, 2>()[1][0]), 4);
+}
+
+TEST(ConcurrentQueueTest, TestSafePrefixUnderConcurrentAppends) {
+  // Producers append far more rows than fit, so the ring wraps around many
+  // times and appends keep waiting for the reader to pop.
+  const int capacity = 16;
+  const int num_producers = 4;
+  const int num_blocks = 200;
+  const int id_stride = 100000;
+  ConcurrentQueue<ValueTransition> queue(capacity, /*useSumTree=*/true);
+  std::vector<int> num_rows(num_producers, 0);
+  for (int p = 0; p < num_producers; ++p) {
+    for (int b = 0; b < num_blocks; ++b) num_rows[p] += (p + b) % 3 + 1;
+  }
+
+  std::vector<std::thread> producers;
+  for (int p = 0; p < num_producers; ++p) {
+    producers.emplace_back([&, p] {
+      int next = 0;
+      for (int b = 0; b < num_blocks; ++b) {
+        const int block_size = (p + b) % 3 + 1;
+        const int first = p * id_stride + next;
+        auto weights = torch::empty({block_size});
+        for (int i = 0; i < block_size; ++i) {
+          weights.accessor<float, 1>()[i] = row_weight(first + i);
+        }
+        queue.blockAppend(make_block(first, block_size), weights);
+        next += block_size;
+      }
+    });
+  }
+
+  // The reader checks every row once before popping it. Rows of a producer
+  // have to show up in order and without gaps.
+  std::vector<int> next(num_producers, 0);
+  int num_popped = 0;
+  int num_errors = 0;
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<double> fraction(0, 1);
+  auto expect = [&](bool condition) {
+    if (!condition) ++num_errors;
+  };
+  const int total_rows = std::accumulate(num_rows.begin(), num_rows.end(), 0);
+  while (num_popped < total_rows) {
+    if (queue.safeSize(nullptr) == 0) {
+      std::this_thread::yield();
+      continue;
+    }
+    std::vector<double> fractions(8);
+    for (auto& f : fractions) f = fraction(gen);
+    std::vector<int> found;
+    double tree_total;
+    const int tree_size = queue.findSlots(fractions, &found, &tree_total);
+    float sum;
+    const int size = queue.safeSize(&sum);
+    expect(tree_size > 0 && tree_size <= size && size <= capacity);
+
+    std::vector<int> slots(size);
+    double weight_sum = 0;
+    double tree_weight_sum = 0;
+    for (int i = 0; i < size; ++i) {
+      const float weight = queue.getWeight(i, &slots[i]);
+      weight_sum += weight;
+      if (i < tree_size) tree_weight_sum += weight;
+    }
+    expect(sum == weight_sum);
+    expect(tree_total == tree_weight_sum);
+    for (int slot : found) {
+      expect(std::find(slots.begin(), slots.begin() + tree_size, slot) !=
+             slots.begin() + tree_size);
+    }
+
+    const auto rows = queue.getSlotsAndMark(slots);
+    auto query_acc = rows.query.accessor<float, 2>();
+    auto values_acc = rows.values.accessor<float, 2>();
+    for (int i = 0; i < size; ++i) {
+      const int id = query_acc[i][0];
+      const int p = id / id_stride;
+      if (p < 0 || p >= num_producers) {
+        ++num_errors;
+        continue;
+      }
+      expect(id == p * id_stride + next[p]);
+      expect(query_acc[i][1] == id && values_acc[i][0] == id);
+      expect(queue.getSlotWeight(slots[i]) == row_weight(id));
+      ++next[p];
+    }
+    queue.blockPop(size);
+    num_popped += size;
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  EXPECT_EQ(num_errors, 0);
+  EXPECT_EQ(next, num_rows);
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(WorkStealingPoolTest, TestBlockingScopeLetsQueuedTaskRun) {
+  // The only worker blocks on a task that is queued behind it.
+  WorkStealingPool pool(/*numWorkers=*/1, /*maxThreads=*/2);
+  std::promise<void> second_ran;
+  std::atomic<bool> first_done{false};
+  std::atomic<bool> first_woke{false};
+  pool.submit([&] {
+    auto ran = second_ran.get_future();
+    WorkStealingPool::BlockingScope blocking;
+    first_woke = ran.wait_for(std::chrono::seconds(10)) ==
+                 std::future_status::ready;
+    first_done = true;
+  });
+  pool.submit([&] { second_ran.set_value(); });
+  ASSERT_TRUE(wait_until([&] { return first_done.load(); }));
+  EXPECT_TRUE(first_woke);
+  EXPECT_EQ(pool.numThreads(), 2);
+}
+
+TEST(WorkStealingPoolTest, TestThreadCountIsBounded) {
+  const int max_threads = 3;
+  WorkStealingPool pool(/*numWorkers=*/2, max_threads);
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::atomic<int> num_waiting{0};
+  std::atomic<int> num_done{0};
+  const int num_tasks = 10;
+  for (int i = 0; i < num_tasks; ++i) {
+    pool.submit([&] {
+      WorkStealingPool::BlockingScope blocking;
+      ++num_waiting;
+      released.wait();
+      ++num_done;
+    });
+  }
+  ASSERT_TRUE(wait_until([&] { return num_waiting == max_threads; }));
+  // The other tasks stay queued while every thread is blocked.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(num_waiting, max_threads);
+  EXPECT_EQ(pool.numThreads(), max_threads);
+  release.set_value();
+  ASSERT_TRUE(wait_until([&] { return num_done == num_tasks; }));
+  EXPECT_EQ(pool.numThreads(), max_threads);
+}
+
+TEST(ContextTest, TestPauseParksAndResumeResubmitsOnce) {
+  const int num_loops = 3;
+  Context context(/*numWorkers=*/2);
+  std::vector<std::shared_ptr<CountingLoop>> loops;
+  for (int i = 0; i < num_loops; ++i) {
+    loops.push_back(std::make_shared<CountingLoop>());
+    context.pushThreadLoop(loops.back());
+  }
+  context.start();
+  auto all_stepped = [&](int num_steps) {
+    return wait_until([&] {
+      for (const auto& loop : loops) {
+        if (loop->num_steps < num_steps) return false;
+      }
+      return true;
+    });
+  };
+  ASSERT_TRUE(all_stepped(1));
+  for (int cycle = 0; cycle < 10; ++cycle) {
+    context.pause();
+    // Steps that were running when pausing finish, then the loops park.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::vector<int> paused_steps;
+    for (const auto& loop : loops) paused_steps.push_back(loop->num_steps);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 0; i < num_loops; ++i) {
+      EXPECT_EQ(loops[i]->num_steps, paused_steps[i]);
+    }
+    context.resume();
+    ASSERT_TRUE(all_stepped(*std::max_element(paused_steps.begin(),
+                                              paused_steps.end()) +
+                            5));
+  }
+  for (const auto& loop : loops) {
+    EXPECT_EQ(loop->num_overlaps, 0);
+  }
+  context.terminate();
+  EXPECT_TRUE(wait_until([&] { return context.terminated(); }));
+}
+
+TEST(ContextTest, TestTerminateDrains) {
+  for (bool paused : {false, true}) {
+    Context context(/*numWorkers=*/2);
+    std::vector<std::shared_ptr<CountingLoop>> loops;
+    for (int i = 0; i < 4; ++i) {
+      loops.push_back(std::make_shared<CountingLoop>());
+      context.pushThreadLoop(loops.back());
+    }
+    context.start();
+    ASSERT_TRUE(wait_until([&] { return loops.back()->num_steps > 0; }));
+    if (paused) {
+      context.pause();
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    context.terminate();
+    // Parked loops are counted as terminated too.
+    EXPECT_TRUE(wait_until([&] { return context.terminated(); }));
+    std::vector<int> num_steps;
+    for (const auto& loop : loops) num_steps.push_back(loop->num_steps);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 0; i < (int)loops.size(); ++i) {
+      EXPECT_EQ(loops[i]->num_steps, num_steps[i]);
+    }
+  }
+}
+
+TEST(ReplaySnapshotTest, TestRoundTripFromWrappedRing) {
+  // The storage holds 1.25 * 16 = 20 rows. Rows 8 to 23 are live after the
+  // second add, so the ring has wrapped.
+  const float alpha = 0.5;
+  ValuePrioritizedReplay replay(16, /*seed=*/0, alpha, /*beta=*/0.4,
+                                /*prefetch=*/0);
+  add_rows(&replay, 0, 12);
+  replay.popUntil(4);
+  add_rows(&replay, 12, 12);
+  ASSERT_EQ(replay.size(), 16);
+
+  const std::string path = temp_path("snapshot");
+  replay.save(path, /*stride=*/3, /*max_size=*/4);
+  ASSERT_TRUE(ReplaySnapshotReader::isSnapshot(path));
+
+  // Non-positive priorities keep the stored ones.
+  ValuePrioritizedReplay stored(16, /*seed=*/0, alpha, 0.4, 0);
+  stored.load(path, /*priority=*/0, /*max_size=*/-1, /*stride=*/1);
+  expect_rows(stored.extract(), {8, 11, 14, 17}, /*priority=*/0);
+
+  ValuePrioritizedReplay strided(16, /*seed=*/0, alpha, 0.4, 0);
+  strided.load(path, /*priority=*/2, /*max_size=*/-1, /*stride=*/2);
+  expect_rows(strided.extract(), {8, 14}, /*priority=*/2);
+
+  replay.save(path);
+  ValuePrioritizedReplay full(16, /*seed=*/0, alpha, 0.4, 0);
+  full.load(path, /*priority=*/-1, /*max_size=*/5, /*stride=*/3);
+  expect_rows(full.extract(), {8, 11, 14, 17, 20}, /*priority=*/0);
+  unlink(path.c_str());
+}
+
+TEST(ReplaySnapshotTest, TestRejectsBadHeader) {
+  ValuePrioritizedReplay replay(16, /*seed=*/0, 0.5, 0.4, 0);
+  add_rows(&replay, 0, 4);
+  const std::string path = temp_path("header");
+  replay.save(path);
+  std::string bytes;
+  {
+    std::ifstream stream(path, std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(stream), {});
+  }
+  auto write = [&](const std::string& data) {
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    stream.write(data.data(), data.size());
+  };
+
+  std::string bad_magic = bytes;
+  bad_magic[0] = 'X';
+  write(bad_magic);
+  EXPECT_FALSE(ReplaySnapshotReader::isSnapshot(path));
+  EXPECT_THROW(ReplaySnapshotReader{path}, std::runtime_error);
+
+  std::string bad_version = bytes;
+  const uint32_t version = 99;
+  bad_version.replace(8, sizeof(version),
+                      reinterpret_cast<const char*>(&version),
+                      sizeof(version));
+  write(bad_version);
+  EXPECT_TRUE(ReplaySnapshotReader::isSnapshot(path));
+  EXPECT_THROW(ReplaySnapshotReader{path}, std::runtime_error);
+
+  write(bytes.substr(0, bytes.size() - 8));
+  EXPECT_THROW(ReplaySnapshotReader{path}, std::runtime_error);
+  unlink(path.c_str());
+}
+
+TEST(CVNetBufferConnectorTest, TestAsyncQueriesGetTheirValues) {
+  auto model = make_identity_model();
+  auto locker = std::make_shared<ModelLocker>(
+      std::vector<TorchJitModel*>{&model}, "cpu");
+  auto connector = std::make_shared<CVNetBufferConnector>(
+      locker, /*replayBuffer=*/nullptr);
+  const int num_threads = 4;
+  const int num_requests = 20;
+  std::vector<std::future<void>> futures[num_threads];
+  std::vector<torch::Tensor> values[num_threads];
+  std::atomic<int> num_deferred{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < num_requests; ++i) {
+        const int first = (t * num_requests + i) * 100;
+        values[t].push_back(torch::empty({i % 5 + 1, 3}));
+        futures[t].push_back(connector->compute_values_async(
+            make_queries(first, i % 5 + 1), values[t].back()));
+        // The worker runs the query, not the thread that waits for it.
+        if (futures[t].back().wait_for(std::chrono::seconds(0)) ==
+            std::future_status::deferred) {
+          ++num_deferred;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_deferred, 0);
+  // The worker serves the queued queries before the connector goes away.
+  connector.reset();
+  for (int t = 0; t < num_threads; ++t) {
+    for (int i = 0; i < num_requests; ++i) {
+      futures[t][i].get();
+      const int first = (t * num_requests + i) * 100;
+      auto acc = values[t][i].accessor<float, 2>();
+      for (int row = 0; row < i % 5 + 1; ++row) {
+        EXPECT_EQ(acc[row][0], first + row);
+      }
+    }
+  }
+}
+
+TEST(ModelLockerTest, TestForwardsNeverUseABankBeingReloaded) {
+  std::vector<TorchJitModel> models;
+  for (int i = 0; i < 2; ++i) models.push_back(make_identity_model());
+  ModelLocker locker(std::vector<TorchJitModel*>{&models[0], &models[1]},
+                     "cpu");
+  const int num_threads = 4;
+  const int num_forwards = 300;
+  const int num_updates = 200;
+  std::atomic<int> num_errors{0};
+  std::atomic<bool> done{false};
+
+  // updateModel loads the bank of version v while moving to version v + 2,
+  // so the version cannot pass v + 1 while a replica of version v is held.
+  std::thread updater([&] {
+    for (int i = 0; i < num_updates; ++i) {
+      locker.updateModel(pybind11::object());
+      std::this_thread::yield();
+    }
+    done = true;
+  });
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      const auto query = make_queries(t, 2);
+      for (int i = 0; i < num_forwards || !done; ++i) {
+        int64_t version;
+        if (i % 2 == 0) {
+          const int64_t before = locker.version();
+          const auto values = locker.forward(query, /*model_id=*/-1, &version);
+          if (version < before || version > locker.version()) ++num_errors;
+          if (!values.equal(query)) ++num_errors;
+        } else {
+          const int id = locker.lock(&version);
+          for (int k = 0; k < 3; ++k) {
+            if (locker.version() > version + 1) ++num_errors;
+            if (!locker.forward(query, id).equal(query)) ++num_errors;
+            std::this_thread::yield();
+          }
+          if (locker.version() > version + 1) ++num_errors;
+          locker.unlock(id);
+        }
+      }
+    });
+  }
+  updater.join();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_errors, 0);
+  EXPECT_EQ(locker.version(), num_updates);
+}
+
+TEST(ModelLockerTest, TestMlpNetIsRebuiltOnUpdate) {
+  // A Net2 with one hidden layer: body.0 is Linear(3, 4) and output is
+  // Linear(4, 2), so every value is 4 * gelu(w * q[0]).
+  auto hidden = make_linear(3, 4, 0.5);
+  // Shares the storage of the parameter of the module.
+  auto hidden_weight = hidden.attr("weight").toTensor();
+  TorchJitModel body("Sequential");
+  body.register_module("0", hidden);
+  TorchJitModel model("Net2");
+  model.register_module("body", body);
+  model.register_module("output", make_linear(4, 2, 1.0));
+  ModelLocker locker(std::vector<TorchJitModel*>{&model}, "cpu");
+  locker.useMlpNet();
+
+  const auto query = make_queries(1, 3);
+  auto expected = [&](float w) {
+    auto values = torch::empty({3, 2});
+    for (int row = 0; row < 3; ++row) {
+      const float x = w * (1 + row);
+      const float gelu = 0.5f * x * (1 + std::erf(x / std::sqrt(2.0f)));
+      for (int j = 0; j < 2; ++j) values.accessor<float, 2>()[row][j] = 4 * gelu;
+    }
+    return values;
+  };
+  const auto old_values = expected(0.5);
+  const auto new_values = expected(1.0);
+  auto matches = [](const torch::Tensor& values, const torch::Tensor& ref) {
+    auto acc = values.accessor<float, 2>();
+    auto ref_acc = ref.accessor<float, 2>();
+    for (int row = 0; row < 3; ++row) {
+      for (int j = 0; j < 2; ++j) {
+        if (std::abs(acc[row][j] - ref_acc[row][j]) > 1e-5) return false;
+      }
+    }
+    return true;
+  };
+  EXPECT_TRUE(matches(locker.forward(query), old_values));
+
+  // Only the first bank sees the new weights, and only once updateModel
+  // makes it current again.
+  hidden_weight.fill_(1.0);
+  std::atomic<bool> done{false};
+  std::atomic<int> num_errors{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([&] {
+      while (!done) {
+        const auto values = locker.forward(query);
+        if (!matches(values, old_values) && !matches(values, new_values)) {
+          ++num_errors;
+        }
+      }
+    });
+  }
+  EXPECT_TRUE(matches(locker.forward(query), old_values));
+  locker.updateModel(pybind11::object());
+  EXPECT_TRUE(matches(locker.forward(query), old_values));
+  locker.updateModel(pybind11::object());
+  EXPECT_TRUE(matches(locker.forward(query), new_values));
+  done = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(num_errors, 0);
+}
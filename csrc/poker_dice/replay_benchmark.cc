@@ -0,0 +1,251 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Times prioritized sampling from a full replay buffer with the linear
+// cumulative-sum scan and with the sum tree, and extracting the whole buffer.
+// With --snapshot_path also compares saving and loading the buffer in the
+// per-record format and as a mapped snapshot, and checks that both load the
+// rows and priorities that were saved.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <torch/torch.h>
+
+#include "rela/prioritized_replay.h"
+
+using namespace rela;
+
+namespace {
+
+struct Timer {
+  std::chrono::time_point<std::chrono::system_clock> start =
+      std::chrono::system_clock::now();
+
+  double tick() {
+    const auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    return diff.count();
+  }
+};
+
+void fill(ValuePrioritizedReplay* replay, int num_entries, int query_size,
+          int values_size) {
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<float> dist(0.1, 1.0);
+  const int kBlockSize = 1024;
+  for (int start = 0; start < num_entries; start += kBlockSize) {
+    const int block_size = std::min(kBlockSize, num_entries - start);
+    std::vector<ValueTransition> block;
+    block.reserve(block_size);
+    auto priority = torch::zeros({block_size}, torch::kFloat32);
+    auto priority_acc = priority.accessor<float, 1>();
+    for (int i = 0; i < block_size; ++i) {
+      // Distinct rows, so that loading the wrong rows changes the checksum.
+      block.emplace_back(torch::full({query_size}, (start + i) % 1000),
+                         torch::full({values_size}, (start + i) % 999));
+      priority_acc[i] = dist(gen);
+    }
+    replay->add(block, priority);
+  }
+}
+
+// Returns seconds per sample() + updatePriority() round.
+double run(ValuePrioritizedReplay* replay, int batch_size, int num_batches) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> dist(0.1, 1.0);
+  auto priority = torch::zeros({batch_size}, torch::kFloat32);
+  Timer t;
+  for (int i = 0; i < num_batches; ++i) {
+    replay->sample(batch_size, "cpu");
+    auto priority_acc = priority.accessor<float, 1>();
+    for (int j = 0; j < batch_size; ++j) priority_acc[j] = dist(gen);
+    replay->updatePriority(priority);
+  }
+  return t.tick() / num_batches;
+}
+
+// Writes the buffer in the per-record format that load() still accepts.
+void save_records(ValuePrioritizedReplay* replay, const std::string& path) {
+  const auto data = replay->extract();
+  FILE* stream = fopen(path.c_str(), "wb");
+  for (int64_t i = 0; i < data[0].size(0); ++i) {
+    ValueTransition(data[0][i], data[1][i]).write(stream);
+  }
+  fclose(stream);
+}
+
+// Sum of all values weighted by position, so that the checksum depends on
+// the order of the rows and of the columns.
+double checksum(const torch::Tensor& tensor) {
+  const auto data = tensor.to(torch::kFloat32).contiguous().view({-1});
+  const float* values = data.data_ptr<float>();
+  double sum = 0;
+  for (int64_t i = 0; i < data.numel(); ++i) {
+    sum += values[i] * (i % 7919 + 1);
+  }
+  return sum;
+}
+
+// Checksums of the queries, values, and priorities. Empties the buffer.
+std::vector<double> checksums(ValuePrioritizedReplay* replay) {
+  std::vector<double> sums;
+  for (const auto& tensor : replay->extract()) {
+    sums.push_back(checksum(tensor));
+  }
+  return sums;
+}
+
+// Whether the first n checksums agree up to float rounding.
+bool match(const std::vector<double>& sums,
+           const std::vector<double>& expected, int n) {
+  for (int i = 0; i < n; ++i) {
+    if (std::abs(sums[i] - expected[i]) > 1e-6 * std::abs(expected[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void compare_save_load(int num_entries, int query_size, int values_size,
+                       const std::string& path) {
+  const double gigabytes =
+      double(num_entries) * (query_size + values_size + 1) * 4 / (1 << 30);
+  std::cout << "save/load " << num_entries << " rows, " << gigabytes
+            << " GB\n";
+  auto make_replay = [&] {
+    return std::make_unique<ValuePrioritizedReplay>(
+        num_entries, /*seed=*/0, /*alpha=*/1.0, /*beta=*/0.4,
+        /*prefetch=*/0, /*use_priority=*/true);
+  };
+  const std::string records_path = path + ".records";
+  std::vector<double> expected;
+  double snapshot_save, snapshot_load, records_save, records_load;
+  {
+    auto replay = make_replay();
+    fill(replay.get(), num_entries, query_size, values_size);
+    Timer t;
+    replay->save(path);
+    const double secs = snapshot_save = t.tick();
+    std::cout << "snapshot: save " << secs * 1e3 << "ms ("
+              << gigabytes / secs << " GB/s)";
+    expected = checksums(replay.get());
+  }
+  {
+    auto replay = make_replay();
+    Timer t;
+    replay->load(path, /*priority=*/0, /*max_size=*/-1, /*stride=*/1);
+    const double secs = snapshot_load = t.tick();
+    std::cout << " load " << secs * 1e3 << "ms (" << gigabytes / secs
+              << " GB/s, " << replay->size() << " rows)";
+    std::cout << (match(checksums(replay.get()), expected, 3)
+                      ? " contents match\n"
+                      : " CONTENTS DIFFER\n");
+  }
+  {
+    auto replay = make_replay();
+    fill(replay.get(), num_entries, query_size, values_size);
+    Timer t;
+    save_records(replay.get(), records_path);
+    records_save = t.tick();
+    std::cout << "records: save " << records_save * 1e3 << "ms";
+  }
+  {
+    auto replay = make_replay();
+    Timer t;
+    replay->load(records_path, /*priority=*/1.0, /*max_size=*/-1,
+                 /*stride=*/1);
+    const double secs = records_load = t.tick();
+    std::cout << " load " << secs * 1e3 << "ms (" << gigabytes / secs
+              << " GB/s, " << replay->size() << " rows)";
+    // The per-record format has no priorities.
+    std::cout << (match(checksums(replay.get()), expected, 2)
+                      ? " contents match\n"
+                      : " CONTENTS DIFFER\n");
+  }
+  std::cout << "snapshot speedup: save " << records_save / snapshot_save
+            << "x load " << records_load / snapshot_load << "x\n";
+  std::remove(records_path.c_str());
+  std::remove(path.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int num_entries = 1 << 20;
+  int batch_size = 512;
+  int num_batches = 50;
+  int query_size = 8;
+  int values_size = 36;
+  bool skip_sampling = false;
+  std::string snapshot_path;
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--num_entries") {
+        assert(i + 1 < argc);
+        num_entries = std::stoi(argv[++i]);
+      } else if (arg == "--batch_size") {
+        assert(i + 1 < argc);
+        batch_size = std::stoi(argv[++i]);
+      } else if (arg == "--num_batches") {
+        assert(i + 1 < argc);
+        num_batches = std::stoi(argv[++i]);
+      } else if (arg == "--query_size") {
+        assert(i + 1 < argc);
+        query_size = std::stoi(argv[++i]);
+      } else if (arg == "--values_size") {
+        assert(i + 1 < argc);
+        values_size = std::stoi(argv[++i]);
+      } else if (arg == "--skip_sampling") {
+        skip_sampling = true;
+      } else if (arg == "--snapshot_path") {
+        assert(i + 1 < argc);
+        snapshot_path = argv[++i];
+      } else {
+        std::cerr << "Unknown flag: " << arg << "\n";
+        return -1;
+      }
+    }
+  }
+
+  std::cout << "entries=" << num_entries << " batch_size=" << batch_size
+            << "\n";
+  for (bool use_sum_tree : {false, true}) {
+    if (skip_sampling) break;
+    ValuePrioritizedReplay replay(num_entries, /*seed=*/0, /*alpha=*/1.0,
+                                  /*beta=*/0.4, /*prefetch=*/0,
+                                  /*use_priority=*/true,
+                                  /*compressed_values=*/false, use_sum_tree);
+    fill(&replay, num_entries, query_size, values_size);
+    const double secs = run(&replay, batch_size, num_batches);
+    Timer t;
+    const auto extracted = replay.extract();
+    const double extract_secs = t.tick();
+    std::cout << (use_sum_tree ? "sum_tree" : "linear_scan") << ": "
+              << secs * 1e3 << "ms per batch, extract "
+              << extracted[0].size(0) << " rows in " << extract_secs * 1e3
+              << "ms\n";
+  }
+  if (!snapshot_path.empty()) {
+    compare_save_load(num_entries, query_size, values_size, snapshot_path);
+  }
+}
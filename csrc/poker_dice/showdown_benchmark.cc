@@ -0,0 +1,142 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares the pairwise showdown evaluation against compute_win_probability
+// on all 216 public hands and reports the cost of a full-game CFR iteration.
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "poker_dice.h"
+#include "subgame_solving.h"
+#include "util.h"
+
+using namespace poker_dice;
+
+namespace {
+
+constexpr int kNumPublicHands = 216;
+
+struct Timer {
+  std::chrono::time_point<std::chrono::system_clock> start =
+      std::chrono::system_clock::now();
+
+  double tick() {
+    const auto end = std::chrono::system_clock::now();
+    std::chrono::duration<double> diff = end - start;
+    return diff.count();
+  }
+};
+
+// The O(H^2) reference: compare every pair of hands.
+std::vector<double> compute_win_probability_pairwise(
+    int public_hand, const Game& game, const std::vector<double>& beliefs) {
+  std::vector<double> values(game.num_hands());
+  for (int myhand = 0; myhand < game.num_hands(); ++myhand) {
+    for (int ophand = 0; ophand < game.num_hands(); ++ophand) {
+      values[myhand] +=
+          beliefs[ophand] * game.utility(myhand, ophand, public_hand);
+    }
+  }
+  return values;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int num_repeats = 200;
+  int cfr_iters = 64;
+  {
+    for (int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if (arg == "--num_repeats") {
+        assert(i + 1 < argc);
+        num_repeats = std::stoi(argv[++i]);
+      } else if (arg == "--cfr_iters") {
+        assert(i + 1 < argc);
+        cfr_iters = std::stoi(argv[++i]);
+      } else {
+        std::cerr << "Unknown flag: " << arg << "\n";
+        return -1;
+      }
+    }
+  }
+
+  const Game game(2, 6);
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<double> dist(0, 1);
+  std::vector<std::vector<double>> beliefs(kNumPublicHands);
+  for (auto& b : beliefs) {
+    b.resize(game.num_hands());
+    for (auto& v : b) v = dist(gen);
+  }
+
+  double max_diff = 0;
+  for (int pub_hand = 0; pub_hand < kNumPublicHands; ++pub_hand) {
+    const auto expected =
+        compute_win_probability_pairwise(pub_hand, game, beliefs[pub_hand]);
+    const auto actual =
+        compute_win_probability(pub_hand, game, beliefs[pub_hand]);
+    for (int hand = 0; hand < game.num_hands(); ++hand) {
+      max_diff = std::max(max_diff, std::abs(expected[hand] - actual[hand]));
+    }
+  }
+  std::cout << "max |pairwise - sweep| = " << max_diff << "\n";
+
+  double checksum = 0;
+  double pairwise_secs, sweep_secs;
+  {
+    Timer t;
+    for (int r = 0; r < num_repeats; ++r) {
+      for (int pub_hand = 0; pub_hand < kNumPublicHands; ++pub_hand) {
+        checksum += compute_win_probability_pairwise(pub_hand, game,
+                                                     beliefs[pub_hand])[0];
+      }
+    }
+    pairwise_secs = t.tick() / num_repeats;
+  }
+  {
+    Timer t;
+    for (int r = 0; r < num_repeats; ++r) {
+      for (int pub_hand = 0; pub_hand < kNumPublicHands; ++pub_hand) {
+        checksum +=
+            compute_win_probability(pub_hand, game, beliefs[pub_hand])[0];
+      }
+    }
+    sweep_secs = t.tick() / num_repeats;
+  }
+  std::cout << "216-hand showdown sweep: pairwise=" << pairwise_secs * 1e6
+            << "us sweep=" << sweep_secs * 1e6
+            << "us speedup=" << pairwise_secs / sweep_secs
+            << " (checksum=" << checksum << ")\n";
+
+  SubgameSolvingParams params;
+  params.num_iters = cfr_iters;
+  params.max_depth = 100;
+  params.use_cfr = true;
+  params.linear_update = true;
+  Timer t;
+  for (int pub_hand = 0; pub_hand < kNumPublicHands; ++pub_hand) {
+    auto solver = build_solver(game, game.get_initial_state(pub_hand),
+                               get_initial_beliefs(game), params,
+                               /*net=*/nullptr);
+    solver->multistep();
+  }
+  const double secs = t.tick();
+  std::cout << "Full-game CFR over 216 public hands: "
+            << secs / cfr_iters * 1e3 << "ms per iteration\n";
+}
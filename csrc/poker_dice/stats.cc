@@ -14,13 +14,19 @@
 
 #include "stats.h"
 
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <torch/torch.h>
 
 #include "poker_dice.h"
 #include "net_interface.h"
+#include "recursive_solving.h"
 #include "subgame_solving.h"
 #include "util.h"
 
@@ -46,7 +52,8 @@ float eval_net(const Game& game, const TreeStrategy& net_strategy,
                std::shared_ptr<IValueNet> net, bool traverse_by_net,
                bool verbose) {
   std::cerr << "DANGEROUS TODO!!!\n";
-  const auto full_tree = unroll_tree(game, 152);
+  const auto full_tree_ptr = get_cached_tree(game, 152);
+  const Tree& full_tree = *full_tree_ptr;
   const auto net_stats = compute_stategy_stats(game, net_strategy);
   const auto true_stats = compute_stategy_stats(game, full_strategy);
   if (verbose) {
@@ -153,4 +160,60 @@ float eval_net(const Game& game, const TreeStrategy& net_strategy,
   return mse;
 }
 
+ExploitabilitySweep compute_exploitability_sweep(
+    const Game& game, const SubgameSolvingParams& params,
+    const std::function<std::shared_ptr<IValueNet>()>& net_factory,
+    int num_threads) {
+  const int num_public_hands = game.num_public_hands();
+  num_threads = std::max(1, std::min(num_threads, num_public_hands));
+  // Every worker runs its own net, so the intra-op pools of the nets share
+  // the cores instead of each taking all of them. Restored for the caller at
+  // the end.
+  const int caller_intra_op_threads = at::get_num_threads();
+  const int intra_op_threads = std::max<int>(
+      1, std::thread::hardware_concurrency() / num_threads);
+
+  ExploitabilitySweep result;
+  result.exploitabilities.resize(num_public_hands);
+  std::atomic<int> next_hand{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  const auto start = std::chrono::steady_clock::now();
+
+  auto worker = [&]() {
+    try {
+      at::set_num_threads(intra_op_threads);
+      const auto net = net_factory();
+      for (int pub_hand = next_hand++; pub_hand < num_public_hands;
+           pub_hand = next_hand++) {
+        const auto strategy =
+            compute_strategy_recursive_to_leaf(game, params, pub_hand, net);
+        const auto values = compute_exploitability2(game, strategy, pub_hand);
+        result.exploitabilities[pub_hand] = (values[0] + values[1]) / 2.0;
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = std::current_exception();
+      // Let the other workers drain the queue.
+      next_hand = num_public_hands;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  at::set_num_threads(caller_intra_op_threads);
+  if (error) std::rethrow_exception(error);
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  result.mean_exploitability =
+      vector_sum(result.exploitabilities) / num_public_hands;
+  result.hands_per_second = num_public_hands / elapsed.count();
+  return result;
+}
+
 }  // namespace liars_dice
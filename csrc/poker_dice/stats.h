@@ -14,7 +14,9 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
+#include <vector>
 
 #include "poker_dice.h"
 #include "net_interface.h"
@@ -27,4 +29,24 @@ float eval_net(const Game& game, const TreeStrategy& net_strategy,
                std::shared_ptr<IValueNet> net, bool traverse_by_net,
                bool verbose);
 
+struct ExploitabilitySweep {
+  // Exploitability of the recursive-to-leaf strategy for each public hand.
+  std::vector<double> exploitabilities;
+  // Mean over public hands. Summed in public hand order, so the value does not
+  // depend on the number of threads.
+  double mean_exploitability;
+  // Wall-clock throughput of the whole sweep.
+  double hands_per_second;
+};
+
+// Computes compute_strategy_recursive_to_leaf and its exploitability for every
+// public hand. Public hands are handed out to num_threads workers (one if
+// num_threads <= 0). Each worker calls net_factory once and uses the returned
+// net exclusively, with an intra-op thread pool of cores / num_threads
+// threads. The results do not depend on num_threads.
+ExploitabilitySweep compute_exploitability_sweep(
+    const Game& game, const SubgameSolvingParams& params,
+    const std::function<std::shared_ptr<IValueNet>()>& net_factory,
+    int num_threads);
+
 }  // namespace liars_dice
@@ -15,16 +15,23 @@
 #include "subgame_solving.h"
 
 #include <algorithm>
+#include <chrono>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <stdexcept>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 #include <torch/torch.h>
 
+#include "cfr_kernels.h"
 #include "net_interface.h"
 #include "real_net.h"
+#include "rela/work_stealing_pool.h"
+#include "thread_pool.h"
 #include "util.h"
 #include "poker_dice.h"
 
@@ -32,53 +39,91 @@ namespace poker_dice {
 
 namespace {
 
-template <class T>
-void init_nd(int a, int b, T value, std::vector<std::vector<T>>* array) {
+// Precision policies of the solvers. Value is the type of the strategies,
+// reaches, and values of a traversal. Accumulator is the type of the regrets
+// and strategy sums, which add up many small updates over the iterations.
+struct DoublePrecision {
+  using Value = double;
+  using Accumulator = double;
+};
+
+struct FloatPrecision {
+  using Value = float;
+  using Accumulator = float;
+};
+
+// Float traversals with double regrets and sums.
+struct MixedPrecision {
+  using Value = float;
+  using Accumulator = double;
+};
+
+template <class T, class U>
+void init_nd(int a, int b, U value, std::vector<std::vector<T>>* array) {
   array->resize(a);
   for (int i = 0; i < a; ++i) {
     (*array)[i].assign(b, value);
   }
 }
 
-template <class T>
-void init_nd(int a, int b, int c, T value,
-             std::vector<std::vector<std::vector<T>>>* array) {
-  array->resize(a);
-  for (auto& subarray : *array) {
-    init_nd(b, c, value, &subarray);
+// Computes the reaches of compute_reach_probabilities for nodes
+// [node_begin, node_end) of a single level and hands [hand_begin, hand_end).
+// The reaches of the level above must be computed already.
+template <class Strategy, class T>
+void propagate_level_reaches(
+    const TreeLevels& levels, const Strategy& strategy,
+    const std::vector<double>& initial_beliefs, int player, int node_begin,
+    int node_end, int hand_begin, int hand_end,
+    std::vector<std::vector<T>>* reach_probabilities) {
+  const int stride = strategy.hand_stride();
+  for (int node_id = node_begin; node_id < node_end; ++node_id) {
+    T* reaches = (*reach_probabilities)[node_id].data();
+    const int parent = levels.parents[node_id];
+    if (parent < 0) {
+      std::copy(initial_beliefs.begin() + hand_begin,
+                initial_beliefs.begin() + hand_end, reaches + hand_begin);
+      continue;
+    }
+    const T* parent_reaches = (*reach_probabilities)[parent].data();
+    if (levels.player_ids[parent] == player) {
+      const auto* action_probs =
+          strategy.action_data(parent, levels.actions[node_id]);
+      for (int hand = hand_begin; hand < hand_end; ++hand) {
+        reaches[hand] = parent_reaches[hand] * action_probs[hand * stride];
+      }
+    } else {
+      std::copy(parent_reaches + hand_begin, parent_reaches + hand_end,
+                reaches + hand_begin);
+    }
   }
 }
 
 // For each node `x` and hand `h` computes
 // P(root->x, h | beliefs) := pi^{player}(root->x|h) * P(h).
-void compute_reach_probabilities(const Game& game,
-    const Tree& tree, const TreeStrategy& strategy,
+template <class Strategy, class T>
+void compute_reach_probabilities(
+    const TreeLevels& levels, const Strategy& strategy,
     const std::vector<double>& initial_beliefs, int player,
-    std::vector<std::vector<double>>* reach_probabilities) {
-  const auto num_hands = initial_beliefs.size();
-
-
-  for (size_t node_id = 0; node_id < tree.size(); ++node_id) {
-    if (node_id == 0) {
-      (*reach_probabilities)[node_id] = initial_beliefs;
-    } else {
-      const auto& node = tree[node_id];
-      const auto& state = node.state;
-      const auto last_action_player_id = tree[node.parent].state.player_id;
-
-      const Action last_action = game.deduce_last_action(state, tree[node.parent].state);
-
-      if (player == last_action_player_id) {
-        for (size_t hand = 0; hand < num_hands; ++hand) {
-          (*reach_probabilities)[node_id][hand] =
-              (*reach_probabilities)[node.parent][hand] *
-              strategy[node.parent][hand][last_action];
-        }
-      } else {
-        (*reach_probabilities)[node_id] = (*reach_probabilities)[node.parent];
-      }
-    }
+    std::vector<std::vector<T>>* reach_probabilities) {
+  const int num_hands = initial_beliefs.size();
+  for (int node_id = 0; node_id < levels.num_nodes(); ++node_id) {
+    (*reach_probabilities)[node_id].resize(num_hands);
   }
+  for (int level = 0; level < levels.num_levels(); ++level) {
+    propagate_level_reaches(levels, strategy, initial_beliefs, player,
+                            levels.level_offsets[level],
+                            levels.level_offsets[level + 1], 0, num_hands,
+                            reach_probabilities);
+  }
+}
+
+template <class Strategy, class T>
+void compute_reach_probabilities(const Game& game,
+    const Tree& tree, const Strategy& strategy,
+    const std::vector<double>& initial_beliefs, int player,
+    std::vector<std::vector<T>>* reach_probabilities) {
+  compute_reach_probabilities(build_tree_levels(game, tree), strategy,
+                              initial_beliefs, player, reach_probabilities);
 }
 
 std::vector<double> compute_expected_terminal_values(
@@ -122,10 +167,11 @@ size_t get_query_size(const Game& game) {
   return 1 + 1 + game.max_bid + game.num_hands() * 2 + 216;
 }
 
+template <class T>
 int64_t write_query_to(const Game& game, int traverser,
                        const PartialPublicState& state,
-                       const std::vector<double>& reaches1,
-                       const std::vector<double>& reaches2, float* buffer) {
+                       const std::vector<T>& reaches1,
+                       const std::vector<T>& reaches2, float* buffer) {
   int64_t write_index = 0;
   buffer[write_index++] = static_cast<float>(state.player_id);
   buffer[write_index++] = static_cast<float>(traverser);
@@ -147,16 +193,44 @@ int64_t write_query_to(const Game& game, int traverser,
   return write_index;
 }
 
-TreeStrategy get_uniform_reach_weigted_strategy(
-    const Game& game, const Tree& tree,
-    const Pair<std::vector<double>>& initial_beliefs) {
-  TreeStrategy strategy = get_uniform_strategy(game, tree);
+// Sets `strategy` to the uniform strategy over feasible actions for
+// `num_hands` hands.
+template <class Strategy>
+void fill_uniform_strategy(const Game& game, const Tree& tree, int num_hands,
+                           Strategy* strategy) {
+  strategy->reset(tree.size(), num_hands, game.num_actions());
+  for (size_t node_id = 0; node_id < tree.size(); ++node_id) {
+    int first = game.get_bid_range(tree[node_id].state).first;
+    int last = first + tree[node_id].num_children();
+    for (int a = first; a < last; ++a) {
+      auto* probs = strategy->action_data(node_id, a);
+      for (int hand = 0; hand < num_hands; ++hand) {
+        probs[hand * strategy->hand_stride()] = 1. / (last - first);
+      }
+    }
+  }
+}
 
-  std::vector<std::vector<double>> reach_probabilities_buffer;
-  init_nd(tree.size(), game.num_hands(), 0.0, &reach_probabilities_buffer);
+template <class Strategy>
+void fill_uniform_strategy(const Game& game, const Tree& tree,
+                           Strategy* strategy) {
+  fill_uniform_strategy(game, tree, game.num_hands(), strategy);
+}
+
+// Sets `strategy` to the uniform strategy weighted by the reaches of the
+// acting player. `reach_probabilities_buffer` is used as scratch space.
+template <class Strategy, class T>
+void fill_uniform_reach_weigted_strategy(
+    const Game& game, const Tree& tree,
+    const Pair<std::vector<double>>& initial_beliefs, Strategy* strategy,
+    std::vector<std::vector<T>>* reach_probabilities_buffer) {
+  const int num_hands = initial_beliefs[0].size();
+  fill_uniform_strategy(game, tree, num_hands, strategy);
+  init_nd(tree.size(), num_hands, 0.0, reach_probabilities_buffer);
   for (int traverser : {0, 1}) {
-    compute_reach_probabilities(game, tree, strategy, initial_beliefs[traverser],
-                                traverser, &reach_probabilities_buffer);
+    compute_reach_probabilities(game, tree, *strategy,
+                                initial_beliefs[traverser], traverser,
+                                reach_probabilities_buffer);
 
 
 
@@ -186,79 +260,395 @@ TreeStrategy get_uniform_reach_weigted_strategy(
       }
       const auto [action_begin, action_end] =
           game.get_bid_range(tree[node].state);
-      for (int i = 0; i < game.num_hands(); i++) {
-        for (Action a = action_begin; a < action_end; ++a) {
-          strategy[node][i][a] *= reach_probabilities_buffer[node][i];
+      const auto& reaches = (*reach_probabilities_buffer)[node];
+      for (Action a = action_begin; a < action_end; ++a) {
+        auto* probs = strategy->action_data(node, a);
+        for (int i = 0; i < num_hands; i++) {
+          probs[i * strategy->hand_stride()] *= reaches[i];
+        }
+      }
+    }
+  }
+}
+
+// Returns `strategy` as a TreeStrategy. Strategies in other layouts or of
+// other value types are converted into `buffer`.
+template <class Layout, class T>
+const TreeStrategy& as_tree_strategy(
+    const BasicTreeStrategy<Layout, T>& strategy, TreeStrategy* buffer) {
+  if constexpr (std::is_same<BasicTreeStrategy<Layout, T>,
+                             TreeStrategy>::value) {
+    return strategy;
+  } else {
+    convert_layout(strategy, buffer);
+    return *buffer;
+  }
+}
+
+// A solver strategy as a TreeStrategy for the getters of ISubgameSolver.
+// Strategies in other layouts or of other value types are converted on the
+// first read after invalidate(), so a solve converts once however often the
+// strategy is read. Owners call invalidate() whenever the strategy changes.
+// References returned by get() stay valid and unchanged until then.
+template <class Layout, class T>
+class TreeStrategyCache {
+ public:
+  void invalidate() { stale_ = true; }
+
+  const TreeStrategy& get(const BasicTreeStrategy<Layout, T>& strategy) const {
+    if constexpr (std::is_same<BasicTreeStrategy<Layout, T>,
+                               TreeStrategy>::value) {
+      return strategy;
+    } else {
+      // Const readers may share the solver, so the conversion is guarded.
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stale_) {
+        convert_layout(strategy, &buffer_);
+        stale_ = false;
+      }
+      return buffer_;
+    }
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  mutable bool stale_ = true;
+  mutable TreeStrategy buffer_;
+};
+
+// For each hand sets average[node] to sums[node] (plus last[node] if given)
+// normalized over actions.
+template <class Layout, class R, class T>
+void normalize_node(const BasicTreeStrategy<Layout, R>& sums,
+                    const BasicTreeStrategy<Layout, R>* last, int node,
+                    BasicTreeStrategy<Layout, T>* average) {
+  if constexpr (std::is_same<Layout, ActionMajor>::value) {
+    normalize_action_major(sums.node_data(node),
+                           last ? last->node_data(node) : nullptr,
+                           sums.num_hands(), sums.num_actions(),
+                           average->node_data(node));
+  } else {
+    for (int i = 0; i < sums.num_hands(); i++) {
+      if (last) {
+        normalize_probabilities(sums[node][i], (*last)[node][i],
+                                (*average)[node][i].data());
+      } else {
+        normalize_probabilities(sums[node][i], (*average)[node][i].data());
+      }
+    }
+  }
+}
+
+// Discount factors of the CFR update.
+struct CfrDiscounts {
+  double pos = 1;
+  double neg = 1;
+  double strat = 1;
+};
+
+// Discounts to apply after `num_strategies` strategies were accumulated.
+CfrDiscounts compute_cfr_discounts(const SubgameSolvingParams& params,
+                                   double num_strategies) {
+  CfrDiscounts discounts;
+  if (params.linear_update) {
+    discounts.pos = discounts.neg = discounts.strat =
+        num_strategies / (num_strategies + 1);
+  } else if (params.dcfr) {
+    if (params.dcfr_alpha >= 5) {
+      discounts.pos = 1;
+    } else {
+      discounts.pos = pow(num_strategies, params.dcfr_alpha) /
+                      (pow(num_strategies, params.dcfr_alpha) + 1.);
+    }
+    if (params.dcfr_beta <= -5) {
+      discounts.neg = 0;
+    } else {
+      discounts.neg = pow(num_strategies, params.dcfr_beta) /
+                      (pow(num_strategies, params.dcfr_beta) + 1.);
+    }
+    discounts.strat =
+        pow(num_strategies / (num_strategies + 1), params.dcfr_gamma);
+  }
+  return discounts;
+}
+
+// Sets strategy[node] to the regret matching strategy of regrets[node].
+// The vectorized HandMajor kernels are double only.
+template <class Layout, class R, class T>
+void regret_matching_node(const BasicTreeStrategy<Layout, R>& regrets,
+                          int node, int action_begin, int action_end,
+                          BasicTreeStrategy<Layout, T>* strategy) {
+  // TODO(akhti): remove magic constant.
+  if constexpr (std::is_same<Layout, ActionMajor>::value) {
+    regret_matching_action_major(regrets.node_data(node), regrets.num_hands(),
+                                 regrets.num_actions(), action_begin,
+                                 action_end, kRegretSmoothingEps,
+                                 strategy->node_data(node));
+  } else if constexpr (!std::is_same<R, double>::value ||
+                       !std::is_same<T, double>::value) {
+    regret_matching_scalar(regrets.node_data(node), regrets.num_hands(),
+                           regrets.num_actions(), action_begin, action_end,
+                           kRegretSmoothingEps, strategy->node_data(node));
+  } else {
+    regret_matching(regrets.node_data(node), regrets.num_hands(),
+                    regrets.num_actions(), action_begin, action_end,
+                    kRegretSmoothingEps, strategy->node_data(node));
+  }
+}
+
+// Discounts regrets[node] and adds last[node] weighted by `reaches` to
+// sums[node]. Sets average[node] to the normalized sums.
+template <class Layout, class R, class T>
+void discount_and_accumulate_node(const BasicTreeStrategy<Layout, T>& last,
+                                  const std::vector<T>& reaches, int node,
+                                  int action_begin, int action_end,
+                                  const CfrDiscounts& discounts,
+                                  BasicTreeStrategy<Layout, R>* regrets,
+                                  BasicTreeStrategy<Layout, R>* sums,
+                                  BasicTreeStrategy<Layout, T>* average) {
+  if constexpr (std::is_same<Layout, ActionMajor>::value) {
+    discount_and_accumulate_action_major(
+        regrets->node_data(node), sums->node_data(node),
+        average->node_data(node), last.node_data(node), reaches.data(),
+        last.num_hands(), last.num_actions(), action_begin, action_end,
+        discounts.pos, discounts.neg, discounts.strat);
+  } else if constexpr (!std::is_same<R, double>::value ||
+                       !std::is_same<T, double>::value) {
+    discount_and_accumulate_scalar(
+        regrets->node_data(node), sums->node_data(node),
+        average->node_data(node), last.node_data(node), reaches.data(),
+        last.num_hands(), last.num_actions(), action_begin, action_end,
+        discounts.pos, discounts.neg, discounts.strat);
+  } else {
+    discount_and_accumulate(
+        regrets->node_data(node), sums->node_data(node),
+        average->node_data(node), last.node_data(node), reaches.data(),
+        last.num_hands(), last.num_actions(), action_begin, action_end,
+        discounts.pos, discounts.neg, discounts.strat);
+  }
+}
+
+// CFR backward pass over nodes [node_begin, node_end) of a single level and
+// hands [hand_begin, hand_end). The values of the level below must be
+// computed already. Sets the values of inner nodes to the EVs of `strategy`
+// for the traverser and adds the immediate regrets of the traverser's nodes
+// to `regrets`. Leaves are left as is.
+template <class Layout, class R, class T>
+void accumulate_level_regrets(const TreeLevels& levels,
+                              const BasicTreeStrategy<Layout, T>& strategy,
+                              int traverser, int node_begin, int node_end,
+                              int hand_begin, int hand_end,
+                              BasicTreeStrategy<Layout, R>* regrets,
+                              std::vector<std::vector<T>>* values) {
+  const int stride = regrets->hand_stride();
+  for (int node = node_begin; node < node_end; ++node) {
+    const int children_begin = levels.children_begin[node];
+    const int children_end = levels.children_end[node];
+    if (children_begin == children_end) continue;
+    T* value = (*values)[node].data();
+    std::fill(value + hand_begin, value + hand_end, T(0));
+    if (levels.player_ids[node] == traverser) {
+      for (int child = children_begin; child < children_end; ++child) {
+        const Action action = levels.actions[child];
+        const T* action_value = (*values)[child].data();
+        R* action_regrets = regrets->action_data(node, action);
+        const T* action_probs = strategy.action_data(node, action);
+        for (int hand = hand_begin; hand < hand_end; ++hand) {
+          action_regrets[hand * stride] += action_value[hand];
+          value[hand] += action_value[hand] * action_probs[hand * stride];
+        }
+      }
+      for (int child = children_begin; child < children_end; ++child) {
+        R* action_regrets = regrets->action_data(node, levels.actions[child]);
+        for (int hand = hand_begin; hand < hand_end; ++hand) {
+          action_regrets[hand * stride] -= value[hand];
+        }
+      }
+    } else {
+      for (int child = children_begin; child < children_end; ++child) {
+        const T* action_value = (*values)[child].data();
+        for (int hand = hand_begin; hand < hand_end; ++hand) {
+          value[hand] += action_value[hand];
+        }
+      }
+    }
+  }
+}
+
+// (node, hand) pairs that a pruned CFR pass updates.
+struct ActiveHands {
+  // Subtrees that are skipped as a whole. Indexed by node.
+  std::vector<char> is_pruned;
+  // Sorted active hands of every node.
+  std::vector<std::vector<int>> hands;
+  // is_active[node][hand] for lookups from the children.
+  std::vector<std::vector<char>> is_active;
+};
+
+// Same as accumulate_level_regrets, but only updates the active hands.
+// Pruned nodes get zero values. Inactive hands keep their values and regrets
+// from the last pass that updated them, and parents use those values.
+template <class Layout, class R, class T>
+void accumulate_level_regrets_pruned(
+    const TreeLevels& levels, const BasicTreeStrategy<Layout, T>& strategy,
+    const ActiveHands& active, int traverser, int node_begin, int node_end,
+    int hand_begin, int hand_end, BasicTreeStrategy<Layout, R>* regrets,
+    std::vector<std::vector<T>>* values) {
+  const int stride = regrets->hand_stride();
+  for (int node = node_begin; node < node_end; ++node) {
+    const int children_begin = levels.children_begin[node];
+    const int children_end = levels.children_end[node];
+    if (children_begin == children_end) continue;
+    T* value = (*values)[node].data();
+    if (active.is_pruned[node]) {
+      std::fill(value + hand_begin, value + hand_end, T(0));
+      continue;
+    }
+    const auto& hands = active.hands[node];
+    const auto first = std::lower_bound(hands.begin(), hands.end(), hand_begin);
+    const auto last = std::lower_bound(first, hands.end(), hand_end);
+    if (last - first == hand_end - hand_begin) {
+      accumulate_level_regrets(levels, strategy, traverser, node, node + 1,
+                               hand_begin, hand_end, regrets, values);
+      continue;
+    }
+    for (auto it = first; it != last; ++it) value[*it] = 0;
+    if (levels.player_ids[node] == traverser) {
+      for (int child = children_begin; child < children_end; ++child) {
+        const Action action = levels.actions[child];
+        const T* action_value = (*values)[child].data();
+        R* action_regrets = regrets->action_data(node, action);
+        const T* action_probs = strategy.action_data(node, action);
+        for (auto it = first; it != last; ++it) {
+          const int hand = *it;
+          action_regrets[hand * stride] += action_value[hand];
+          value[hand] += action_value[hand] * action_probs[hand * stride];
+        }
+      }
+      for (int child = children_begin; child < children_end; ++child) {
+        R* action_regrets = regrets->action_data(node, levels.actions[child]);
+        for (auto it = first; it != last; ++it) {
+          action_regrets[*it * stride] -= value[*it];
+        }
+      }
+    } else {
+      // The oponent's actions keep the traverser's reaches, so the active
+      // hands of the children are the same.
+      for (int child = children_begin; child < children_end; ++child) {
+        const T* action_value = (*values)[child].data();
+        for (auto it = first; it != last; ++it) {
+          value[*it] += action_value[*it];
         }
       }
     }
   }
-  return strategy;
 }
 
-// Helper base class for tree traversing.
+// Best response backward pass over nodes [node_begin, node_end) of a single
+// level and hands [hand_begin, hand_end), in the same way as
+// accumulate_level_regrets. The traverser's nodes take the value of the best
+// child, which is recorded in `br_strategies`.
+template <class Layout, class T>
+void best_response_level(const TreeLevels& levels, int traverser,
+                         int node_begin, int node_end, int hand_begin,
+                         int hand_end, int num_actions,
+                         BasicTreeStrategy<Layout, T>* br_strategies,
+                         std::vector<std::vector<T>>* values) {
+  std::vector<int> best_action(hand_end);
+  for (int node = node_begin; node < node_end; ++node) {
+    const int children_begin = levels.children_begin[node];
+    const int children_end = levels.children_end[node];
+    if (children_begin == children_end) continue;
+    T* value = (*values)[node].data();
+    std::fill(value + hand_begin, value + hand_end, T(0));
+    if (levels.player_ids[node] == traverser) {
+      for (int child = children_begin; child < children_end; ++child) {
+        const Action action = levels.actions[child];
+        const T* new_value = (*values)[child].data();
+        for (int hand = hand_begin; hand < hand_end; ++hand) {
+          if (child == children_begin || new_value[hand] > value[hand]) {
+            value[hand] = new_value[hand];
+            best_action[hand] = action;
+          }
+        }
+      }
+      for (int hand = hand_begin; hand < hand_end; ++hand) {
+        for (int action = 0; action < num_actions; ++action) {
+          br_strategies->at(node, hand, action) = 0.;
+        }
+        br_strategies->at(node, hand, best_action[hand]) = 1.0;
+      }
+    } else {
+      for (int child = children_begin; child < children_end; ++child) {
+        const T* new_value = (*values)[child].data();
+        for (int hand = hand_begin; hand < hand_end; ++hand) {
+          value[hand] += new_value[hand];
+        }
+      }
+    }
+  }
+}
+
+// Helper base class for tree traversing. Reaches and values are
+// Precision::Value.
+template <class Precision = DoublePrecision>
 struct PartialTreeTraverser {
+  using Value = typename Precision::Value;
+
   const Game game;
-  const Tree tree;
+  std::shared_ptr<const Tree> tree;
 
   // Probability to reach a specific node by a player with specific under the
   // average policy: [2, num_nodes, num_hands].
   // Computed with precompute_reaches.
-  Pair<std::vector<std::vector<double>>> reach_probabilities;
+  Pair<std::vector<std::vector<Value>>> reach_probabilities;
 
   // Values for each node and hand for one of the players.
   // Shape [num_nodes, num_hands].
   // Leaf values could be populated with precompute_leaf_values.
   // It's up to subclasess to pupulate the rest.
-  std::vector<std::vector<double>> traverser_values;
+  std::vector<std::vector<Value>> traverser_values;
 
   // Size of the inputs and outputs of the value network.
   const int64_t query_size, output_size;
 
-  PartialTreeTraverser(const Game& game, const Tree& tree,
-                       std::shared_ptr<IValueNet> value_net)
+  // Parallel traversals split the hands of a node into chunks of at least
+  // this size.
+  static constexpr int kMinHandsPerTask = 64;
+
+  // With num_threads > 1 traversals run on a thread pool.
+  PartialTreeTraverser(const Game& game, std::shared_ptr<const Tree> tree,
+                       std::shared_ptr<IValueNet> value_net,
+                       int num_threads = 1)
       : game(game),
         tree(tree),
         query_size(get_query_size(game)),
         output_size(game.num_hands()),
         value_net(value_net) {
-    if (value_net == nullptr) {
-      // Check all leaf nodes are final.
-      for (auto& node : tree) {
-        if (!game.is_terminal(node.state) && !node.num_children()) {
-          throw std::runtime_error("Found a node " +
-                                   game.state_to_string(node.state) +
-                                   " that is a non-final leaf. Either provide "
-                                   "value net or increase max_depth");
-        }
-      }
-    } else {
-      // Initialzer buffers to query the neural network.
-      for (size_t node_id = 0; node_id < tree.size(); ++node_id) {
-        const auto& node = tree[node_id];
-        const auto& state = node.state;
-        if (!node.num_children() && !game.is_terminal(state)) {
-          pseudo_leaves_indices.push_back(node_id);
-        }
-      }
-      net_query_buffer.resize(query_size * pseudo_leaves_indices.size());
-    }
-    for (size_t i = 0; i < tree.size(); ++i) {
-      if (game.is_terminal(tree[i].state)) {
-        terminal_indices.push_back(i);
-      }
+    if (num_threads > 1) {
+      pool = std::make_unique<ThreadPool>(num_threads);
     }
-    leaf_values =
-        torch::empty({(int64_t)pseudo_leaves_indices.size(), output_size});
-    init_nd(tree.size(), game.num_hands(), 0.0, &traverser_values);
-    init_nd(tree.size(), game.num_hands(), 0.0, &reach_probabilities[0]);
-    init_nd(tree.size(), game.num_hands(), 0.0, &reach_probabilities[1]);
+    init_buffers();
+  }
+
+  // A pending query may still be writing to the buffers.
+  ~PartialTreeTraverser() { drop_pending_query(); }
+
+  PartialTreeTraverser(const PartialTreeTraverser&) = delete;
+  PartialTreeTraverser& operator=(const PartialTreeTraverser&) = delete;
+
+  // Switches to the tree for a new root. Buffers are reused if the tree has
+  // the same size as before.
+  void reset_tree(const PartialPublicState& root, int max_depth) {
+    drop_pending_query();
+    tree = get_cached_tree(game, root, max_depth);
+    init_buffers();
   }
 
   // Write a single query to the buffer. The query corresponds to the node as
   // seen by tranverser.
   void write_query(size_t node_id, int traverser, float* buffer) {
-    const auto& state = tree[node_id].state;
+    const auto& state = (*tree)[node_id].state;
     auto write_index =
         write_query_to(game, traverser, state, reach_probabilities[0][node_id],
                        reach_probabilities[1][node_id], buffer);
@@ -273,155 +663,355 @@ struct PartialTreeTraverser {
     value_net->add_training_example(query_tensor, value_tensor);
   }
 
-  void precompute_reaches(const TreeStrategy& strategy,
+  template <class Strategy>
+  void precompute_reaches(const Strategy& strategy,
                           const std::vector<double>& initial_beliefs,
                           int player) {
-    poker_dice::compute_reach_probabilities(game, 
-        tree, strategy, initial_beliefs, player, &reach_probabilities[player]);
+    compute_reaches(strategy, initial_beliefs, player,
+                    &reach_probabilities[player]);
   }
 
-  // Compute values for leaf nodes. For terminals exact value is used; for
-  // non-terminals value net is called. Reaches for both players must be
-  // precomputed.
-  void precompute_all_leaf_values(int traverser) {
-    query_value_net(traverser);
+  // Same as compute_reach_probabilities, but uses the pool if any. The
+  // buffers in `reaches` must be allocated.
+  template <class Strategy>
+  void compute_reaches(const Strategy& strategy,
+                       const std::vector<double>& initial_beliefs, int player,
+                       std::vector<std::vector<Value>>* reaches) {
+    traverse_forward([&](int node_begin, int node_end, int hand_begin,
+                         int hand_end) {
+      propagate_level_reaches(levels, strategy, initial_beliefs, player,
+                              node_begin, node_end, hand_begin, hand_end,
+                              reaches);
+    });
+  }
 
-        //std::cout << " --- --- --- traverser_values[" << game.state_to_string(tree[1].state) << "]" << traverser_values[1] << std::endl;
+  // Calls fn(node_begin, node_end, hand_begin, hand_end) for ranges of nodes
+  // within a depth level, deeper levels first. Without a pool every level is
+  // a single call with all hands. With a pool the nodes of a level, which
+  // only depend on deeper levels, are processed concurrently, and the hands
+  // of a node are split between threads when the level is narrower than the
+  // pool.
+  template <class Fn>
+  void traverse_backward(const Fn& fn) {
+    for (int level = levels.num_levels(); level-- > 0;) {
+      for_each_range_in_level(level, fn);
+    }
+  }
 
+  // Same as traverse_backward, but parents go before children.
+  template <class Fn>
+  void traverse_forward(const Fn& fn) {
+    for (int level = 0; level < levels.num_levels(); ++level) {
+      for_each_range_in_level(level, fn);
+    }
+  }
+
+  // Calls fn(node_id) for all nodes in any order, concurrently with a pool.
+  template <class Fn>
+  void for_each_node(const Fn& fn) {
+    if (pool == nullptr) {
+      for (size_t node_id = 0; node_id < tree->size(); ++node_id) {
+        fn(node_id);
+      }
+      return;
+    }
+    pool->parallel_for(tree->size(), [&](int64_t node_id) { fn(node_id); });
+  }
+
+  // Compute values for leaf nodes. For terminals exact value is used; for
+  // non-terminals value net is called. Reaches for both players must be
+  // precomputed. Terminals are evaluated while the net query runs.
+  //
+  // With `active` only the terminals with active hands are evaluated. Pruned
+  // terminals get zero values and the others keep the values of the last
+  // pass that evaluated them.
+  void precompute_all_leaf_values(int traverser,
+                                  const ActiveHands* active = nullptr) {
+    if (!pending_query.valid() || pending_query_traverser != traverser) {
+      prefetch_leaf_values(traverser);
+    }
 
-    populate_leaf_values();
+    precompute_terminal_leaves_values(traverser, active);
 
-        //std::cout << " --- --- --- traverser_values[" << game.state_to_string(tree[1].state) << "]" << traverser_values[1] << std::endl;
+        //std::cout << " --- --- --- traverser_values[" << game.state_to_string((*tree)[1].state) << "]" << traverser_values[1] << std::endl;
 
-    precompute_terminal_leaves_values(traverser);
+    if (pending_query.valid()) {
+      wait_pending_query();
+      pending_query.get();
+      populate_leaf_values();
+    }
 
-    //for (size_t node_id = 0; node_id < tree.size(); ++node_id) {
-    //   std::cout << " --- --- --- traverser_values[" << game.state_to_string(tree[node_id].state) << "]" << traverser_values[node_id] << std::endl;
+    //for (size_t node_id = 0; node_id < tree->size(); ++node_id) {
+    //   std::cout << " --- --- --- traverser_values[" << game.state_to_string((*tree)[node_id].state) << "]" << traverser_values[node_id] << std::endl;
     //}
   }
 
  protected:
-  void precompute_reaches(const TreeStrategy& strategy,
+  template <class Strategy>
+  void precompute_reaches(const Strategy& strategy,
                           const Pair<std::vector<double>>& initial_beliefs) {
     precompute_reaches(strategy, initial_beliefs[0], 0);
     precompute_reaches(strategy, initial_beliefs[1], 1);
   }
 
-  // Query value net, weight by oponent reaches, and save result as
-  // leaf_values tensor.
-  void query_value_net(int traverser) {
+  // Writes the queries of the pseudo leaves for the traverser and starts the
+  // value net on them without waiting for the result. The oponent reaches to
+  // weight the rows by are saved in leaf_scalers. The next
+  // precompute_all_leaf_values for the traverser picks up the result, so the
+  // reaches must not change in between. Reaches for both players must be
+  // precomputed.
+  void prefetch_leaf_values(int traverser) {
+    drop_pending_query();
     if (pseudo_leaves_indices.empty()) return;
     assert(value_net != nullptr);
     //std::cerr << "pseudo_leaves_indices.size(): " << pseudo_leaves_indices.size() << std::endl;
-    const int64_t N = pseudo_leaves_indices.size();
-    torch::Tensor scalers = torch::zeros({N}, torch::kDouble);
-    auto scalers_acc = scalers.accessor<double, 1>();
     for (size_t row = 0; row < pseudo_leaves_indices.size(); ++row) {
       const auto node_id = pseudo_leaves_indices[row];
       write_query(node_id, traverser,
                   net_query_buffer.data() + row * query_size);
-      scalers_acc[row] =
+      leaf_scalers[row] =
           vector_sum(reach_probabilities[1 - traverser][node_id]);
     }
-    leaf_values = value_net->compute_values(
-        torch::from_blob(net_query_buffer.data(), {N, query_size}));
-    leaf_values *= scalers.unsqueeze(1);
+    pending_query = value_net->compute_values_async(net_queries, leaf_values);
+    pending_query_traverser = traverser;
+  }
+
+  // Starts the query precompute_all_leaf_values for the traverser needs, if
+  // it is not running yet, and returns whether its values are available.
+  // Deferred queries count as available as they run when waited for. Reaches
+  // for both players must be precomputed.
+  bool leaf_values_ready(int traverser) {
+    if (pseudo_leaves_indices.empty()) return true;
+    if (!pending_query.valid() || pending_query_traverser != traverser) {
+      prefetch_leaf_values(traverser);
+    }
+    return pending_query.wait_for(std::chrono::seconds(0)) !=
+           std::future_status::timeout;
+  }
+
+  // Waits until pending_query has written leaf_values. A query that runs on
+  // another thread is waited for without holding a core of the pool the
+  // solver may run on. A deferred one runs here.
+  void wait_pending_query() {
+    if (pending_query.wait_for(std::chrono::seconds(0)) ==
+        std::future_status::timeout) {
+      rela::WorkStealingPool::BlockingScope blocking;
+      pending_query.wait();
+    } else {
+      pending_query.wait();
+    }
+  }
+
+  // Waits until a query that will not be used stops writing to the buffers.
+  void drop_pending_query() {
+    if (pending_query.valid()) {
+      wait_pending_query();
+    }
+    pending_query = std::future<void>();
   }
 
-  // Copy results from leaf_values to corresponding nodes in
-  // traverser_values.
+  // Copy results from leaf_values weighted by leaf_scalers to corresponding
+  // nodes in traverser_values. The scaling happens here, in Value, so the
+  // float output of the net is not round-tripped through a double tensor.
   void populate_leaf_values() {
     if (pseudo_leaves_indices.empty()) return;
     auto result_acc = leaf_values.accessor<float, 2>();
     for (size_t row = 0; row < pseudo_leaves_indices.size(); ++row) {
       const auto node_id = pseudo_leaves_indices[row];
+      const Value scaler = leaf_scalers[row];
+      Value* values = traverser_values[node_id].data();
       for (int64_t i = 0; i < output_size; ++i) {
-        traverser_values[node_id][i] = result_acc[row][i];
+        values[i] = result_acc[row][i] * scaler;
       }
     }
   }
 
   // Populate traverser_values for terminal nodes.
-  void precompute_terminal_leaves_values(int traverser) {
-    for (auto node_id : terminal_indices) {
-      traverser_values[node_id] = compute_expected_terminal_values(
-          game, tree[node_id].state,
-          /*inverse=*/tree[node_id].state.player_id != traverser,
-          reach_probabilities[1 - traverser][node_id]);
+  void precompute_terminal_leaves_values(int traverser,
+                                         const ActiveHands* active) {
+    auto compute = [&](size_t node_id) {
+      if (active != nullptr) {
+        if (active->is_pruned[node_id]) {
+          std::fill(traverser_values[node_id].begin(),
+                    traverser_values[node_id].end(), 0.0);
+          return;
+        }
+        if (active->hands[node_id].empty()) return;
+      }
+      auto& op_reaches = reach_probabilities[1 - traverser][node_id];
+      const bool inverse = (*tree)[node_id].state.player_id != traverser;
+      if constexpr (std::is_same<Value, double>::value) {
+        traverser_values[node_id] = compute_expected_terminal_values(
+            game, (*tree)[node_id].state, inverse, op_reaches);
+      } else {
+        // Payoffs are computed in double.
+        std::vector<double> op_reaches_double(op_reaches.begin(),
+                                              op_reaches.end());
+        const auto values = compute_expected_terminal_values(
+            game, (*tree)[node_id].state, inverse, op_reaches_double);
+        std::copy(values.begin(), values.end(),
+                  traverser_values[node_id].begin());
+      }
+    };
+    if (pool == nullptr) {
+      for (auto node_id : terminal_indices) compute(node_id);
+    } else {
+      pool->parallel_for(terminal_indices.size(), [&](int64_t i) {
+        compute(terminal_indices[i]);
+      });
     }
   }
 
+  template <class Fn>
+  void for_each_range_in_level(int level, const Fn& fn) {
+    const int begin = levels.level_offsets[level];
+    const int end = levels.level_offsets[level + 1];
+    if (pool == nullptr) {
+      fn(begin, end, 0, game.num_hands());
+      return;
+    }
+    const int num_nodes = end - begin;
+    const int max_chunks = std::max(1, game.num_hands() / kMinHandsPerTask);
+    const int num_chunks = std::min(
+        max_chunks,
+        (pool->num_threads() + num_nodes - 1) / num_nodes);
+    const int chunk_size = (game.num_hands() + num_chunks - 1) / num_chunks;
+    pool->parallel_for(num_nodes * num_chunks, [&](int64_t item) {
+      const int hand_begin = (item % num_chunks) * chunk_size;
+      const int hand_end = std::min(game.num_hands(), hand_begin + chunk_size);
+      const int node = begin + item / num_chunks;
+      fn(node, node + 1, hand_begin, hand_end);
+    });
+  }
+
+  // (Re)initializes node lists and buffers for the current tree.
+  void init_buffers() {
+    pseudo_leaves_indices.clear();
+    terminal_indices.clear();
+    if (value_net == nullptr) {
+      // Check all leaf nodes are final.
+      for (auto& node : *tree) {
+        if (!game.is_terminal(node.state) && !node.num_children()) {
+          throw std::runtime_error("Found a node " +
+                                   game.state_to_string(node.state) +
+                                   " that is a non-final leaf. Either provide "
+                                   "value net or increase max_depth");
+        }
+      }
+    } else {
+      // Initialzer buffers to query the neural network.
+      for (size_t node_id = 0; node_id < tree->size(); ++node_id) {
+        const auto& node = (*tree)[node_id];
+        const auto& state = node.state;
+        if (!node.num_children() && !game.is_terminal(state)) {
+          pseudo_leaves_indices.push_back(node_id);
+        }
+      }
+      net_query_buffer.resize(query_size * pseudo_leaves_indices.size());
+    }
+    for (size_t i = 0; i < tree->size(); ++i) {
+      if (game.is_terminal((*tree)[i].state)) {
+        terminal_indices.push_back(i);
+      }
+    }
+    build_tree_levels(game, *tree, &levels);
+    const int64_t num_leaves = pseudo_leaves_indices.size();
+    if (!leaf_values.defined() || leaf_values.size(0) != num_leaves) {
+      leaf_values = torch::empty({num_leaves, output_size});
+    }
+    // Wraps the query buffer, which may have moved in the resize above.
+    net_queries = num_leaves ? torch::from_blob(net_query_buffer.data(),
+                                                {num_leaves, query_size})
+                             : torch::Tensor();
+    leaf_scalers.resize(num_leaves);
+    init_nd(tree->size(), game.num_hands(), 0.0, &traverser_values);
+    init_nd(tree->size(), game.num_hands(), 0.0, &reach_probabilities[0]);
+    init_nd(tree->size(), game.num_hands(), 0.0, &reach_probabilities[1]);
+  }
+
   // List of pseude leaf nodes, i.e., nodes where value net eval is needed.
   std::vector<size_t> pseudo_leaves_indices;
   std::vector<size_t> terminal_indices;
-  // Query buffers.
+  TreeLevels levels;
+  // Query buffers. net_queries is a view of net_query_buffer.
   std::vector<float> net_query_buffer;
+  torch::Tensor net_queries;
   torch::Tensor leaf_values;
+  std::vector<Value> leaf_scalers;
 
   std::shared_ptr<IValueNet> value_net;
+  // Only set for parallel traversals.
+  std::unique_ptr<ThreadPool> pool;
+
+  // Query started by prefetch_leaf_values that is not used yet. It reads
+  // net_queries and writes leaf_values until it is ready, so it is waited for
+  // before the tree or the buffers change and in the destructor.
+  std::future<void> pending_query;
+  int pending_query_traverser = -1;
 };
 
-struct BRSolver : public PartialTreeTraverser {
-  BRSolver(const Game& game, const std::vector<UnrolledTreeNode>& tree,
-           std::shared_ptr<IValueNet> value_net)
-      : PartialTreeTraverser(game, tree, value_net) {
-    init_nd(tree.size(), game.num_hands(), game.num_actions(), 0.0,
-            &br_strategies);
+template <class Layout, class Precision = DoublePrecision>
+struct BRSolver : public PartialTreeTraverser<Precision> {
+  using Base = PartialTreeTraverser<Precision>;
+  using Strategy = BasicTreeStrategy<Layout, typename Precision::Value>;
+  using Base::game;
+  using Base::levels;
+  using Base::traverser_values;
+  using Base::tree;
+
+  BRSolver(const Game& game, std::shared_ptr<const Tree> tree,
+           std::shared_ptr<IValueNet> value_net, int num_threads = 1)
+      : Base(game, tree, value_net, num_threads),
+        br_strategies(tree->size(), game.num_hands(), game.num_actions()) {}
+
+  void reset_tree(const PartialPublicState& root, int max_depth) {
+    Base::reset_tree(root, max_depth);
+    br_strategies.reset(tree->size(), game.num_hands(), game.num_actions());
   }
 
   // Re-computes BR strategy for the traverser and returns its expected BR
   // value and the best response strategy. Only values for nodes where
   // traverser is acting are valid.
-  const TreeStrategy& compute_br(
-      int traverser, const TreeStrategy& oponent_strategy,
+  template <class OponentStrategy>
+  const Strategy& compute_br(
+      int traverser, const OponentStrategy& oponent_strategy,
       const Pair<std::vector<double>>& initial_beliefs,
       std::vector<double>* values) {
-    precompute_reaches(oponent_strategy, initial_beliefs);
-    precompute_all_leaf_values(traverser);
-    for (size_t public_node = tree.size(); public_node-- > 0;) {
-      const auto& node = tree[public_node];
-      auto& value = traverser_values[public_node];
-      if (!node.num_children()) {
-        // All leaf values are set by precompute_all_leaf_values.
-        continue;
-      }
-      const auto& state = node.state;
-      value.assign(value.size(), 0.0);
-      if (state.player_id == traverser) {
-        std::vector<int> best_action(game.num_hands());
-        for (auto [child_node, action] : ChildrenActionIt(node, game)) {
-          const auto& new_value = traverser_values[child_node];
-          for (int hand = 0; hand < game.num_hands(); ++hand) {
-            if (child_node == node.children_begin ||
-                new_value[hand] > value[hand]) {
-              value[hand] = new_value[hand];
-              best_action[hand] = action;
-            }
-          }
-        }
-        for (int hand = 0; hand < game.num_hands(); ++hand) {
-          br_strategies[public_node][hand].assign(game.num_actions(), 0.);
-          br_strategies[public_node][hand][best_action[hand]] = 1.0;
-        }
-      } else {
-        for (auto child_node : ChildrenIt(node)) {
-          const auto& new_value = traverser_values[child_node];
-          for (int hand = 0; hand < game.num_hands(); ++hand) {
-            value[hand] += new_value[hand];
-          }
-        }
-      }
-    }
-    *values = traverser_values[0];
+    this->precompute_reaches(oponent_strategy, initial_beliefs);
+    this->precompute_all_leaf_values(traverser);
+    this->traverse_backward([&](int node_begin, int node_end, int hand_begin,
+                                int hand_end) {
+      best_response_level(levels, traverser, node_begin, node_end, hand_begin,
+                          hand_end, game.num_actions(), &br_strategies,
+                          &traverser_values);
+    });
+    values->assign(traverser_values[0].begin(), traverser_values[0].end());
     return br_strategies;
   }
 
+  // Starts the leaf query of compute_br with the same arguments and returns
+  // whether its values are available.
+  template <class OponentStrategy>
+  bool prepare_br(int traverser, const OponentStrategy& oponent_strategy,
+                  const Pair<std::vector<double>>& initial_beliefs) {
+    this->precompute_reaches(oponent_strategy, initial_beliefs);
+    return this->leaf_values_ready(traverser);
+  }
+
   // Indexed by [node, hand, action].
-  TreeStrategy br_strategies;
+  Strategy br_strategies;
 };
 
+// Average strategies and best responses are Precision::Value, the sums that
+// give the average are Precision::Accumulator.
+template <class Layout, class Precision>
 struct FP : public ISubgameSolver {
-  FP(const Game& game, const Tree& tree, std::shared_ptr<IValueNet> value_net,
+  using Strategy = BasicTreeStrategy<Layout, typename Precision::Value>;
+  using SumStrategy =
+      BasicTreeStrategy<Layout, typename Precision::Accumulator>;
+
+  FP(const Game& game, std::shared_ptr<const Tree> tree,
+     std::shared_ptr<IValueNet> value_net,
      const Pair<std::vector<double>>& beliefs,
      const SubgameSolvingParams& params)
       : params(params),
@@ -430,12 +1020,8 @@ struct FP : public ISubgameSolver {
         // TODO(akhti): normalize before using!
         initial_beliefs(beliefs),
         tree(tree),
-        br_solver(game, tree, value_net) {
-    // Initial strategies are uniform over feasible actions.
-    average_strategies = get_uniform_strategy(game, tree);
-    last_strategies = average_strategies;
-    sum_strategies =
-        get_uniform_reach_weigted_strategy(game, tree, initial_beliefs);
+        br_solver(game, tree, value_net, params.num_threads) {
+    init_strategies();
     assert(!params.use_cfr);
   }
 
@@ -443,27 +1029,41 @@ struct FP : public ISubgameSolver {
      std::shared_ptr<IValueNet> value_net,
      const Pair<std::vector<double>>& beliefs,
      const SubgameSolvingParams& params)
-      : FP(game, unroll_tree(game, root, params.max_depth), value_net, beliefs,
-           params) {}
+      : FP(game, get_cached_tree(game, root, params.max_depth), value_net,
+           beliefs, params) {}
+
+  void reset(const PartialPublicState& root,
+             const Pair<std::vector<double>>& beliefs) override {
+    br_solver.reset_tree(root, params.max_depth);
+    tree = br_solver.tree;
+    initial_beliefs = beliefs;
+    num_strategies = 0;
+    for (int player : {0, 1}) {
+      root_values[player].clear();
+      root_values_means[player].clear();
+    }
+    init_strategies();
+  }
 
   void update_sum_strat(int public_node, int traverser,
-                        const TreeStrategy& br_strategies,
+                        const Strategy& br_strategies,
                         const std::vector<double>& traverser_beliefs) {
-    const auto& node = tree[public_node];
+    const auto& node = (*tree)[public_node];
     const auto& state = node.state;
     if (node.num_children()) {
       if (state.player_id == traverser) {
         std::vector<double> new_beliefs(game.num_hands());
+        const int stride = sum_strategies.hand_stride();
         for (auto [child_node, a] : ChildrenActionIt(node, game)) {
+          const auto* br = br_strategies.action_data(public_node, a);
+          auto* sum = sum_strategies.action_data(public_node, a);
+          auto* last = last_strategies.action_data(public_node, a);
           for (int i = 0; i < game.num_hands(); i++) {
-            sum_strategies[public_node][i][a] +=
-                traverser_beliefs[i] * br_strategies[public_node][i][a];
-            last_strategies[public_node][i][a] =
-                traverser_beliefs[i] * br_strategies[public_node][i][a];
+            sum[i * stride] += traverser_beliefs[i] * br[i * stride];
+            last[i * stride] = traverser_beliefs[i] * br[i * stride];
           }
           for (int i = 0; i < game.num_hands(); i++) {
-            new_beliefs[i] =
-                traverser_beliefs[i] * br_strategies[public_node][i][a];
+            new_beliefs[i] = traverser_beliefs[i] * br[i * stride];
           }
           update_sum_strat(child_node, traverser, br_strategies, new_beliefs);
         }
@@ -478,7 +1078,7 @@ struct FP : public ISubgameSolver {
   }
 
   void step(int traverser) override {
-    const TreeStrategy& br_strategy =
+    const Strategy& br_strategy =
         br_solver.compute_br(traverser, average_strategies, initial_beliefs,
                              &root_values[traverser]);
 
@@ -497,30 +1097,30 @@ struct FP : public ISubgameSolver {
     }
     update_sum_strat(/*public_node=*/0, traverser, br_strategy,
                      initial_beliefs[traverser]);
-    for (size_t node = 0; node < tree.size(); ++node) {
-      if (!tree[node].num_children() ||
-          tree[node].state.player_id != traverser) {
+    for (size_t node = 0; node < tree->size(); ++node) {
+      if (!(*tree)[node].num_children() ||
+          (*tree)[node].state.player_id != traverser) {
         continue;
       }
-      for (int i = 0; i < game.num_hands(); i++) {
-        if (params.linear_update) {
-          for (auto& v : sum_strategies[node][i]) {
-            v *= static_cast<double>(num_update + 1) / (num_update + 2);
-          }
-        }
-        if (params.optimistic) {
-          normalize_probabilities(sum_strategies[node][i],
-                                  last_strategies[node][i],
-                                  &average_strategies[node][i]);
-        } else {
-          normalize_probabilities(sum_strategies[node][i],
-                                  &average_strategies[node][i]);
+      if (params.linear_update) {
+        auto* sums = sum_strategies.node_data(node);
+        for (int i = 0; i < game.num_hands() * game.num_actions(); i++) {
+          sums[i] *= static_cast<double>(num_update + 1) / (num_update + 2);
         }
       }
+      normalize_node(sum_strategies,
+                     params.optimistic ? &last_strategies : nullptr, node,
+                     &average_strategies);
     }
+    average_strategies_cache.invalidate();
     ++num_strategies;
   }
 
+  bool prepare_step(int traverser) override {
+    return br_solver.prepare_br(traverser, average_strategies,
+                                initial_beliefs);
+  }
+
   void multistep() override {
     for (int iter = 0; iter < params.num_iters; ++iter) {
       step(iter % 2);
@@ -533,11 +1133,11 @@ struct FP : public ISubgameSolver {
   }
 
   const TreeStrategy& get_strategy() const override {
-    return average_strategies;
+    return average_strategies_cache.get(average_strategies);
   }
 
   void print_strategy(const std::string& path) const override {
-    poker_dice::print_strategy(game, tree, average_strategies, path);
+    poker_dice::print_strategy(game, *tree, get_strategy(), path);
   }
 
   std::vector<double> get_hand_values(int player_id) const override {
@@ -545,106 +1145,129 @@ struct FP : public ISubgameSolver {
     return root_values_means.at(player_id);
   }
 
-  const Tree& get_tree() const override { return tree; }
+  const Tree& get_tree() const override { return *tree; }
 
  private:
+  // Initial strategies are uniform over feasible actions.
+  void init_strategies() {
+    fill_uniform_strategy(game, *tree, &average_strategies);
+    fill_uniform_strategy(game, *tree, &last_strategies);
+    average_strategies_cache.invalidate();
+    // The reaches of br_solver are recomputed before every use.
+    fill_uniform_reach_weigted_strategy(game, *tree, initial_beliefs,
+                                        &sum_strategies,
+                                        &br_solver.reach_probabilities[0]);
+  }
+
   const SubgameSolvingParams params;
   const Game game;
   // Num updates accumulated in sum_strategies.
   int num_strategies;
   // Believes for both players: [2, num_hands].
-  const Pair<std::vector<double>> initial_beliefs;
+  Pair<std::vector<double>> initial_beliefs;
   // Indexed by [node, hand, action].
-  TreeStrategy average_strategies, sum_strategies, last_strategies;
+  Strategy average_strategies;
+  SumStrategy sum_strategies, last_strategies;
+  TreeStrategyCache<Layout, typename Precision::Value>
+      average_strategies_cache;
   // Values from the last traversal at the root: [2, num_hands].
   Pair<std::vector<double>> root_values;
   Pair<std::vector<double>> root_values_means;
 
-  Tree tree;
-  BRSolver br_solver;
+  std::shared_ptr<const Tree> tree;
+  BRSolver<Layout, Precision> br_solver;
 };
 
-struct CFR : public ISubgameSolver, private PartialTreeTraverser {
-  CFR(const Game& game, const Tree& tree, std::shared_ptr<IValueNet> value_net,
+// Strategies, reaches, and values are Precision::Value, regrets and strategy
+// sums are Precision::Accumulator.
+template <class Layout, class Precision>
+struct CFR : public ISubgameSolver, private PartialTreeTraverser<Precision> {
+  using Base = PartialTreeTraverser<Precision>;
+  using Value = typename Precision::Value;
+  using Strategy = BasicTreeStrategy<Layout, Value>;
+  using SumStrategy =
+      BasicTreeStrategy<Layout, typename Precision::Accumulator>;
+  using Base::add_training_example;
+  using Base::for_each_node;
+  using Base::game;
+  using Base::levels;
+  using Base::precompute_all_leaf_values;
+  using Base::precompute_reaches;
+  using Base::reach_probabilities;
+  using Base::reset_tree;
+  using Base::traverse_backward;
+  using Base::traverser_values;
+  using Base::tree;
+
+  CFR(const Game& game, std::shared_ptr<const Tree> tree,
+      std::shared_ptr<IValueNet> value_net,
       const Pair<std::vector<double>>& beliefs,
       const SubgameSolvingParams& params)
-      : PartialTreeTraverser(game, tree, value_net),
+      : Base(game, tree, value_net, params.num_threads),
         params(params),
         num_steps{0, 0},
         // TODO(akhti): normalize before using!
         initial_beliefs(beliefs) {
-    // Initial strategies are uniform over feasible actions.
-    average_strategies = get_uniform_strategy(game, tree);
-    last_strategies = average_strategies;
-    sum_strategies =
-        get_uniform_reach_weigted_strategy(game, tree, initial_beliefs);
-
-
-
-
-    /*for (size_t node = 0; node < tree.size(); ++node) {
-      for (int i = 0; i < game.num_hands(); i++) {
-        std::cout << " --- --- --- sum_strategies[" << game.state_to_string(tree[node].state) << "]["<<i<<"]: " << sum_strategies[node][i] << std::endl;
-    }}*/
-
-
-    init_nd(tree.size(), game.num_hands(), game.num_actions(), 0.0, &regrets);
-    init_nd(tree.size(), game.num_hands(), 0.0, &reach_probabilities_buffer);
+    if (params.prune_threshold > 0 && params.prune_full_pass_interval < 1) {
+      throw std::invalid_argument(
+          "prune_full_pass_interval must be at least 1 with pruning, got " +
+          std::to_string(params.prune_full_pass_interval));
+    }
+    init_strategies();
   }
 
   CFR(const Game& game, const PartialPublicState& root,
       std::shared_ptr<IValueNet> value_net,
       const Pair<std::vector<double>>& beliefs,
       const SubgameSolvingParams& params)
-      : CFR(game, unroll_tree(game, root, params.max_depth), value_net, beliefs,
-            params) {
+      : CFR(game, get_cached_tree(game, root, params.max_depth), value_net,
+            beliefs, params) {
     assert(params.use_cfr);
     assert(!params.linear_update || !params.dcfr);
   }
 
+  void reset(const PartialPublicState& root,
+             const Pair<std::vector<double>>& beliefs) override {
+    reset_tree(root, params.max_depth);
+    initial_beliefs = beliefs;
+    num_steps = {0, 0};
+    for (int player : {0, 1}) {
+      root_values[player].clear();
+      root_values_means[player].clear();
+    }
+    init_strategies();
+  }
+
   // Adds regrets for the last_strategies to regrets.
   // Sets traverser_values[node] to the EVs of last_strategies for traverser.
   void update_regrets(int traverser) {
-
-
-    precompute_reaches(last_strategies, initial_beliefs);
-    precompute_all_leaf_values(traverser);
-
-    
-
-    for (size_t public_node = tree.size(); public_node-- > 0;) {
-      const auto& node = tree[public_node];
-      if (!node.num_children()) {
-        // All leaf values are set by precompute_all_leaf_values.
-        continue;
-      }
-      const auto& state = node.state;
-      auto& value = traverser_values[public_node];
-      value.assign(value.size(), 0.0);
-      if (state.player_id == traverser) {
-        for (auto [child_node, action] : ChildrenActionIt(node, game)) {
-          const auto& action_value = traverser_values[child_node];
-          for (int hand = 0; hand < game.num_hands(); ++hand) {
-            regrets[public_node][hand][action] += action_value[hand];
-            value[hand] +=
-                action_value[hand] * last_strategies[public_node][hand][action];
-          }
-        }
-        for (int hand = 0; hand < game.num_hands(); ++hand) {
-          for (auto [child_node, action] : ChildrenActionIt(node, game)) {
-            regrets[public_node][hand][action] -= value[hand];
-          }
-        }
-      } else {
-        assert(state.player_id == 1 - traverser);
-        for (auto child_node : ChildrenIt(node)) {
-          const auto& action_value = traverser_values[child_node];
-          for (int hand = 0; hand < game.num_hands(); ++hand) {
-            value[hand] += action_value[hand];
-          }
-        }
-      }
+    refresh_reaches(0);
+    refresh_reaches(1);
+    if (params.prune_threshold > 0 && values_traverser != traverser) {
+      // Inactive hands reuse the values of the traverser's previous pass.
+      std::swap(traverser_values, other_traverser_values);
+      values_traverser = traverser;
+    }
+    if (params.prune_threshold > 0 &&
+        num_steps[traverser] % params.prune_full_pass_interval != 0) {
+      compute_active_hands(traverser);
+      precompute_all_leaf_values(traverser, &active_hands);
+      traverse_backward([&](int node_begin, int node_end, int hand_begin,
+                            int hand_end) {
+        accumulate_level_regrets_pruned(
+            levels, last_strategies, active_hands, traverser, node_begin,
+            node_end, hand_begin, hand_end, &regrets, &traverser_values);
+      });
+      return;
     }
+    precompute_all_leaf_values(traverser);
+    traverse_backward([&](int node_begin, int node_end, int hand_begin,
+                          int hand_end) {
+      // All leaf values are set by precompute_all_leaf_values.
+      accumulate_level_regrets(levels, last_strategies, traverser, node_begin,
+                               node_end, hand_begin, hand_end, &regrets,
+                               &traverser_values);
+    });
   }
 
 
@@ -671,7 +1294,8 @@ struct CFR : public ISubgameSolver, private PartialTreeTraverser {
 
      //print_regrets("regrets_out_priv.txt");
 
-    root_values[traverser] = traverser_values[0];
+    root_values[traverser].assign(traverser_values[0].begin(),
+                                  traverser_values[0].end());
     {
       const double alpha = params.linear_update
                                ? 2. / (num_steps[traverser] + 2)
@@ -684,101 +1308,54 @@ struct CFR : public ISubgameSolver, private PartialTreeTraverser {
       }
     }
 
-    double pos_discount = 1;
-    double neg_discount = 1;
-    double strat_discount = 1;
-    {
-      // We always have uniform strategy, hence +1.
-      const double num_strategies = num_steps[traverser] + 1;
-      if (params.linear_update) {
-        pos_discount = neg_discount = strat_discount =
-            num_strategies / (num_strategies + 1);
-      } else if (params.dcfr) {
-        if (params.dcfr_alpha >= 5) {
-          pos_discount = 1;
-        } else {
-          pos_discount = pow(num_strategies, params.dcfr_alpha) /
-                         (pow(num_strategies, params.dcfr_alpha) + 1.);
-        }
-        if (params.dcfr_beta <= -5) {
-          neg_discount = 0;
-        } else {
-          neg_discount = pow(num_strategies, params.dcfr_beta) /
-                         (pow(num_strategies, params.dcfr_beta) + 1.);
-        }
-        strat_discount =
-            pow(num_strategies / (num_strategies + 1), params.dcfr_gamma);
-      }
-    }
-
-    //std::cout << "(1) Tree size: " <<  tree.size() << std::endl;
-
-    for (size_t node = 0; node < tree.size(); ++node) {
-
-     // std::cout << " --- state: " << game.state_to_string(tree[node].state) << std::endl;
+    // We always have uniform strategy, hence +1.
+    const auto discounts =
+        compute_cfr_discounts(params, num_steps[traverser] + 1);
 
-      if (!tree[node].num_children() ||
-          tree[node].state.player_id != traverser) {
-        continue;
-      }
-      const auto [start, end] = game.get_bid_range(tree[node].state);
-
-      //std::cout << " --- --- state player is traverser " << traverser << " bid range: " << "[" << start << "," << end << ")\n";
-      for (int i = 0; i < game.num_hands(); i++) {
-        for (int action = start; action < end; ++action) {
-          // TODO(akhti): remove magic constant.
-          last_strategies[node][i][action] =
-              std::max<double>(regrets[node][i][action], kRegretSmoothingEps);
-        }
-        normalize_probabilities(last_strategies[node][i],
-                                &last_strategies[node][i]);
+    for_each_node([&](size_t node) {
+      if (!levels.num_children(node) ||
+          levels.player_ids[node] != traverser) {
+        return;
       }
+      const auto [start, end] = levels.action_range(node);
+      regret_matching_node(regrets, node, start, end, &last_strategies);
+    });
+    // Only the strategy of the traverser changed, so these reaches are also
+    // the ones the next update_regrets needs.
+    stale_reaches[traverser] = true;
+    refresh_reaches(traverser);
+    // Steps alternate between the players, so the net can work on the leaves
+    // of the next traverser while the strategy sums are updated. Not done
+    // after the last of params.num_iters steps, so that a solver that is
+    // done does not leave a query behind.
+    if (num_steps[0] + num_steps[1] + 1 < params.num_iters) {
+      this->prefetch_leaf_values(1 - traverser);
     }
 
-    compute_reach_probabilities(game, tree, last_strategies,
-                                initial_beliefs[traverser], traverser,
-                                &reach_probabilities_buffer);
-
-    //std::cout << "(2) Tree size: " <<  tree.size() << std::endl;
-
-    for (size_t node = 0; node < tree.size(); ++node) {
-      //std::cout << " --- state: " << game.state_to_string(tree[node].state) << std::endl;
-      if (!tree[node].num_children() ||
-          tree[node].state.player_id != traverser) {
-        continue;
+    for_each_node([&](size_t node) {
+      if (!levels.num_children(node) ||
+          levels.player_ids[node] != traverser) {
+        return;
       }
-      const auto [action_begin, action_end] =
-          game.get_bid_range(tree[node].state);
-
-     // std::cout << " --- --- state player is traverser " << traverser << " bid range: " << "[" << action_begin << "," << action_end << ")\n";
-
-
-      for (int i = 0; i < game.num_hands(); i++) {
-        //std::cout << " --- --- --- sum_strategies[" << game.state_to_string(tree[node].state) << "]["<<i<<"]: " << sum_strategies[node][i] << std::endl;
-
-        for (Action a = action_begin; a < action_end; ++a) {  //*****
-          regrets[node][i][a] *=
-              regrets[node][i][a] > 0 ? pos_discount : neg_discount;
-        }
-        for (Action a = action_begin; a < action_end; ++a) {
-          sum_strategies[node][i][a] *= strat_discount;
-        }
-        for (Action a = action_begin; a < action_end; ++a) {
-          sum_strategies[node][i][a] +=
-              reach_probabilities_buffer[node][i] * last_strategies[node][i][a];
-        }
-
-
-        //std::cout << " --- --- --- sum_strategies[node][i]: " << sum_strategies[node][i] << std::endl;
-
-        normalize_probabilities(sum_strategies[node][i],
-                                &average_strategies[node][i]);
-      }
-    }
-
+      const auto [action_begin, action_end] = levels.action_range(node);
+      discount_and_accumulate_node(last_strategies,
+                                   reach_probabilities[traverser][node], node,
+                                   action_begin, action_end, discounts,
+                                   &regrets, &sum_strategies,
+                                   &average_strategies);
+    });
+
+    average_strategies_cache.invalidate();
+    last_strategies_cache.invalidate();
     ++num_steps[traverser];
   }
 
+  bool prepare_step(int traverser) override {
+    refresh_reaches(0);
+    refresh_reaches(1);
+    return this->leaf_values_ready(traverser);
+  }
+
   void multistep() override {
     for (int iter = 0; iter < params.num_iters; ++iter) {
       step(iter % 2);
@@ -792,52 +1369,424 @@ struct CFR : public ISubgameSolver, private PartialTreeTraverser {
   }
 
   const TreeStrategy& get_strategy() const override {
-    return average_strategies;
+    return average_strategies_cache.get(average_strategies);
   }
 
   const TreeStrategy& get_sampling_strategy() const override {
-    return last_strategies;
+    return last_strategies_cache.get(last_strategies);
   }
 
   const TreeStrategy& get_belief_propogation_strategy() const override {
-    return last_strategies;
+    return last_strategies_cache.get(last_strategies);
   }
 
   void print_strategy(const std::string& path) const override {
-    poker_dice::print_strategy(game, tree, average_strategies, path);
+    poker_dice::print_strategy(game, *tree, get_strategy(), path);
   }
 
   void print_regrets(const std::string& path) const override {
-    poker_dice::print_strategy(game, tree, regrets, path);
+    TreeStrategy buffer;
+    poker_dice::print_strategy(game, *tree, as_tree_strategy(regrets, &buffer),
+                               path);
   }
 
   std::vector<double> get_hand_values(int player_id) const override {
     return root_values_means.at(player_id);
   }
 
-  const Tree& get_tree() const override { return tree; }
+  const Tree& get_tree() const override { return *tree; }
+
+  int64_t get_num_pruned_updates() const override {
+    return num_pruned_updates;
+  }
 
  private:
+  // Initial strategies are uniform over feasible actions and regrets are
+  // zero.
+  void init_strategies() {
+    fill_uniform_strategy(game, *tree, &average_strategies);
+    last_strategies = average_strategies;
+    average_strategies_cache.invalidate();
+    last_strategies_cache.invalidate();
+    fill_uniform_reach_weigted_strategy(game, *tree, initial_beliefs,
+                                        &sum_strategies,
+                                        &reach_probabilities[0]);
+    regrets.reset(tree->size(), game.num_hands(), game.num_actions());
+    stale_reaches = {true, true};
+    num_pruned_updates = 0;
+    if (params.prune_threshold > 0) {
+      init_nd(tree->size(), game.num_hands(), 0.0, &other_traverser_values);
+      values_traverser = 0;
+    }
+  }
+
+  // Finds the (node, hand) pairs a pruned pass updates and counts the
+  // skipped updates of inner nodes and terminals.
+  //
+  // A subtree is pruned if the oponent's reach mass in it is below
+  // prune_threshold of the mass at the root, so its counterfactual values are
+  // close to zero. A hand is inactive in a child of the traverser's node if
+  // its reach relative to the root is below prune_threshold and the regret of
+  // the action cannot become positive before the next full pass. Every
+  // counterfactual value is at most max_bid times the oponent's reach mass,
+  // so a regret changes by at most 2 * max_bid times that mass per pass.
+  // Linear and DCFR updates also discount negative regrets towards zero after
+  // every pass, so the regret is scaled by the product of those discounts
+  // until the full pass before the gain is added. A hand stays inactive in
+  // the whole subtree below.
+  void compute_active_hands(int traverser) {
+    const auto& own_reaches = reach_probabilities[traverser];
+    const auto& op_reaches = reach_probabilities[1 - traverser];
+    const double threshold = params.prune_threshold;
+    const int passes_to_full_pass =
+        params.prune_full_pass_interval -
+        num_steps[traverser] % params.prune_full_pass_interval;
+    double negative_discount = 1;
+    for (int pass = 0; pass < passes_to_full_pass; ++pass) {
+      negative_discount *=
+          compute_cfr_discounts(params, num_steps[traverser] + 1 + pass).neg;
+    }
+    const int num_nodes = levels.num_nodes();
+    const int num_hands = game.num_hands();
+    active_hands.is_pruned.resize(num_nodes);
+    active_hands.hands.resize(num_nodes);
+    active_hands.is_active.resize(num_nodes);
+    op_reach_mass.resize(num_nodes);
+    for (int node = 0; node < num_nodes; ++node) {
+      op_reach_mass[node] = vector_sum(op_reaches[node]);
+      const int parent = levels.parents[node];
+      auto& hands = active_hands.hands[node];
+      auto& is_active = active_hands.is_active[node];
+      hands.clear();
+      is_active.assign(num_hands, 0);
+      if (parent < 0) {
+        active_hands.is_pruned[node] = false;
+        is_active.assign(num_hands, 1);
+      } else {
+        active_hands.is_pruned[node] =
+            active_hands.is_pruned[parent] ||
+            op_reach_mass[node] < threshold * op_reach_mass[0];
+        if (active_hands.is_pruned[node]) {
+          if (levels.num_children(node) ||
+              game.is_terminal((*tree)[node].state)) {
+            num_pruned_updates += num_hands;
+          }
+          continue;
+        }
+        const char* parent_active = active_hands.is_active[parent].data();
+        if (levels.player_ids[parent] == traverser) {
+          const double max_regret_gain = passes_to_full_pass * 2.0 *
+                                         game.max_bid * op_reach_mass[parent];
+          const auto* action_regrets =
+              regrets.action_data(parent, levels.actions[node]);
+          const int stride = regrets.hand_stride();
+          for (int hand = 0; hand < num_hands; ++hand) {
+            is_active[hand] =
+                parent_active[hand] &&
+                (own_reaches[node][hand] >= threshold * own_reaches[0][hand] ||
+                 action_regrets[hand * stride] * negative_discount +
+                         max_regret_gain >=
+                     0);
+          }
+        } else {
+          std::copy_n(parent_active, num_hands, is_active.begin());
+        }
+      }
+      for (int hand = 0; hand < num_hands; ++hand) {
+        if (is_active[hand]) hands.push_back(hand);
+      }
+      if (levels.num_children(node)) {
+        num_pruned_updates += num_hands - hands.size();
+      } else if (hands.empty() && game.is_terminal((*tree)[node].state)) {
+        num_pruned_updates += num_hands;
+      }
+    }
+  }
+
+  // Recomputes reach_probabilities[player] for last_strategies unless they
+  // are up to date. The reaches of a player only depend on the strategy in
+  // the nodes of the player.
+  void refresh_reaches(int player) {
+    if (!stale_reaches[player]) return;
+    precompute_reaches(last_strategies, initial_beliefs[player], player);
+    stale_reaches[player] = false;
+  }
+
   const SubgameSolvingParams params;
   // Num step() done for the player.
   Pair<int> num_steps;
   // Believes for both players: [2, num_hands].
-  const Pair<std::vector<double>> initial_beliefs;
+  Pair<std::vector<double>> initial_beliefs;
   // Indexed by [node, hand, action].
-  TreeStrategy average_strategies, sum_strategies, last_strategies;
-  TreeStrategy regrets;
+  Strategy average_strategies, last_strategies;
+  SumStrategy sum_strategies, regrets;
+  TreeStrategyCache<Layout, Value> average_strategies_cache,
+      last_strategies_cache;
   // Values from the last traversal at the root: [2, num_hands].
   Pair<std::vector<double>> root_values;
   Pair<std::vector<double>> root_values_means;
 
-  // Buffer to store reach probabilties for the last_strategies.
-  std::vector<std::vector<double>> reach_probabilities_buffer;
+  // Whether reach_probabilities[player] are out of date for last_strategies.
+  Pair<bool> stale_reaches;
+
+  // Buffers of the pruned passes. With pruning traverser_values hold the
+  // values of values_traverser and other_traverser_values those of the
+  // other player.
+  ActiveHands active_hands;
+  std::vector<double> op_reach_mass;
+  std::vector<std::vector<Value>> other_traverser_values;
+  int values_traverser;
+  int64_t num_pruned_updates;
 }; // END CFR struct
+
+// CFR for the full game under a block of public hands. The betting tree does
+// not depend on the public hand, so all public hands share one tree and every
+// per-node array is laid out as [public_hand, hand]: the block runs the CFR
+// update of a game with num_public_hands * num_hands private hands. Only the
+// terminal values couple hands and are computed per public hand. Every
+// element goes through the same operations as in CFR, so the results are
+// bitwise equal to solving the public hands one by one.
+template <class Layout>
+struct BatchedCFRBlock {
+  using Strategy = BasicTreeStrategy<Layout>;
+
+  BatchedCFRBlock(const Game& game, const std::vector<int>& public_hands,
+                  const SubgameSolvingParams& params)
+      : game(game),
+        params(params),
+        public_hands(public_hands),
+        num_hands(public_hands.size() * game.num_hands()),
+        num_steps{0, 0} {
+    assert(params.use_cfr);
+    assert(!params.linear_update || !params.dcfr);
+    assert(!public_hands.empty());
+    tree = get_cached_tree(game, game.get_initial_state(public_hands[0]),
+                           params.max_depth);
+    build_tree_levels(game, *tree, &levels);
+    for (size_t node_id = 0; node_id < tree->size(); ++node_id) {
+      const auto& node = (*tree)[node_id];
+      if (game.is_terminal(node.state)) {
+        terminal_indices.push_back(node_id);
+      } else if (!node.num_children()) {
+        throw std::runtime_error("Found a node " +
+                                 game.state_to_string(node.state) +
+                                 " that is a non-final leaf. Batched solving "
+                                 "requires max_depth to cover the full game");
+      }
+    }
+    for (int player : {0, 1}) {
+      initial_beliefs[player].assign(num_hands, 1.0 / game.num_hands());
+      init_nd(tree->size(), num_hands, 0.0, &reach_probabilities[player]);
+    }
+    init_nd(tree->size(), num_hands, 0.0, &traverser_values);
+    fill_uniform_strategy(game, *tree, num_hands, &average_strategies);
+    last_strategies = average_strategies;
+    fill_uniform_reach_weigted_strategy(game, *tree, initial_beliefs,
+                                        &sum_strategies,
+                                        &reach_probabilities[0]);
+    regrets.reset(tree->size(), num_hands, game.num_actions());
+    stale_reaches = {true, true};
+  }
+
+  // Same as CFR::update_regrets for all public hands. Without a value net
+  // only the reaches of the oponent are needed.
+  void update_regrets(int traverser) {
+    refresh_reaches(1 - traverser);
+    precompute_terminal_leaves_values(traverser);
+    for (int level = levels.num_levels(); level-- > 0;) {
+      accumulate_level_regrets(levels, last_strategies, traverser,
+                               levels.level_offsets[level],
+                               levels.level_offsets[level + 1], 0, num_hands,
+                               &regrets, &traverser_values);
+    }
+  }
+
+  void step(int traverser) {
+    update_regrets(traverser);
+
+    const auto& root_values = traverser_values[0];
+    {
+      const double alpha = params.linear_update
+                               ? 2. / (num_steps[traverser] + 2)
+                               : 1. / (num_steps[traverser] + 1);
+      root_values_means[traverser].resize(root_values.size());
+      for (size_t i = 0; i < root_values.size(); ++i) {
+        root_values_means[traverser][i] +=
+            (root_values[i] - root_values_means[traverser][i]) * alpha;
+      }
+    }
+
+    // We always have uniform strategy, hence +1.
+    const auto discounts =
+        compute_cfr_discounts(params, num_steps[traverser] + 1);
+    for (int node = 0; node < levels.num_nodes(); ++node) {
+      if (!levels.num_children(node) ||
+          levels.player_ids[node] != traverser) {
+        continue;
+      }
+      const auto [start, end] = levels.action_range(node);
+      regret_matching_node(regrets, node, start, end, &last_strategies);
+    }
+    stale_reaches[traverser] = true;
+    refresh_reaches(traverser);
+    for (int node = 0; node < levels.num_nodes(); ++node) {
+      if (!levels.num_children(node) ||
+          levels.player_ids[node] != traverser) {
+        continue;
+      }
+      const auto [action_begin, action_end] = levels.action_range(node);
+      discount_and_accumulate_node(last_strategies,
+                                   reach_probabilities[traverser][node], node,
+                                   action_begin, action_end, discounts,
+                                   &regrets, &sum_strategies,
+                                   &average_strategies);
+    }
+
+    ++num_steps[traverser];
+  }
+
+  TreeStrategy get_strategy(int index) const {
+    TreeStrategy strategy(tree->size(), game.num_hands(), game.num_actions());
+    const int offset = index * game.num_hands();
+    for (size_t node = 0; node < tree->size(); ++node) {
+      for (int hand = 0; hand < game.num_hands(); ++hand) {
+        for (int action = 0; action < game.num_actions(); ++action) {
+          strategy[node][hand][action] =
+              average_strategies.at(node, offset + hand, action);
+        }
+      }
+    }
+    return strategy;
+  }
+
+  std::vector<double> get_hand_values(int index, int player_id) const {
+    const auto& means = root_values_means.at(player_id);
+    const auto begin = means.begin() + index * game.num_hands();
+    return std::vector<double>(begin, begin + game.num_hands());
+  }
+
+ private:
+  // Same as CFR::refresh_reaches.
+  void refresh_reaches(int player) {
+    if (!stale_reaches[player]) return;
+    compute_reach_probabilities(levels, last_strategies,
+                                initial_beliefs[player], player,
+                                &reach_probabilities[player]);
+    stale_reaches[player] = false;
+  }
+
+  // Populates traverser_values for terminal nodes, one public hand at a time.
+  void precompute_terminal_leaves_values(int traverser) {
+    std::vector<double> op_reaches(game.num_hands());
+    for (auto node_id : terminal_indices) {
+      auto state = (*tree)[node_id].state;
+      const auto& reaches = reach_probabilities[1 - traverser][node_id];
+      for (size_t i = 0; i < public_hands.size(); ++i) {
+        const int offset = i * game.num_hands();
+        state.hand = public_hands[i];
+        std::copy_n(reaches.begin() + offset, game.num_hands(),
+                    op_reaches.begin());
+        const auto values = compute_expected_terminal_values(
+            game, state, /*inverse=*/state.player_id != traverser,
+            op_reaches);
+        std::copy(values.begin(), values.end(),
+                  traverser_values[node_id].begin() + offset);
+      }
+    }
+  }
+
+  const Game game;
+  const SubgameSolvingParams params;
+  const std::vector<int> public_hands;
+  // Size of the [public_hand, hand] axis.
+  const int num_hands;
+  std::shared_ptr<const Tree> tree;
+  TreeLevels levels;
+  std::vector<size_t> terminal_indices;
+  // Num step() done for the player.
+  Pair<int> num_steps;
+  // Believes for both players: [2, num_public_hands * num_hands].
+  Pair<std::vector<double>> initial_beliefs;
+  // Indexed by [node, public_hand * num_hands + hand, action].
+  Strategy average_strategies, sum_strategies, last_strategies;
+  Strategy regrets;
+  // [2, num_nodes, num_public_hands * num_hands].
+  Pair<std::vector<std::vector<double>>> reach_probabilities;
+  // [num_nodes, num_public_hands * num_hands].
+  std::vector<std::vector<double>> traverser_values;
+  Pair<std::vector<double>> root_values_means;
+  Pair<bool> stale_reaches;
+};
+
+// Splits the public hands into blocks small enough for the state of a block
+// to stay in cache. multistep() runs all iterations block by block.
+template <class Layout>
+struct BatchedCFR : public IBatchedSubgameSolver {
+  // Wider blocks amortize more per-node work, narrower ones stay in cache.
+  static constexpr int kPublicHandsPerBlock = 8;
+
+  BatchedCFR(const Game& game, const std::vector<int>& public_hands,
+             const SubgameSolvingParams& params)
+      : params(params), total_public_hands(public_hands.size()) {
+    for (size_t begin = 0; begin < public_hands.size();
+         begin += kPublicHandsPerBlock) {
+      const size_t end =
+          std::min(begin + kPublicHandsPerBlock, public_hands.size());
+      blocks.push_back(std::make_unique<BatchedCFRBlock<Layout>>(
+          game,
+          std::vector<int>(public_hands.begin() + begin,
+                           public_hands.begin() + end),
+          params));
+    }
+  }
+
+  void step(int traverser) override {
+    for (auto& block : blocks) block->step(traverser);
+  }
+
+  void multistep() override {
+    for (auto& block : blocks) {
+      for (int iter = 0; iter < params.num_iters; ++iter) {
+        block->step(iter % 2);
+      }
+    }
+  }
+
+  int num_public_hands() const override { return total_public_hands; }
+
+  TreeStrategy get_strategy(int index) const override {
+    return blocks[index / kPublicHandsPerBlock]->get_strategy(
+        index % kPublicHandsPerBlock);
+  }
+
+  std::vector<double> get_hand_values(int index, int player_id) const override {
+    return blocks[index / kPublicHandsPerBlock]->get_hand_values(
+        index % kPublicHandsPerBlock, player_id);
+  }
+
+ private:
+  const SubgameSolvingParams params;
+  const int total_public_hands;
+  std::vector<std::unique_ptr<BatchedCFRBlock<Layout>>> blocks;
+};
+
+template <class Layout, class Precision>
+std::unique_ptr<ISubgameSolver> build_solver_with_precision(
+    const Game& game, const PartialPublicState& root,
+    const Pair<std::vector<double>>& beliefs,
+    const SubgameSolvingParams& params, std::shared_ptr<IValueNet> net) {
+  if (params.use_cfr) {
+    return std::make_unique<CFR<Layout, Precision>>(game, root, net, beliefs,
+                                                    params);
+  } else {
+    return std::make_unique<FP<Layout, Precision>>(game, root, net, beliefs,
+                                                   params);
+  }
+}
 }  // namespace
 
 TreeStrategy get_uniform_strategy(const Game& game, const Tree& tree) {
-  TreeStrategy strategy;
-  init_nd(tree.size(), game.num_hands(), game.num_actions(), 0.0, &strategy);
+  TreeStrategy strategy(tree.size(), game.num_hands(), game.num_actions());
   for (size_t node_id = 0; node_id < tree.size(); ++node_id) {
     int first = game.get_bid_range(tree[node_id].state).first;
     int last = first + tree[node_id].num_children();
@@ -897,16 +1846,23 @@ void print_strategy(const Game& game, const Tree& tree,
 
 std::vector<double> compute_win_probability(int public_hand,
     const Game& game, const std::vector<double>& beliefs) {
-
+  // A hand beats every hand in the tie classes before its own and splits the
+  // pot within its tie class.
+  const ShowdownRanking ranking = game.showdown_ranking(public_hand);
   std::vector<double> values(game.num_hands());
-
-  for (int myhand = 0; myhand < game.num_hands(); ++myhand) {
-    for (int ophand = 0; ophand < game.num_hands(); ++ophand) {
-      values[myhand] += beliefs[ophand] * game.utility(myhand, ophand, public_hand);
-      //values[myhand] += 1. / game.num_hands() * game.utility(myhand, ophand, public_hand);
+  double weaker_mass = 0;
+  for (int c = 0; c < ranking.num_classes; ++c) {
+    const int begin = ranking.class_begin[c], end = ranking.class_begin[c + 1];
+    double tie_mass = 0;
+    for (int i = begin; i < end; ++i) {
+      tie_mass += beliefs[ranking.order[i]];
     }
+    const double value = weaker_mass + 0.5 * tie_mass;
+    for (int i = begin; i < end; ++i) {
+      values[ranking.order[i]] = value;
+    }
+    weaker_mass += tie_mass;
   }
-
   return values;
 }
 
@@ -914,26 +1870,66 @@ std::vector<double> compute_win_probability(int public_hand,
 //****************************************************
 //****************************************************
 
+template <class Layout>
 std::unique_ptr<ISubgameSolver> build_solver(
     const Game& game, const PartialPublicState& root,
     const Pair<std::vector<double>>& beliefs,
     const SubgameSolvingParams& params, std::shared_ptr<IValueNet> net) {
-  if (params.use_cfr) {
-    return std::make_unique<CFR>(game, root, net, beliefs, params);
+  if (!params.use_float) {
+    return build_solver_with_precision<Layout, DoublePrecision>(
+        game, root, beliefs, params, net);
+  } else if (params.float_accumulators) {
+    return build_solver_with_precision<Layout, FloatPrecision>(
+        game, root, beliefs, params, net);
   } else {
-    return std::make_unique<FP>(game, root, net, beliefs, params);
+    return build_solver_with_precision<Layout, MixedPrecision>(
+        game, root, beliefs, params, net);
   }
 }
 
+template std::unique_ptr<ISubgameSolver> build_solver<HandMajor>(
+    const Game& game, const PartialPublicState& root,
+    const Pair<std::vector<double>>& beliefs,
+    const SubgameSolvingParams& params, std::shared_ptr<IValueNet> net);
+template std::unique_ptr<ISubgameSolver> build_solver<ActionMajor>(
+    const Game& game, const PartialPublicState& root,
+    const Pair<std::vector<double>>& beliefs,
+    const SubgameSolvingParams& params, std::shared_ptr<IValueNet> net);
+
+std::unique_ptr<ISubgameSolver> build_solver(
+    const Game& game, const PartialPublicState& root,
+    const Pair<std::vector<double>>& beliefs,
+    const SubgameSolvingParams& params, std::shared_ptr<IValueNet> net) {
+  return build_solver<SolverLayout>(game, root, beliefs, params, net);
+}
+
+std::unique_ptr<IBatchedSubgameSolver> build_batched_full_game_solver(
+    const Game& game, const std::vector<int>& public_hands,
+    const SubgameSolvingParams& params) {
+  return std::make_unique<BatchedCFR<SolverLayout>>(game, public_hands,
+                                                    params);
+}
+
+ISubgameSolver* SolverPool::acquire(const PartialPublicState& root,
+                                    const Pair<std::vector<double>>& beliefs) {
+  auto& solver = solvers_[{root.last_bid, root.event, root.player_id}];
+  if (solver == nullptr) {
+    solver = build_solver(game_, root, beliefs, params_, net_);
+  } else {
+    solver->reset(root, beliefs);
+  }
+  return solver.get();
+}
+
 std::array<double, 2> compute_exploitability2(const Game& game,
                                               const TreeStrategy& strategy, int public_hand) {
   const auto root = game.get_initial_state(public_hand);
-  const auto tree = unroll_tree(game, root, /*max_depth=*/1000000);
+  const auto tree = get_cached_tree(game, root, /*max_depth=*/1000000);
   Pair<std::vector<double>> beliefs;
   for (auto i : {0, 1}) {
     beliefs[i].assign(game.num_hands(), 1. / game.num_hands());
   }
-  BRSolver solver(game, tree, /*value_net=*/nullptr);
+  BRSolver<SolverLayout> solver(game, tree, /*value_net=*/nullptr);
   std::vector<double> values0, values1;
   solver.compute_br(/*traverser=*/0, strategy, beliefs, &values0);
   solver.compute_br(/*traverser=*/1, strategy, beliefs, &values1);
@@ -960,7 +1956,8 @@ TreeStrategyStats compute_stategy_stats(const Game& game,
 
 
   const auto uniform_beliefs = get_initial_beliefs(game).at(0);
-  const auto tree = unroll_tree(game, 152);
+  const auto tree_ptr = get_cached_tree(game, 152);
+  const Tree& tree = *tree_ptr;
   TreeStrategyStats stats;
   stats.tree = tree;
 
@@ -1050,11 +2047,17 @@ deserialize_query(const Game& game, const float* query) {
   PartialPublicState state;
   state.player_id = query[index++] + 0.5;
   const int traverser = query[index++] + 0.5;
-  // TODO(akhti): use constant for initial action.
-  state.last_bid = -1;
-  for (Action action = 0; action < game.num_actions(); ++action) {
+  // write_query_to has no slot for max_bid, so a query without a set bid is
+  // at max_bid.
+  state.last_bid = game.max_bid;
+  for (int bid = 0; bid < game.max_bid; ++bid) {
+    if (query[index++] > 0.5) {
+      state.last_bid = bid;
+    }
+  }
+  for (int pub_hand = 0; pub_hand < 216; ++pub_hand) {
     if (query[index++] > 0.5) {
-      state.last_bid = action;
+      state.hand = pub_hand;
     }
   }
   std::vector<std::vector<double>> beliefs(2);
@@ -1071,7 +2074,8 @@ std::vector<double> compute_ev(const Game& game, const TreeStrategy& strategy1,
 
   std::cerr << "DANERGOUS TODO!!!\n";
 
-  auto tree = unroll_tree(game, 152);
+  const auto tree_ptr = get_cached_tree(game, 152);
+  const Tree& tree = *tree_ptr;
   assert(tree.size() == strategy1.size());
   assert(tree.size() == strategy2.size());
   std::vector<std::vector<double>> op_reach_probabilities;
@@ -1127,11 +2131,11 @@ std::vector<std::vector<double>> compute_immediate_regrets(
   std::cerr << "DANGEROUS TODO !!!\n";
 
 
-  const Tree tree = unroll_tree(game, 152);
+  const auto tree_ptr = get_cached_tree(game, 152);
+  const Tree& tree = *tree_ptr;
   assert(!strategies.empty());
-  TreeStrategy regrets;
-  init_nd(tree.size(), game.num_hands(), game.num_actions(), 0.0, &regrets);
-  PartialTreeTraverser tree_traverser(game, tree, nullptr);
+  TreeStrategy regrets(tree.size(), game.num_hands(), game.num_actions());
+  PartialTreeTraverser<> tree_traverser(game, tree_ptr, nullptr);
   const std::vector<double> initial_beliefs = get_initial_beliefs(game)[0];
   for (size_t strategy_id = 0; strategy_id < strategies.size(); ++strategy_id) {
     const auto& last_strategies = strategies[strategy_id];
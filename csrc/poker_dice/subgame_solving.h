@@ -19,11 +19,15 @@ Solvers (FP and CFR) for subgames.
 #pragma once
 
 #include <array>
+#include <map>
+#include <memory>
+#include <tuple>
 #include <vector>
 
 #include "poker_dice.h"
 #include "net_interface.h"
 #include "tree.h"
+#include "tree_strategy.h"
 
 namespace poker_dice {
 
@@ -37,7 +41,12 @@ constexpr double kReachSmoothingEps = 1e-80;
 constexpr double kRegretSmoothingEps = 1e-80;
 
 // Indexed by [node, hand, action].
-using TreeStrategy = std::vector<std::vector<std::vector<double>>>;
+using TreeStrategy = FlatTreeStrategy;
+
+// Layout of the regrets and strategies kept inside the solvers. Strategies
+// returned through ISubgameSolver are always TreeStrategy. ActionMajor makes
+// the per-hand loops unit-stride and is faster in layout_benchmark.
+using SolverLayout = ActionMajor;
 
 struct TreeStrategyStats;
 
@@ -47,6 +56,16 @@ struct SubgameSolvingParams {
   int max_depth = 2;
   bool linear_update = false;
   bool use_cfr = false;  // Whetehr to use FP or CFR.
+  // Threads to traverse the tree of a single subgame with. Nodes of the same
+  // depth and, for wide nodes, ranges of hands are processed concurrently.
+  // Only worth it for large subgames; 1 keeps everything on the caller.
+  int num_threads = 1;
+  // Keeps strategies, reaches, and values in float instead of double, which
+  // halves the memory traffic of the traversals for data generation. Regrets
+  // and strategy sums stay double unless float_accumulators is set too.
+  // Strategies and values returned through ISubgameSolver are double.
+  bool use_float = false;
+  bool float_accumulators = false;
 
   // FP only params.
   bool optimistic = false;
@@ -56,6 +75,15 @@ struct SubgameSolvingParams {
   double dcfr_alpha = 0;
   double dcfr_beta = 0;
   double dcfr_gamma = 0;
+  // Regret-based pruning, off for 0. Iterations skip the hands whose reach
+  // relative to the root falls below prune_threshold and the subtrees the
+  // oponent reaches with less than prune_threshold of its mass. Skipped
+  // regrets stay frozen until the next full pass. Every
+  // prune_full_pass_interval-th iteration of a player is a full pass, so 1
+  // disables the pruned passes. With pruning on, building a CFR solver with an
+  // interval below 1 throws std::invalid_argument.
+  double prune_threshold = 0;
+  int prune_full_pass_interval = 10;
 };
 
 
@@ -73,6 +101,12 @@ class ISubgameSolver {
   // Make params.num_iter steps.
   virtual void multistep() = 0;
 
+  // Starts the value net query the next step(traverser) needs, if it is not
+  // running yet, and returns whether its values are there, i.e., whether the
+  // step can run without waiting for the net. Lets a caller work on something
+  // else instead of blocking in step.
+  virtual bool prepare_step(int /*traverser*/) { return true; }
+
   // Matrix of shape [node, hand, action]: responses for every hand and node.
   virtual const TreeStrategy& get_strategy() const = 0;
   // Strategy to use to choose next node in MDP.
@@ -88,6 +122,15 @@ class ISubgameSolver {
   virtual void update_value_network() = 0;
 
   virtual const Tree& get_tree() const = 0;
+
+  // Number of (node, hand) updates skipped by pruning so far.
+  virtual int64_t get_num_pruned_updates() const { return 0; }
+
+  // Restarts solving from a new root and beliefs. The result is the same as
+  // for a freshly built solver, but the tree, strategy, and query buffers are
+  // reused. Cheapest if the new root has the same tree shape as the old one.
+  virtual void reset(const PartialPublicState& root,
+                     const Pair<std::vector<double>>& beliefs) = 0;
 };
 
 std::vector<float> get_query(const Game& game, int traverser,
@@ -108,7 +151,8 @@ void print_strategy(const Game& game, const Tree& tree,
                     const TreeStrategy& strategy);
 
 // Computes probabilities to win the game for each possible hand assuming that
-// the oponents hands are distributed according to beliefs.
+// the oponents hands are distributed according to beliefs. Ties count as half
+// a win. Runs in O(H) by sweeping the tie classes of Game::showdown_ranking.
 std::vector<double> compute_win_probability(int public_hand,const Game& game, 
                                             const std::vector<double>& beliefs);
 
@@ -120,6 +164,14 @@ inline Pair<std::vector<double>> get_initial_beliefs(const Game& game) {
   return beliefs;
 }
 
+std::unique_ptr<ISubgameSolver> build_solver(
+    const Game& game, const PartialPublicState& root,
+    const Pair<std::vector<double>>& beliefs,
+    const SubgameSolvingParams& params, std::shared_ptr<IValueNet> net);
+
+// Same as above with an explicit internal layout. Instantiated for HandMajor
+// and ActionMajor.
+template <class Layout>
 std::unique_ptr<ISubgameSolver> build_solver(
     const Game& game, const PartialPublicState& root,
     const Pair<std::vector<double>>& beliefs,
@@ -138,6 +190,58 @@ inline std::unique_ptr<ISubgameSolver> build_solver(
   return build_solver(game, params, /*net=*/nullptr);
 }
 
+// Solves the full game for several public hands at once. See
+// build_batched_full_game_solver.
+class IBatchedSubgameSolver {
+ public:
+  virtual ~IBatchedSubgameSolver() = default;
+
+  virtual void step(int traverser) = 0;
+  // Make params.num_iters steps.
+  virtual void multistep() = 0;
+
+  virtual int num_public_hands() const = 0;
+  // Average strategy for the index-th public hand.
+  virtual TreeStrategy get_strategy(int index) const = 0;
+  // Values for each hand at the top of the game for the index-th public hand.
+  virtual std::vector<double> get_hand_values(int index,
+                                              int player_id) const = 0;
+};
+
+// Builds a CFR solver for the full game from the initial state of every
+// public hand in `public_hands`, with uniform beliefs. All public hands are
+// updated together in one pass over a shared tree. The strategies and values
+// are bitwise equal to the ones of build_solver for each public hand. Requires
+// params.use_cfr and a max_depth that covers the full game.
+std::unique_ptr<IBatchedSubgameSolver> build_batched_full_game_solver(
+    const Game& game, const std::vector<int>& public_hands,
+    const SubgameSolvingParams& params);
+
+// Keeps one solver per tree shape and resets it instead of building a new
+// solver for every subgame. In poker dice the shape of a subgame only depends
+// on the last bid, the event, and the acting player, so repeated subgames
+// reuse all their buffers. Not thread safe.
+class SolverPool {
+ public:
+  SolverPool(const Game& game, const SubgameSolvingParams& params,
+             std::shared_ptr<IValueNet> net)
+      : game_(game), params_(params), net_(std::move(net)) {}
+
+  // Returns a solver for the subgame. The solver is owned by the pool and is
+  // valid until the next call to acquire with a root of the same shape.
+  ISubgameSolver* acquire(const PartialPublicState& root,
+                          const Pair<std::vector<double>>& beliefs);
+
+  size_t size() const { return solvers_.size(); }
+
+ private:
+  const Game game_;
+  const SubgameSolvingParams params_;
+  std::shared_ptr<IValueNet> net_;
+  std::map<std::tuple<Action, int, int>, std::unique_ptr<ISubgameSolver>>
+      solvers_;
+};
+
 double compute_exploitability(const Game& game, const TreeStrategy& strategy, int public_hand);
 std::array<double, 2> compute_exploitability2(const Game& game,
                                               const TreeStrategy& strategy, int public_hand);
@@ -14,8 +14,17 @@
 
 #include <math.h>
 
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
 #include <gtest/gtest.h>
 
+#include "cfr_kernels.h"
 #include "real_net.h"
 #include "subgame_solving.h"
 #include "util.h"
@@ -24,6 +33,99 @@
 using namespace poker_dice;
 
 namespace {
+// Value net whose values only depend on the query. Optionally writes the
+// values in place and records the buffers it writes to.
+class QueryDependentNet : public IValueNet {
+ public:
+  explicit QueryDependentNet(bool in_place) : in_place_(in_place) {}
+
+  torch::Tensor compute_values(const torch::Tensor queries) override {
+    auto values = torch::empty({queries.size(0), kNumHands});
+    fill_values(queries, values);
+    return values;
+  }
+
+  void compute_values_into(const torch::Tensor queries,
+                           torch::Tensor values) override {
+    if (!in_place_) {
+      IValueNet::compute_values_into(queries, values);
+      return;
+    }
+    output_buffers.push_back(values.data_ptr<float>());
+    fill_values(queries, values);
+  }
+
+  void add_training_example(const torch::Tensor /*queries*/,
+                            const torch::Tensor /*values*/) override {}
+
+  std::vector<float*> output_buffers;
+
+ private:
+  static constexpr int kNumHands = 36;
+
+  static void fill_values(const torch::Tensor& queries, torch::Tensor values) {
+    auto queries_acc = queries.accessor<float, 2>();
+    auto values_acc = values.accessor<float, 2>();
+    const int query_size = queries.size(1);
+    for (int row = 0; row < queries.size(0); ++row) {
+      for (int hand = 0; hand < kNumHands; ++hand) {
+        values_acc[row][hand] =
+            queries_acc[row][query_size - kNumHands + hand] * 10 -
+            queries_acc[row][query_size - 2 * kNumHands + hand] * 5 +
+            queries_acc[row][0];
+      }
+    }
+  }
+
+  const bool in_place_;
+};
+
+// Same as QueryDependentNet, but computes the values on another thread.
+class AsyncQueryDependentNet : public QueryDependentNet {
+ public:
+  AsyncQueryDependentNet() : QueryDependentNet(/*in_place=*/true) {}
+
+  std::future<void> compute_values_async(const torch::Tensor queries,
+                                         torch::Tensor values) override {
+    ++num_async_queries;
+    return std::async(std::launch::async, [this, queries, values] {
+      compute_values_into(queries, values);
+    });
+  }
+
+  int num_async_queries = 0;
+};
+
+// Same as QueryDependentNet, but computes the values on a thread of its own
+// after a delay and reports them through a promise, like the nets that batch
+// queries on worker threads. Unlike a std::async future, the returned one
+// does not wait for the computation when destroyed.
+class SlowPromiseNet : public QueryDependentNet {
+ public:
+  SlowPromiseNet() : QueryDependentNet(/*in_place=*/true) {}
+
+  ~SlowPromiseNet() {
+    for (auto& thread : threads_) thread.join();
+  }
+
+  std::future<void> compute_values_async(const torch::Tensor queries,
+                                         torch::Tensor values) override {
+    auto promise = std::make_shared<std::promise<void>>();
+    threads_.emplace_back([this, queries, values, promise] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      compute_values_into(queries, values);
+      ++num_finished;
+      promise->set_value();
+    });
+    return promise->get_future();
+  }
+
+  std::atomic<int> num_finished{0};
+
+ private:
+  std::vector<std::thread> threads_;
+};
+
 double compute_fp_exploitability(const Game& game,
                                  const PartialPublicState& root,
                                  const Pair<std::vector<double>>& beliefs,
@@ -34,7 +136,7 @@ double compute_fp_exploitability(const Game& game,
   auto solver = build_solver(game, root, beliefs, params, net);
   solver->multistep();
   std::array<double, 2> values =
-      compute_exploitability2(game, solver->get_strategy());
+      compute_exploitability2(game, solver->get_strategy(), root.hand);
   return (values[0] + values[1]) / 2.;
 }
 // No-network version assumes that all leaf nodes are final.
@@ -44,6 +146,18 @@ double compute_fp_exploitability(const Game& game,
                                  const SubgameSolvingParams& params) {
   return compute_fp_exploitability(game, root, beliefs, params, nullptr);
 }
+
+void expect_strategies_eq(const Game& game, const TreeStrategy& expected,
+                          const TreeStrategy& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (size_t node = 0; node < expected.size(); ++node) {
+    for (int hand = 0; hand < game.num_hands(); ++hand) {
+      for (int action = 0; action < game.num_actions(); ++action) {
+        ASSERT_EQ(expected[node][hand][action], actual[node][hand][action]);
+      }
+    }
+  }
+}
 }  // namespace
 
 /*
@@ -144,55 +258,49 @@ TEST(EvaluateTerninalNode, MyTest) {
 }
 */
 
-
-TEST(FictiousTest, TestOneDiceOneFace) {
-  const int num_dice = 1;
-  const int num_faces = 1;
-  SubgameSolvingParams params;
-  params.num_iters = 3500;
-  params.max_depth = 100;
-  Game game(num_dice, num_faces);
-
-  const auto root = game.get_initial_state();
-
-  const auto initial_beliefs = get_initial_beliefs(game);
-  ASSERT_EQ(game.num_hands(), 1);
-  ASSERT_EQ(initial_beliefs[0][0], 1.0);
-  const auto value =
-      compute_fp_exploitability(game, root, initial_beliefs, params);
-  ASSERT_GE(value, 0.0);
-  ASSERT_LT(value, 1e-3);
+TEST(EvaluateTerninalNode, TestWinProbabilityMatchesPairwise) {
+  Game game(2, 6);
+  std::vector<double> beliefs(game.num_hands());
+  for (int hand = 0; hand < game.num_hands(); ++hand) {
+    beliefs[hand] = (hand % 7 + 1) / 100.0;
+  }
+  for (int pub_hand = 0; pub_hand < 216; ++pub_hand) {
+    const auto values = compute_win_probability(pub_hand, game, beliefs);
+    for (int myhand = 0; myhand < game.num_hands(); ++myhand) {
+      double expected = 0;
+      for (int ophand = 0; ophand < game.num_hands(); ++ophand) {
+        expected += beliefs[ophand] * game.utility(myhand, ophand, pub_hand);
+      }
+      ASSERT_NEAR(expected, values[myhand], 1e-12)
+          << "pub_hand=" << pub_hand << " myhand=" << myhand;
+    }
+  }
 }
 
-TEST(FictiousTest, TestOneDiceOneFaceLinear) {
-  const int num_dice = 1;
-  const int num_faces = 1;
+
+TEST(FictiousTest, TestFullGame) {
   SubgameSolvingParams params;
-  params.num_iters = 3500;
+  params.num_iters = 10000;
   params.max_depth = 100;
-  params.linear_update = true;
-  Game game(num_dice, num_faces);
+  const Game game(2, 6);
 
-  const auto root = game.get_initial_state();
+  const auto root = game.get_initial_state(/*public_hand=*/17);
 
   const auto initial_beliefs = get_initial_beliefs(game);
-  ASSERT_EQ(game.num_hands(), 1);
-  ASSERT_EQ(initial_beliefs[0][0], 1.0);
   const auto value =
       compute_fp_exploitability(game, root, initial_beliefs, params);
   ASSERT_GE(value, 0.0);
   ASSERT_LT(value, 1e-3);
 }
 
-TEST(FictiousTest, TestOneDiceTwoFaces) {
-  const int num_dice = 1;
-  const int num_faces = 2;
+TEST(FictiousTest, TestFullGameLinear) {
   SubgameSolvingParams params;
   params.num_iters = 10000;
-  params.max_depth = 1000;
-  Game game(num_dice, num_faces);
+  params.max_depth = 100;
+  params.linear_update = true;
+  const Game game(2, 6);
 
-  const auto root = game.get_initial_state();
+  const auto root = game.get_initial_state(/*public_hand=*/17);
 
   const auto initial_beliefs = get_initial_beliefs(game);
   const auto value =
@@ -201,17 +309,15 @@ TEST(FictiousTest, TestOneDiceTwoFaces) {
   ASSERT_LT(value, 1e-3);
 }
 
-TEST(CFRTest, TestOneDiceTwoFacesCfr) {
-  const int num_dice = 1;
-  const int num_faces = 2;
+TEST(CFRTest, TestFullGameCfr) {
   SubgameSolvingParams params;
-  params.num_iters = 180;
-  params.max_depth = 1000;
+  params.num_iters = 1000;
+  params.max_depth = 100;
   params.linear_update = true;
   params.use_cfr = true;
-  Game game(num_dice, num_faces);
+  const Game game(2, 6);
 
-  const auto root = game.get_initial_state();
+  const auto root = game.get_initial_state(/*public_hand=*/17);
 
   const auto initial_beliefs = get_initial_beliefs(game);
   const auto value =
@@ -220,16 +326,13 @@ TEST(CFRTest, TestOneDiceTwoFacesCfr) {
   ASSERT_LT(value, 1e-3);
 }
 
-TEST(CFRTest, TestOneDiceTwoFacesCfrRegrets) {
-  const int num_dice = 1;
-  const int num_faces = 2;
-
+TEST(CFRTest, TestFullGameCfrRegrets) {
   SubgameSolvingParams params;
   params.num_iters = 4000;
-  params.max_depth = 1000;
+  params.max_depth = 100;
   params.use_cfr = true;
   params.linear_update = false;
-  Game game(num_dice, num_faces);
+  const Game game(2, 6);
 
   auto solver = build_solver(game, params);
   std::vector<TreeStrategy> strategies;
@@ -249,68 +352,383 @@ TEST(CFRTest, TestOneDiceTwoFacesCfrRegrets) {
   }
 }
 
-TEST(FictiousTest, TestOneDiceThreeFacesLinear) {
-  const int num_dice = 1;
-  const int num_faces = 3;
+TEST(CFRTest, TestLayoutsMatch) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
   SubgameSolvingParams params;
-  params.num_iters = 1 << 12;
-  params.max_depth = 1000;
+  params.num_iters = 50;
+  params.max_depth = 100;
+  for (bool use_cfr : {true, false}) {
+    params.use_cfr = use_cfr;
+    params.linear_update = true;
+    auto hand_major = build_solver<HandMajor>(
+        game, root, get_initial_beliefs(game), params, /*net=*/nullptr);
+    auto action_major = build_solver<ActionMajor>(
+        game, root, get_initial_beliefs(game), params, /*net=*/nullptr);
+    hand_major->multistep();
+    action_major->multistep();
+    const auto& expected = hand_major->get_strategy();
+    const auto& actual = action_major->get_strategy();
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t node = 0; node < expected.size(); ++node) {
+      for (int hand = 0; hand < game.num_hands(); ++hand) {
+        for (int action = 0; action < game.num_actions(); ++action) {
+          ASSERT_EQ(expected[node][hand][action], actual[node][hand][action]);
+        }
+      }
+    }
+    ASSERT_EQ(hand_major->get_hand_values(0), action_major->get_hand_values(0));
+  }
+}
+
+TEST(CFRTest, TestStrategiesFollowSteps) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
+  SubgameSolvingParams params;
+  params.num_iters = 6;
+  params.max_depth = 100;
+  params.use_cfr = true;
   params.linear_update = true;
-  Game game(num_dice, num_faces);
+  auto hand_major = build_solver<HandMajor>(
+      game, root, get_initial_beliefs(game), params, /*net=*/nullptr);
+  auto action_major = build_solver<ActionMajor>(
+      game, root, get_initial_beliefs(game), params, /*net=*/nullptr);
+  const TreeStrategy* sampling = &action_major->get_sampling_strategy();
+  for (int iter = 0; iter < params.num_iters; ++iter) {
+    hand_major->step(iter % 2);
+    action_major->step(iter % 2);
+    // The strategies are converted again after every step, into the same
+    // buffers, and the sampling and belief strategies are the same one.
+    ASSERT_EQ(&action_major->get_sampling_strategy(), sampling);
+    ASSERT_EQ(&action_major->get_belief_propogation_strategy(), sampling);
+    expect_strategies_eq(game, hand_major->get_sampling_strategy(),
+                         *sampling);
+    expect_strategies_eq(game, hand_major->get_strategy(),
+                         action_major->get_strategy());
+  }
+  action_major->reset(root, get_initial_beliefs(game));
+  hand_major->reset(root, get_initial_beliefs(game));
+  expect_strategies_eq(game, hand_major->get_strategy(),
+                       action_major->get_strategy());
+}
 
-  const auto root = game.get_initial_state();
-  const auto initial_beliefs = get_initial_beliefs(game);
-  const auto value =
-      compute_fp_exploitability(game, root, initial_beliefs, params);
-  ASSERT_GE(value, 0.0);
-  ASSERT_LT(value, 2e-3);
+TEST(SolverPoolTest, TestMatchesFreshSolvers) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
+  const auto child = game.act(root, game.get_bid_range(root).first);
+  // Initial states share a tree shape, so only two solvers are built.
+  const std::vector<PartialPublicState> roots = {
+      root, game.get_initial_state(/*public_hand=*/100), root, child, child};
+  SubgameSolvingParams params;
+  params.num_iters = 20;
+  params.max_depth = 100;
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<double> dist(0.1, 1.0);
+  for (bool use_cfr : {true, false}) {
+    params.use_cfr = use_cfr;
+    SolverPool pool(game, params, /*net=*/nullptr);
+    for (const auto& state : roots) {
+      auto beliefs = get_initial_beliefs(game);
+      for (auto& player_beliefs : beliefs) {
+        for (auto& belief : player_beliefs) belief = dist(gen);
+        player_beliefs = normalize_probabilities_safe(player_beliefs, 0.0);
+      }
+      auto fresh = build_solver(game, state, beliefs, params, /*net=*/nullptr);
+      auto pooled = pool.acquire(state, beliefs);
+      fresh->multistep();
+      pooled->multistep();
+      const auto& expected = fresh->get_strategy();
+      const auto& actual = pooled->get_strategy();
+      ASSERT_EQ(expected.size(), actual.size());
+      for (size_t node = 0; node < expected.size(); ++node) {
+        for (int hand = 0; hand < game.num_hands(); ++hand) {
+          for (int action = 0; action < game.num_actions(); ++action) {
+            ASSERT_EQ(expected[node][hand][action],
+                      actual[node][hand][action]);
+          }
+        }
+      }
+      ASSERT_EQ(fresh->get_hand_values(0), pooled->get_hand_values(0));
+      ASSERT_EQ(fresh->get_hand_values(1), pooled->get_hand_values(1));
+    }
+    ASSERT_EQ(pool.size(), 2);
+  }
 }
 
-TEST(FictiousTest, TestOneDiceThreeFacesLinearEV) {
-  const int num_dice = 1;
-  const int num_faces = 3;
+TEST(CFRTest, TestBatchedMatchesPerHand) {
+  const Game game(2, 6);
+  const std::vector<int> public_hands = {0, 17, 152, 215};
+  SubgameSolvingParams params;
+  params.num_iters = 30;
+  params.max_depth = 100;
+  params.use_cfr = true;
+  for (bool linear_update : {true, false}) {
+    params.linear_update = linear_update;
+    auto batched = build_batched_full_game_solver(game, public_hands, params);
+    batched->multistep();
+    ASSERT_EQ(batched->num_public_hands(), public_hands.size());
+    for (size_t i = 0; i < public_hands.size(); ++i) {
+      auto solver = build_solver(game, game.get_initial_state(public_hands[i]),
+                                 get_initial_beliefs(game), params,
+                                 /*net=*/nullptr);
+      solver->multistep();
+      const auto& expected = solver->get_strategy();
+      const auto actual = batched->get_strategy(i);
+      ASSERT_EQ(expected.size(), actual.size());
+      for (size_t node = 0; node < expected.size(); ++node) {
+        for (int hand = 0; hand < game.num_hands(); ++hand) {
+          for (int action = 0; action < game.num_actions(); ++action) {
+            ASSERT_EQ(expected[node][hand][action],
+                      actual[node][hand][action]);
+          }
+        }
+      }
+      ASSERT_EQ(solver->get_hand_values(0), batched->get_hand_values(i, 0));
+      ASSERT_EQ(solver->get_hand_values(1), batched->get_hand_values(i, 1));
+    }
+  }
+}
+
+TEST(CFRTest, TestPruning) {
+  const Game game(2, 6);
+  const int public_hand = 17;
+  const auto root = game.get_initial_state(public_hand);
+  SubgameSolvingParams params;
+  params.num_iters = 1000;
+  params.max_depth = 100;
+  params.use_cfr = true;
+  params.linear_update = true;
+  auto full = build_solver(game, root, get_initial_beliefs(game), params,
+                           /*net=*/nullptr);
+  full->multistep();
+  params.prune_threshold = 1e-3;
+  auto pruned = build_solver(game, root, get_initial_beliefs(game), params,
+                             /*net=*/nullptr);
+  pruned->multistep();
+  EXPECT_EQ(full->get_num_pruned_updates(), 0);
+  EXPECT_GT(pruned->get_num_pruned_updates(), 0);
+  const auto full_exploitability =
+      compute_exploitability2(game, full->get_strategy(), public_hand);
+  const auto pruned_exploitability =
+      compute_exploitability2(game, pruned->get_strategy(), public_hand);
+  EXPECT_LT(pruned_exploitability[0] + pruned_exploitability[1], 0.01);
+  EXPECT_LT(full_exploitability[0] + full_exploitability[1], 0.01);
+
+  // Only full passes are the same as no pruning.
+  params.prune_full_pass_interval = 1;
+  auto unpruned = build_solver(game, root, get_initial_beliefs(game), params,
+                               /*net=*/nullptr);
+  unpruned->multistep();
+  EXPECT_EQ(unpruned->get_num_pruned_updates(), 0);
+  EXPECT_EQ(unpruned->get_hand_values(0), full->get_hand_values(0));
+  EXPECT_EQ(unpruned->get_hand_values(1), full->get_hand_values(1));
+
+  // DCFR discounts negative regrets harder than the linear update.
+  params.prune_full_pass_interval = 10;
+  params.linear_update = false;
+  params.dcfr = true;
+  params.dcfr_alpha = 1.5;
+  params.dcfr_beta = 0;
+  params.dcfr_gamma = 2;
+  auto dcfr = build_solver(game, root, get_initial_beliefs(game), params,
+                           /*net=*/nullptr);
+  dcfr->multistep();
+  EXPECT_GT(dcfr->get_num_pruned_updates(), 0);
+  const auto dcfr_exploitability =
+      compute_exploitability2(game, dcfr->get_strategy(), public_hand);
+  EXPECT_LT(dcfr_exploitability[0] + dcfr_exploitability[1], 0.01);
+}
+
+TEST(CFRTest, TestPruningRejectsBadInterval) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
+  SubgameSolvingParams params;
+  params.max_depth = 100;
+  params.use_cfr = true;
+  params.prune_full_pass_interval = 0;
+  // The interval is only used with pruning.
+  EXPECT_NO_THROW(build_solver(game, root, get_initial_beliefs(game), params,
+                               /*net=*/nullptr));
+  params.prune_threshold = 1e-3;
+  for (int interval : {0, -1}) {
+    params.prune_full_pass_interval = interval;
+    EXPECT_THROW(build_solver(game, root, get_initial_beliefs(game), params,
+                              /*net=*/nullptr),
+                 std::invalid_argument);
+  }
+}
+
+TEST(CFRTest, TestFloatPrecision) {
+  const Game game(2, 6);
+  const int public_hand = 17;
+  const auto root = game.get_initial_state(public_hand);
+  SubgameSolvingParams params;
+  params.num_iters = 1000;
+  params.max_depth = 100;
+  params.use_cfr = true;
+  params.linear_update = true;
+  auto reference = build_solver(game, root, get_initial_beliefs(game), params,
+                                /*net=*/nullptr);
+  reference->multistep();
+  params.use_float = true;
+  for (bool float_accumulators : {false, true}) {
+    params.float_accumulators = float_accumulators;
+    for (auto& solver :
+         {build_solver<HandMajor>(game, root, get_initial_beliefs(game),
+                                  params, /*net=*/nullptr),
+          build_solver<ActionMajor>(game, root, get_initial_beliefs(game),
+                                    params, /*net=*/nullptr)}) {
+      solver->multistep();
+      const auto exploitability =
+          compute_exploitability2(game, solver->get_strategy(), public_hand);
+      EXPECT_LT(exploitability[0] + exploitability[1], 0.01);
+      for (int player : {0, 1}) {
+        const auto values = solver->get_hand_values(player);
+        const auto expected = reference->get_hand_values(player);
+        for (int hand = 0; hand < game.num_hands(); ++hand) {
+          EXPECT_NEAR(values[hand], expected[hand], 1e-2);
+        }
+      }
+    }
+  }
+}
+
+TEST(CFRTest, TestLeafValuesInPlace) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
+  SubgameSolvingParams params;
+  params.num_iters = 20;
+  params.max_depth = 2;
+  params.use_cfr = true;
+  auto copying_net = std::make_shared<QueryDependentNet>(/*in_place=*/false);
+  auto in_place_net = std::make_shared<QueryDependentNet>(/*in_place=*/true);
+  auto copying = build_solver(game, root, get_initial_beliefs(game), params,
+                              copying_net);
+  auto in_place = build_solver(game, root, get_initial_beliefs(game), params,
+                               in_place_net);
+  copying->multistep();
+  in_place->multistep();
+  EXPECT_EQ(in_place->get_hand_values(0), copying->get_hand_values(0));
+  EXPECT_EQ(in_place->get_hand_values(1), copying->get_hand_values(1));
+  // Every query writes to the same solver-owned buffer.
+  ASSERT_EQ(in_place_net->output_buffers.size(),
+            static_cast<size_t>(params.num_iters));
+  for (float* buffer : in_place_net->output_buffers) {
+    EXPECT_EQ(buffer, in_place_net->output_buffers.front());
+  }
+}
+
+TEST(CFRTest, TestAsyncLeafValuesMatch) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
+  SubgameSolvingParams params;
+  params.num_iters = 20;
+  params.max_depth = 2;
+  for (bool use_cfr : {true, false}) {
+    params.use_cfr = use_cfr;
+    auto sync_net = std::make_shared<QueryDependentNet>(/*in_place=*/true);
+    auto async_net = std::make_shared<AsyncQueryDependentNet>();
+    auto sync = build_solver(game, root, get_initial_beliefs(game), params,
+                             sync_net);
+    auto async = build_solver(game, root, get_initial_beliefs(game), params,
+                              async_net);
+    sync->multistep();
+    async->multistep();
+    EXPECT_EQ(async->get_hand_values(0), sync->get_hand_values(0));
+    EXPECT_EQ(async->get_hand_values(1), sync->get_hand_values(1));
+    EXPECT_GE(async_net->num_async_queries, params.num_iters);
+  }
+}
+
+TEST(CFRTest, TestPendingQueryIsWaitedFor) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
+  SubgameSolvingParams params;
+  params.num_iters = 4;
+  params.max_depth = 2;
+  params.use_cfr = true;
+  auto net = std::make_shared<SlowPromiseNet>();
+  auto solver =
+      build_solver(game, root, get_initial_beliefs(game), params, net);
+  // The query is still running, so the step is not ready.
+  EXPECT_FALSE(solver->prepare_step(/*traverser=*/0));
+  // The buffers the query writes to go away with the solver.
+  solver.reset();
+  EXPECT_EQ(net->num_finished, 1);
+}
+
+TEST(CFRTest, TestParallelTraversalMatches) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*public_hand=*/17);
+  SubgameSolvingParams params;
+  params.num_iters = 30;
+  params.max_depth = 100;
+  params.linear_update = true;
+  for (bool use_cfr : {true, false}) {
+    params.use_cfr = use_cfr;
+    params.num_threads = 1;
+    auto serial = build_solver(game, root, get_initial_beliefs(game), params,
+                               /*net=*/nullptr);
+    params.num_threads = 4;
+    auto parallel = build_solver(game, root, get_initial_beliefs(game), params,
+                                 /*net=*/nullptr);
+    serial->multistep();
+    parallel->multistep();
+    const auto& expected = serial->get_strategy();
+    const auto& actual = parallel->get_strategy();
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t node = 0; node < expected.size(); ++node) {
+      for (int hand = 0; hand < game.num_hands(); ++hand) {
+        for (int action = 0; action < game.num_actions(); ++action) {
+          ASSERT_EQ(expected[node][hand][action], actual[node][hand][action]);
+        }
+      }
+    }
+    ASSERT_EQ(serial->get_hand_values(0), parallel->get_hand_values(0));
+    ASSERT_EQ(serial->get_hand_values(1), parallel->get_hand_values(1));
+  }
+}
+
+TEST(FictiousTest, TestFullGameLinearEV) {
   SubgameSolvingParams params;
   params.num_iters = 1 << 12;
-  params.max_depth = 1000;
+  params.max_depth = 100;
   params.linear_update = true;
-  Game game(num_dice, num_faces);
+  const Game game(2, 6);
 
   auto solver = build_solver(game, params);
   solver->multistep();
   const auto values =
       compute_ev2(game, solver->get_strategy(), solver->get_strategy());
-  std::cout << values[0] << " " << values[1] << "\n";
-  ASSERT_LE(values[0], 2.);
-  ASSERT_GE(values[0], -2.);
+  ASSERT_LE(values[0], game.max_bid);
+  ASSERT_GE(values[0], -game.max_bid);
   ASSERT_NEAR(values[0] + values[1], 0., 1e-6);
 }
 
-TEST(FictiousTest, TestOneDiceFourFacesOracleNet) {
-  const int num_dice = 1;
-  const int num_faces = 3;
+TEST(FictiousTest, TestOracleNet) {
   SubgameSolvingParams params;
-  params.num_iters = 1 << 12;
-  params.max_depth = 5;
+  params.num_iters = 1 << 8;
+  params.max_depth = 2;
   params.linear_update = true;
-  Game game(num_dice, num_faces);
+  const Game game(2, 6);
 
   SubgameSolvingParams oracle_net_params = params;
-  params.max_depth = 50;
+  oracle_net_params.max_depth = 100;
 
-  const auto root = game.get_initial_state();
+  const auto root = game.get_initial_state(/*public_hand=*/17);
   const auto initial_beliefs = get_initial_beliefs(game);
   auto net = create_oracle_value_predictor(game, oracle_net_params);
   const auto value =
       compute_fp_exploitability(game, root, initial_beliefs, params, net);
+  // Depth-limited FP does not reach the full game equilibrium even with exact
+  // leaf values, so this only bounds the exploitability (about 0.37).
   ASSERT_GE(value, 0.0);
-  ASSERT_LT(value, 2e-3);
+  ASSERT_LT(value, 0.5);
 }
 
 TEST(QueryTest, TestQueryDeserialization) {
-  const int num_dice = 1;
-  const int num_faces = 3;
-  Game game(num_dice, num_faces);
-  const auto tree = unroll_tree(game);
+  const Game game(2, 6);
+  const auto tree = unroll_tree(game, /*pub_hand=*/17);
   std::vector<double> beliefs1, beliefs2;
   for (int i = 0; i < game.num_hands(); ++i) beliefs1.push_back(i);
   for (int i = 0; i < game.num_hands(); ++i) beliefs2.push_back(i + 0.5);
@@ -326,9 +744,8 @@ TEST(QueryTest, TestQueryDeserialization) {
       const auto [deserialized_traverser, deserialized_state,
                   deserialized_beliefs1, deserialized_beliefs2] =
           deserialize_query(game, query.data());
-      ASSERT_EQ(state.player_id, deserialized_state.player_id);
+      ASSERT_EQ(state, deserialized_state);
       ASSERT_EQ(traverser, deserialized_traverser);
-      ASSERT_EQ(state.last_bid, deserialized_state.last_bid);
       for (int i = 0; i < game.num_hands(); ++i) {
         ASSERT_NEAR(beliefs1[i], deserialized_beliefs1[i], 1e-6);
         ASSERT_NEAR(beliefs2[i], deserialized_beliefs2[i], 1e-6);
@@ -351,7 +768,68 @@ TEST(UtilsTest, TestProbNormalizationFloat) {
   ASSERT_NEAR(vector_sum(out), 1.0, 1e-10);
 }
 
+TEST(CfrKernelsTest, TestMatchesScalar) {
+  const int num_actions = 3;
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<double> dist(-1, 1);
+  // Odd hand counts exercise the scalar tail after the vector lanes.
+  for (int num_hands : {1, 4, 7, 36, 37}) {
+    for (int action_begin : {0, 1}) {
+      const int size = num_hands * num_actions;
+      std::vector<double> regrets(size), sums(size), reaches(num_hands);
+      for (auto& r : regrets) r = dist(gen);
+      for (auto& s : sums) s = std::abs(dist(gen)) + 0.1;
+      for (auto& r : reaches) r = std::abs(dist(gen));
+
+      std::vector<double> strategy(size), expected_strategy(size);
+      regret_matching(regrets.data(), num_hands, num_actions, action_begin,
+                      num_actions, kRegretSmoothingEps, strategy.data());
+      regret_matching_scalar(regrets.data(), num_hands, num_actions,
+                             action_begin, num_actions, kRegretSmoothingEps,
+                             expected_strategy.data());
+
+      auto expected_regrets = regrets, expected_sums = sums;
+      std::vector<double> average(size), expected_average(size);
+      discount_and_accumulate(regrets.data(), sums.data(), average.data(),
+                              strategy.data(), reaches.data(), num_hands,
+                              num_actions, action_begin, num_actions, 0.9, 0.5,
+                              0.8);
+      discount_and_accumulate_scalar(
+          expected_regrets.data(), expected_sums.data(),
+          expected_average.data(), expected_strategy.data(), reaches.data(),
+          num_hands, num_actions, action_begin, num_actions, 0.9, 0.5, 0.8);
+      for (int i = 0; i < size; ++i) {
+        ASSERT_NEAR(strategy[i], expected_strategy[i], 1e-12);
+        ASSERT_NEAR(regrets[i], expected_regrets[i], 1e-12);
+        ASSERT_NEAR(sums[i], expected_sums[i], 1e-12);
+        ASSERT_NEAR(average[i], expected_average[i], 1e-12);
+      }
+    }
+  }
+}
 
+TEST(PokerScoreTest, TestShowdownRanking) {
+  Game game(2, 6);
+  ASSERT_EQ(game.num_public_hands(), 216);
+  for (int pub_hand = 0; pub_hand < game.num_public_hands(); ++pub_hand) {
+    const auto ranking = game.showdown_ranking(pub_hand);
+    ASSERT_EQ(ranking.class_begin[0], 0);
+    ASSERT_EQ(ranking.class_begin[ranking.num_classes], game.num_hands());
+    for (int c = 0; c < ranking.num_classes; ++c) {
+      const int begin = ranking.class_begin[c], end = ranking.class_begin[c + 1];
+      ASSERT_LT(begin, end);
+      for (int i = begin; i < end; ++i) {
+        ASSERT_EQ(game.utility(ranking.order[i], ranking.order[begin], pub_hand),
+                  0.5);
+      }
+      if (c > 0) {
+        ASSERT_EQ(game.utility(ranking.order[begin], ranking.order[begin - 1],
+                               pub_hand),
+                  1.0);
+      }
+    }
+  }
+}
 
 int to_score(int a, int b, int c, int d, int e)
 {
@@ -0,0 +1,129 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace poker_dice {
+
+// Fixed set of threads that runs parallel loops for a single caller.
+//
+// The items of a loop are claimed one at a time from a shared counter, so a
+// thread that is done with its items takes over the remaining items of slower
+// threads instead of waiting for them. The calling thread works on the loop
+// too.
+class ThreadPool {
+ public:
+  // Starts num_threads - 1 workers.
+  explicit ThreadPool(int num_threads) {
+    for (int i = 1; i < num_threads; ++i) {
+      workers_.emplace_back([this] { worker_loop(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  int num_threads() const { return workers_.size() + 1; }
+
+  // Calls fn(i) for every i in [0, n) and waits for all the calls to finish.
+  // Rethrows the first exception thrown by fn.
+  void parallel_for(int64_t n, const std::function<void(int64_t)>& fn) {
+    if (workers_.empty() || n <= 1) {
+      for (int64_t i = 0; i < n; ++i) fn(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      fn_ = &fn;
+      num_items_ = n;
+      next_item_ = 0;
+      error_ = nullptr;
+      num_busy_workers_ = workers_.size();
+      ++generation_;
+    }
+    cv_.notify_all();
+    run_items();
+    std::unique_lock<std::mutex> lk(mutex_);
+    done_cv_.wait(lk, [this] { return num_busy_workers_ == 0; });
+    fn_ = nullptr;
+    if (error_) std::rethrow_exception(error_);
+  }
+
+ private:
+  void run_items() {
+    for (int64_t i = next_item_++; i < num_items_; i = next_item_++) {
+      try {
+        (*fn_)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (!error_) error_ = std::current_exception();
+        // Skip the remaining items.
+        next_item_ = num_items_;
+      }
+    }
+  }
+
+  void worker_loop() {
+    int64_t seen_generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        cv_.wait(lk, [&] { return stop_ || generation_ != seen_generation; });
+        if (stop_) return;
+        seen_generation = generation_;
+      }
+      run_items();
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (--num_busy_workers_ == 0) done_cv_.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable done_cv_;
+  bool stop_ = false;
+  int64_t generation_ = 0;
+  int num_busy_workers_ = 0;
+
+  // The current loop. Set under mutex_ before the workers are woken up.
+  const std::function<void(int64_t)>* fn_ = nullptr;
+  int64_t num_items_ = 0;
+  std::atomic<int64_t> next_item_{0};
+  std::exception_ptr error_;
+};
+
+}  // namespace poker_dice
@@ -16,6 +16,10 @@
 
 #pragma once
 
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -48,11 +52,12 @@ struct UnrolledTreeNode {
 
 // Builds a BFS tree of this depth. For max_depth=0 the tree will contain only
 // the root. For max_depth=1 - root and its children. And so on.
-inline std::vector<UnrolledTreeNode> unroll_tree(const Game& game,
-                                                 const PartialPublicState& root,
-                                                 int max_depth) {
+// Overwrites `tree`, reusing its storage.
+inline void unroll_tree(const Game& game, const PartialPublicState& root,
+                        int max_depth, std::vector<UnrolledTreeNode>* tree) {
   assert(max_depth >= 0);  // Cannot build an empty tree.
-  std::vector<UnrolledTreeNode> nodes;
+  auto& nodes = *tree;
+  nodes.clear();
   nodes.push_back(UnrolledTreeNode{root, 0, 0, -1, 0});
   for (int node_id = 0; node_id < static_cast<int>(nodes.size()) &&
                         nodes[node_id].depth < max_depth;
@@ -69,6 +74,13 @@ inline std::vector<UnrolledTreeNode> unroll_tree(const Game& game,
       //std::cout << game.state_to_string(state) << std::endl;
     }
   }
+}
+
+inline std::vector<UnrolledTreeNode> unroll_tree(const Game& game,
+                                                 const PartialPublicState& root,
+                                                 int max_depth) {
+  std::vector<UnrolledTreeNode> nodes;
+  unroll_tree(game, root, max_depth, &nodes);
   return nodes;
 }
 
@@ -77,6 +89,58 @@ inline std::vector<UnrolledTreeNode> unroll_tree(const Game& game, int pub_hand)
   return unroll_tree(game, game.get_initial_state(pub_hand), game.max_depth());
 }
 
+// Thread-safe cache of unrolled trees. A tree is fully determined by the
+// game, the root, and max_depth, so the trees are immutable and shared
+// between all users. Entries are never evicted: poker dice has few enough
+// distinct roots for the cache to stay small.
+class TreeCache {
+ public:
+  std::shared_ptr<const Tree> get(const Game& game,
+                                  const PartialPublicState& root,
+                                  int max_depth) {
+    const Key key{game.num_dice,  game.num_faces, root.hand, root.last_bid,
+                  root.event,     root.player_id, max_depth};
+    {
+      std::lock_guard<std::mutex> lk(mutex_);
+      auto it = trees_.find(key);
+      if (it != trees_.end()) return it->second;
+    }
+    // Build outside of the lock. If another thread builds the same tree
+    // concurrently, the first inserted copy wins.
+    auto tree = std::make_shared<const Tree>(unroll_tree(game, root, max_depth));
+    std::lock_guard<std::mutex> lk(mutex_);
+    return trees_.emplace(key, std::move(tree)).first->second;
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return trees_.size();
+  }
+
+  // Cache shared by the whole process.
+  static TreeCache& instance() {
+    static TreeCache cache;
+    return cache;
+  }
+
+ private:
+  using Key = std::tuple<int, int, int, Action, int, int, int>;
+
+  std::mutex mutex_;
+  std::map<Key, std::shared_ptr<const Tree>> trees_;
+};
+
+inline std::shared_ptr<const Tree> get_cached_tree(
+    const Game& game, const PartialPublicState& root, int max_depth) {
+  return TreeCache::instance().get(game, root, max_depth);
+}
+
+inline std::shared_ptr<const Tree> get_cached_tree(const Game& game,
+                                                   int pub_hand) {
+  return get_cached_tree(game, game.get_initial_state(pub_hand),
+                         game.max_depth());
+}
+
 // Creates iterator over children nodes and corresponding actions.
 // Usage:
 //   for (auto[child_node_id, action] : ChildrenActionIt(node, game)) {
@@ -132,4 +196,62 @@ struct ChildrenIt {
   State begin() const { return State(node.children_begin); }
   State end() const { return State(node.children_end); }
 };
+
+// Per-node index arrays of a BFS tree, grouped by depth. Passes that visit a
+// whole depth level at a time read these dense arrays instead of the nodes
+// and their states.
+struct TreeLevels {
+  // Nodes of depth d are [level_offsets[d], level_offsets[d + 1]).
+  std::vector<int> level_offsets;
+  // Indexed by node. The root has parent -1 and action -1.
+  std::vector<int> parents;
+  std::vector<int> children_begin;
+  std::vector<int> children_end;
+  std::vector<int> player_ids;
+  // Action that leads from the parent to the node.
+  std::vector<Action> actions;
+
+  int num_levels() const { return level_offsets.size() - 1; }
+  int num_nodes() const { return parents.size(); }
+  int num_children(int node) const {
+    return children_end[node] - children_begin[node];
+  }
+  // Same as Game::get_bid_range for nodes that have children.
+  std::pair<Action, Action> action_range(int node) const {
+    return {actions[children_begin[node]],
+            actions[children_end[node] - 1] + 1};
+  }
+};
+
+// Fills `levels` for `tree`, reusing its storage.
+inline void build_tree_levels(const Game& game, const Tree& tree,
+                              TreeLevels* levels) {
+  const int num_nodes = tree.size();
+  levels->level_offsets.clear();
+  levels->parents.resize(num_nodes);
+  levels->children_begin.resize(num_nodes);
+  levels->children_end.resize(num_nodes);
+  levels->player_ids.resize(num_nodes);
+  levels->actions.assign(num_nodes, -1);
+  for (int node_id = 0; node_id < num_nodes; ++node_id) {
+    const auto& node = tree[node_id];
+    if (node_id == 0 || node.depth != tree[node_id - 1].depth) {
+      levels->level_offsets.push_back(node_id);
+    }
+    levels->parents[node_id] = node.parent;
+    levels->children_begin[node_id] = node.children_begin;
+    levels->children_end[node_id] = node.children_end;
+    levels->player_ids[node_id] = node.state.player_id;
+    for (auto [child, action] : ChildrenActionIt(node, game)) {
+      levels->actions[child] = action;
+    }
+  }
+  levels->level_offsets.push_back(num_nodes);
+}
+
+inline TreeLevels build_tree_levels(const Game& game, const Tree& tree) {
+  TreeLevels levels;
+  build_tree_levels(game, tree, &levels);
+  return levels;
+}
 }  // namespace liars_dice
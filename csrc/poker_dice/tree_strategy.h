@@ -0,0 +1,257 @@
+// Copyright (c) Facebook, Inc. and its affiliates.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contiguous storage for per-node, per-hand, per-action quantities such as
+// strategies and regrets.
+
+#pragma once
+
+#include <assert.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace poker_dice {
+
+// Allocator that aligns buffers to cache lines so that rows can be loaded with
+// aligned vector instructions.
+template <class T, size_t Alignment = 64>
+struct AlignedAllocator {
+  using value_type = T;
+  template <class U>
+  struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() = default;
+  template <class U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(
+        ::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+  }
+  void deallocate(T* p, size_t) {
+    ::operator delete(p, std::align_val_t(Alignment));
+  }
+
+  template <class U>
+  bool operator==(const AlignedAllocator<U, Alignment>&) const {
+    return true;
+  }
+  template <class U>
+  bool operator!=(const AlignedAllocator<U, Alignment>&) const {
+    return false;
+  }
+};
+
+// Non-owning view of `size` consecutive elements.
+template <class T>
+class RowView {
+ public:
+  RowView(T* data, int size) : data_(data), size_(size) {}
+
+  T& operator[](int i) const { return data_[i]; }
+  T* begin() const { return data_; }
+  T* end() const { return data_ + size_; }
+  T* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  T* data_;
+  int size_;
+};
+
+// Non-owning view of a row-major [rows, cols] block.
+template <class T>
+class MatrixView {
+ public:
+  MatrixView(T* data, int rows, int cols)
+      : data_(data), rows_(rows), cols_(cols) {}
+
+  RowView<T> operator[](int row) const {
+    return RowView<T>(data_ + row * cols_, cols_);
+  }
+  T* data() const { return data_; }
+  size_t size() const { return rows_; }
+
+ private:
+  T* data_;
+  int rows_;
+  int cols_;
+};
+
+// Layout policies for BasicTreeStrategy. A policy gives the distance between
+// consecutive hands and consecutive actions inside the block of a node.
+
+// [node][hand][action]: the actions of a hand are contiguous.
+struct HandMajor {
+  static constexpr int hand_stride(int /*num_hands*/, int num_actions) {
+    return num_actions;
+  }
+  static constexpr int action_stride(int /*num_hands*/, int /*num_actions*/) {
+    return 1;
+  }
+};
+
+// [node][action][hand]: the hands of an action are contiguous, so per-hand
+// loops over a fixed action are unit-stride.
+struct ActionMajor {
+  static constexpr int hand_stride(int /*num_hands*/, int /*num_actions*/) {
+    return 1;
+  }
+  static constexpr int action_stride(int num_hands, int /*num_actions*/) {
+    return num_hands;
+  }
+};
+
+// A value for every (node, hand, action) stored in a single aligned buffer.
+// Use at() or action_data() for layout-independent access. The HandMajor
+// layout can additionally be indexed as strategy[node][hand][action] which
+// returns lightweight views, so copying a strategy is a single allocation.
+// Values are doubles unless T says otherwise.
+template <class Layout, class T = double>
+class BasicTreeStrategy {
+ public:
+  using layout = Layout;
+  using value_type = T;
+
+  BasicTreeStrategy() : num_nodes_(0), num_hands_(0), num_actions_(0) {}
+  BasicTreeStrategy(int num_nodes, int num_hands, int num_actions,
+                    T value = T(0))
+      : num_nodes_(num_nodes),
+        num_hands_(num_hands),
+        num_actions_(num_actions),
+        data_(static_cast<size_t>(num_nodes) * num_hands * num_actions,
+              value) {}
+
+  MatrixView<T> operator[](int node) {
+    static_assert(std::is_same<Layout, HandMajor>::value,
+                  "Row access requires the HandMajor layout");
+    return MatrixView<T>(node_data(node), num_hands_, num_actions_);
+  }
+  MatrixView<const T> operator[](int node) const {
+    static_assert(std::is_same<Layout, HandMajor>::value,
+                  "Row access requires the HandMajor layout");
+    return MatrixView<const T>(node_data(node), num_hands_, num_actions_);
+  }
+
+  T& at(int node, int hand, int action) {
+    return node_data(node)[hand * hand_stride() + action * action_stride()];
+  }
+  const T& at(int node, int hand, int action) const {
+    return node_data(node)[hand * hand_stride() + action * action_stride()];
+  }
+
+  // Values of `action` for hand 0, 1, ... are hand_stride() apart.
+  T* action_data(int node, int action) {
+    return node_data(node) + action * action_stride();
+  }
+  const T* action_data(int node, int action) const {
+    return node_data(node) + action * action_stride();
+  }
+
+  int hand_stride() const {
+    return Layout::hand_stride(num_hands_, num_actions_);
+  }
+  int action_stride() const {
+    return Layout::action_stride(num_hands_, num_actions_);
+  }
+
+  // The num_hands * num_actions values of a node.
+  T* node_data(int node) {
+    return data_.data() + static_cast<size_t>(node) * num_hands_ * num_actions_;
+  }
+  const T* node_data(int node) const {
+    return data_.data() + static_cast<size_t>(node) * num_hands_ * num_actions_;
+  }
+
+  // Copies all values of `other_node` in `other` into `node`.
+  void copy_node(int node, const BasicTreeStrategy& other, int other_node) {
+    assert(other.num_hands_ == num_hands_);
+    assert(other.num_actions_ == num_actions_);
+    std::copy_n(other.node_data(other_node), num_hands_ * num_actions_,
+                node_data(node));
+  }
+
+  void fill(T value) { std::fill(data_.begin(), data_.end(), value); }
+
+  // Changes the shape and sets all values to `value`. Does not allocate if
+  // the new size fits into the current buffer.
+  void reset(int num_nodes, int num_hands, int num_actions, T value = T(0)) {
+    num_nodes_ = num_nodes;
+    num_hands_ = num_hands;
+    num_actions_ = num_actions;
+    data_.assign(static_cast<size_t>(num_nodes) * num_hands * num_actions,
+                 value);
+  }
+
+  // Number of nodes. Mirrors std::vector::size() of the nested layout.
+  size_t size() const { return num_nodes_; }
+  int num_nodes() const { return num_nodes_; }
+  int num_hands() const { return num_hands_; }
+  int num_actions() const { return num_actions_; }
+
+  T* data() { return data_.data(); }
+  const T* data() const { return data_.data(); }
+
+ private:
+  int num_nodes_;
+  int num_hands_;
+  int num_actions_;
+  std::vector<T, AlignedAllocator<T>> data_;
+};
+
+using FlatTreeStrategy = BasicTreeStrategy<HandMajor>;
+
+// Returns `strategy` stored in layout `To`.
+template <class To, class From, class T>
+BasicTreeStrategy<To, T> convert_layout(BasicTreeStrategy<From, T> strategy) {
+  if constexpr (std::is_same<To, From>::value) {
+    return strategy;
+  } else {
+    BasicTreeStrategy<To, T> result(strategy.num_nodes(),
+                                    strategy.num_hands(),
+                                    strategy.num_actions());
+    for (int node = 0; node < strategy.num_nodes(); ++node) {
+      for (int hand = 0; hand < strategy.num_hands(); ++hand) {
+        for (int action = 0; action < strategy.num_actions(); ++action) {
+          result.at(node, hand, action) = strategy.at(node, hand, action);
+        }
+      }
+    }
+    return result;
+  }
+}
+
+// Same as above, but writes into `result` reusing its buffer. Also converts
+// the values if the types differ.
+template <class To, class From, class T, class U>
+void convert_layout(const BasicTreeStrategy<From, T>& strategy,
+                    BasicTreeStrategy<To, U>* result) {
+  result->reset(strategy.num_nodes(), strategy.num_hands(),
+                strategy.num_actions());
+  for (int node = 0; node < strategy.num_nodes(); ++node) {
+    for (int hand = 0; hand < strategy.num_hands(); ++hand) {
+      for (int action = 0; action < strategy.num_actions(); ++action) {
+        result->at(node, hand, action) = strategy.at(node, hand, action);
+      }
+    }
+  }
+}
+
+}  // namespace poker_dice
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include "tree.h"
+#include "tree_strategy.h"
 #include <gtest/gtest.h>
 
 using namespace poker_dice;
@@ -123,3 +124,69 @@ TEST(TreeTest, TestTreeIsBreadthFirst) {
     }
   }
 }*/
+
+TEST(TreeTest, TestCachedTree) {
+  const Game game(2, 6);
+  const auto root = game.get_initial_state(/*hand=*/17);
+  const auto cached = get_cached_tree(game, root, /*max_depth=*/2);
+  const auto expected = unroll_tree(game, root, /*max_depth=*/2);
+  ASSERT_EQ(cached->size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    ASSERT_EQ((*cached)[i].state, expected[i].state);
+    ASSERT_EQ((*cached)[i].children_begin, expected[i].children_begin);
+    ASSERT_EQ((*cached)[i].children_end, expected[i].children_end);
+  }
+  // Same root and depth share the instance, other hands do not.
+  EXPECT_EQ(get_cached_tree(game, root, /*max_depth=*/2), cached);
+  EXPECT_NE(get_cached_tree(game, game.get_initial_state(/*hand=*/18), 2),
+            cached);
+  EXPECT_NE(get_cached_tree(game, root, /*max_depth=*/3), cached);
+}
+
+TEST(TreeTest, TestTreeLevels) {
+  const Game game(2, 6);
+  const auto tree = unroll_tree(game, game.get_initial_state(/*hand=*/17),
+                                game.max_depth());
+  const auto levels = build_tree_levels(game, tree);
+  ASSERT_EQ(levels.num_nodes(), tree.size());
+  ASSERT_EQ(levels.level_offsets.front(), 0);
+  ASSERT_EQ(levels.level_offsets.back(), tree.size());
+  for (int level = 0; level < levels.num_levels(); ++level) {
+    for (int node = levels.level_offsets[level];
+         node < levels.level_offsets[level + 1]; ++node) {
+      ASSERT_EQ(tree[node].depth, level);
+    }
+  }
+  for (int node = 0; node < levels.num_nodes(); ++node) {
+    ASSERT_EQ(levels.parents[node], tree[node].parent);
+    ASSERT_EQ(levels.num_children(node), tree[node].num_children());
+    ASSERT_EQ(levels.player_ids[node], tree[node].state.player_id);
+    if (node != 0) {
+      const auto& parent_state = tree[tree[node].parent].state;
+      ASSERT_EQ(levels.actions[node],
+                game.deduce_last_action(tree[node].state, parent_state));
+    }
+    if (tree[node].num_children()) {
+      ASSERT_EQ(levels.action_range(node),
+                game.get_bid_range(tree[node].state));
+    }
+  }
+}
+
+TEST(TreeStrategyTest, TestFlatLayout) {
+  FlatTreeStrategy strategy(/*num_nodes=*/4, /*num_hands=*/3,
+                            /*num_actions=*/2, /*value=*/0.5);
+  ASSERT_EQ(strategy.size(), 4);
+  ASSERT_EQ(strategy[0].size(), 3);
+  ASSERT_EQ(strategy[0][0].size(), 2);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(strategy.data()) % 64, 0);
+  strategy[2][1][1] = 7.0;
+  EXPECT_EQ(strategy.data()[(2 * 3 + 1) * 2 + 1], 7.0);
+
+  FlatTreeStrategy copy = strategy;
+  copy.copy_node(0, strategy, 2);
+  EXPECT_EQ(copy[0][1][1], 7.0);
+  EXPECT_EQ(copy[0][1][0], 0.5);
+  copy[2][1][1] = 1.0;
+  EXPECT_EQ(strategy[2][1][1], 7.0);
+}
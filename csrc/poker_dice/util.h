@@ -21,9 +21,10 @@ namespace poker_dice {
 
 constexpr double kAlmostZero = 1e-200;
 
-template <class T>
-inline double normalize_probabilities(const std::vector<double>& unnormed_probs,
-                                      T* probs) {
+// The templated versions accept any container with begin(), end(), size(),
+// and operator[], e.g., std::vector<double> or a FlatTreeStrategy row.
+template <class Probs, class T>
+inline double normalize_probabilities(const Probs& unnormed_probs, T* probs) {
   const double sum =
       std::accumulate(unnormed_probs.begin(), unnormed_probs.end(), double{0});
   assert(sum >= kAlmostZero);
@@ -45,10 +46,9 @@ inline std::vector<double> normalize_probabilities(
   return probs;
 }
 
-template <class T>
-inline double normalize_probabilities(const std::vector<double>& unnormed_probs,
-                                      const std::vector<double>& last_probs,
-                                      T* probs) {
+template <class Probs, class T>
+inline double normalize_probabilities(const Probs& unnormed_probs,
+                                      const Probs& last_probs, T* probs) {
   const double sum =
       std::accumulate(unnormed_probs.begin(), unnormed_probs.end(), double{0}) +
       std::accumulate(last_probs.begin(), last_probs.end(), double{0});
@@ -65,9 +65,9 @@ inline double normalize_probabilities(const std::vector<double>& unnormed_probs,
   return normalize_probabilities(unnormed_probs, last_probs, probs->data());
 }
 
-template <class T>
-inline void normalize_probabilities_safe(
-    const std::vector<double>& unnormed_probs, double eps, T* probs) {
+template <class Probs, class T>
+inline void normalize_probabilities_safe(const Probs& unnormed_probs,
+                                         double eps, T* probs) {
   double sum = 0;
   for (size_t i = 0; i < unnormed_probs.size(); ++i) {
     sum += unnormed_probs[i] + eps;